@@ -190,6 +190,64 @@ struct comp_packed acpi_iso {
     uint16_t flags;
 };
 
+#define SRAT_ENTRY_PROCESSOR_LAPIC_AFFINITY 0x0
+#define SRAT_ENTRY_MEMORY_AFFINITY 0x1
+#define SRAT_ENTRY_PROCESSOR_X2APIC_AFFINITY 0x2
+
+#define SRAT_AFFINITY_FLAG_ENABLED (1 << 0)
+
+// system resource affinity table
+struct comp_packed acpi_srat {
+    struct acpi_sdt_header header;
+    uint32_t reserved_0;    // 1 for backwards compatibility
+    uint64_t reserved_1;
+    uint8_t entries[];
+};
+
+struct comp_packed acpi_srat_header {
+    uint8_t type;
+    uint8_t length;
+};
+
+struct comp_packed acpi_srat_lapic_affinity {
+    struct acpi_srat_header header;
+    uint8_t proximity_domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t local_sapic_eid;
+    uint8_t proximity_domain_hi[3];
+    uint32_t clock_domain;
+};
+
+struct comp_packed acpi_srat_memory_affinity {
+    struct acpi_srat_header header;
+    uint32_t proximity_domain;
+    uint16_t reserved_0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved_1;
+    uint32_t flags;
+    uint64_t reserved_2;
+};
+
+struct comp_packed acpi_srat_x2apic_affinity {
+    struct acpi_srat_header header;
+    uint16_t reserved_0;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved_1;
+};
+
+// system locality information table, entries[i * count + j] = distance(i, j)
+struct comp_packed acpi_slit {
+    struct acpi_sdt_header header;
+    uint64_t locality_count;
+    uint8_t entries[];
+};
+
+void acpi_early_init(void);
 void parse_acpi(void);
 void *get_sdt(const char signature[static 4]);
 void parse_madt(volatile struct acpi_madt *_madt);
@@ -11,6 +11,7 @@
 #define arch_spin_hint() __asm__ volatile ("pause")
 
 struct task;
+struct per_cpu_pages;
 
 struct task_state_segment {
     uint32_t reserved_0;
@@ -33,11 +34,18 @@ struct task_state_segment {
 typedef struct cpu_local_t {
     size_t id;                      // core id
     uint32_t lapic_id;              // lapic id of the processor
+    size_t numa_node;               // node id (numa.c), memory gets allocated from there
     uint64_t lapic_clock_frequency;
 
     struct task_state_segment tss;
     struct task *idle_thread;
     struct task *curr_thread;
+
+    struct per_cpu_pages *pcp;      // page frame cache (frame_alloc.c)
+    size_t kfence_countdown;        // kmallocs until the next sampled one (kfence.c)
+
+    uintptr_t active_pml4;          // address space in cr3, set before loading it (mmu.c)
+    bool tlb_shootdown_pending;     // flush tlb_request and ack it (mmu.c)
 } cpu_local_t;
 
 static inline uint64_t read_msr(uint32_t reg)
@@ -3,11 +3,14 @@
 #include <limine.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "cpu.h"
 #include "interrupt.h"
+#include "locking.h"
 
-#define BUDDY_HIGH_ORDER (10)
+// 1 GiB blocks
+#define BUDDY_HIGH_ORDER (18)
 #define BUDDY_LOW_ORDER (0)
 
 #define PAGES_1_ORDER (0)
@@ -21,16 +24,59 @@
 #define PAGES_256_ORDER (8)
 #define PAGES_512_ORDER (9)
 #define PAGES_1024_ORDER (10)
+#define PAGES_2M_ORDER (PAGES_512_ORDER)
+#define PAGES_1G_ORDER (18)
 
-#define STRUCT_PAGE_ALIGNMENT (16)
+// movable and unmovable allocations get grouped by pageblocks of this size
+#define PAGEBLOCK_ORDER (PAGES_2M_ORDER)
+#define PAGEBLOCK_PAGES (1ul << PAGEBLOCK_ORDER)
+
+// migrate types of pageblocks and buddy free lists
+#define PAGE_MIGRATE_UNMOVABLE (0)
+#define PAGE_MIGRATE_MOVABLE (1)
+#define PAGE_MIGRATE_TYPES (2)
+
+#define STRUCT_PAGE_ALIGNMENT (32)
+
+// blocks up to this order get cached in per-cpu lists in front of the buddy
+#define PCP_HIGH_ORDER (PAGES_8_ORDER)
+// order 0 pages moved per refill / drain of a per-cpu list (scaled down for higher orders)
+#define PCP_BATCH (16ul)
+
+// pre-zeroed order 0 pages kept per node for page_calloc()
+#define ZERO_POOL_HIGH (1024ul)
+// pages zeroed before checking the pool again
+#define ZERO_POOL_BATCH (32ul)
+#define ZERO_POOL_INTERVAL_MS (20)
+// stop filling the pool when less than 1/n of a nodes memory is free
+#define ZERO_POOL_RESERVE_FRACTION (16ul)
+
+// per node watermarks: below low the reclaim thread gets woken, and it keeps calling the
+// shrinkers until high is reached again. allocations only dip below min as a last resort
+#define WATERMARK_MIN_FRACTION (256ul)
+#define WATERMARK_MIN_PAGES (128ul)
+// pages asked from the shrinkers per reclaim round
+#define RECLAIM_BATCH (128ul)
+#define KSWAPD_INTERVAL_MS (50)
 
 #define PAGE_SIZE (0x1000ul)
 #define PAGE_SHIFT (12ul)
 
-// struct page flag bits (32 bit signed int)
+// struct pages are allocated per section of physical memory (128 MiB), sections
+// without any ram don't get a struct page array
+#define SECTION_SHIFT (27ul)
+#define PFN_SECTION_SHIFT (SECTION_SHIFT - PAGE_SHIFT)
+#define PAGES_PER_SECTION (1ul << PFN_SECTION_SHIFT)
+
+// struct page flag bits (16 bit)
 #define STRUCT_PAGE_FLAG_COMPOSITE_TAIL (1 << 1)
 #define STRUCT_PAGE_FLAG_SLAB_COMPOSITE_HEAD (1 << 2)
 #define STRUCT_PAGE_FLAG_KMALLOC_BUDDY (1 << 3)
+#define STRUCT_PAGE_FLAG_PCP (1 << 4)
+#define STRUCT_PAGE_FLAG_ZEROED (1 << 5)
+#define STRUCT_PAGE_FLAG_BUDDY (1 << 6)     // head of a free buddy block, order in page->order
+#define STRUCT_PAGE_FLAG_MOVABLE (1 << 7)   // movable page, or free block on a movable list
+#define STRUCT_PAGE_FLAG_SHARED (1 << 8)    // frame with several owners, lifetime in page->refcount
 
 // config allocator (don't move this)
 // xxx_BUDDY and xxx_BITMAP are configurable
@@ -44,7 +90,24 @@
 
 struct page;
 
-extern struct page *pages;
+// owner of movable pages (see page_alloc_movable()). compaction copies a page with
+// lock held, and calls migrate, so the owner can replace its references to old with new
+struct page_mapping {
+    k_spinlock_t lock;      // hold while using the pages of this mapping
+    void *private;          // owner data
+    void (*migrate)(struct page_mapping *mapping, size_t index, struct page *old, struct page *new);
+};
+
+// one entry per section of the physical address space
+struct mem_section {
+    // struct page array of this section, minus the first pfn of the section,
+    // so it can be indexed with the pfn directly. NULL if the section has no ram
+    struct page *mem_map;
+};
+
+extern struct mem_section *mem_sections;
+extern size_t mem_section_count;
+// highest pfn + 1
 extern size_t pages_count;
 // copy of limines memmap
 extern struct memmap_entry *memmap;
@@ -60,34 +123,50 @@ struct early_mem_alloc_mapping {
 extern struct early_mem_alloc_mapping early_mem_mappings[];
 extern size_t early_mem_allocations;
 
-// current size: 40 bytes
+// links between struct pages are stored as pfns, to keep struct page small
+#define PAGE_LINK_NONE (UINT32_MAX)
+#define PAGE_LINK_POISON (0xDEADBEEFu)
+
+// current size: 32 bytes, two struct pages per cache line.
+// the array gets touched on every alloc / free / kfree, keep it that way
 struct page {
-    int32_t flags;  // make sure to have these set correctly
+    uint16_t flags;     // make sure to have these set correctly
+    uint8_t order;      // order of a kmalloc buddy allocation
+    uint8_t node;       // numa node the frame belongs to, set once in buddy_init()
+    uint16_t section;   // mem_sections index, set once in early_mem_init()
+    uint16_t unused;    // for alignment
     union {
-        struct {    // buddy allocator free list
-            struct page *next;
-            struct page *prev;
+        struct {    // buddy allocator free list / per-cpu list (pfns)
+            uint32_t next;
+            uint32_t prev;
         };
         struct {    // for slab, theres a seperately defined structure (sync this up!)
-            void *slab_next;            // struct page *
-            void *slab_prev;            // struct page *
+            uint32_t slab_next;         // pfn
+            uint32_t slab_prev;         // pfn
             void *this_cache;           // struct slab_cache *this_cache;
-            void *freelist;             // pointer to first object
+            uint32_t freelist;          // offset of the first free object into the slab
             uint16_t used_objs;
             uint16_t total_objs;
         };
-        struct {    // slab buddy page
-            size_t order;
+        struct {    // page table (mmu.c), freed on unmap once it's empty
+            uint32_t pt_used;           // present entries
+        };
+        struct {    // movable page, or a frame mapped into address spaces
+            struct page_mapping *mapping;
+            uint32_t index;             // index of this page in the mapping
+            uint32_t refcount;          // owners, mappings included (STRUCT_PAGE_FLAG_SHARED)
         };
         struct {    // composite page:
                     // if page is part of a composite page,
-                    // we can use this to save a reference to
+                    // we can use this to save the pfn of
                     // the head of the composite page
-            struct page *comp_head;
+            uint32_t comp_head;
         };
     };
 } comp_aligned(STRUCT_PAGE_ALIGNMENT);
 
+_Static_assert(sizeof(struct page) == 32, "struct page grew, check the union members");
+
 // fill this structure up with phys_stat_memory(struct phys_mem_stat *stat),
 // so atomicity is guaranteed
 struct phys_mem_stat {
@@ -102,13 +181,82 @@ struct memmap_entry {
     size_t type;
 };
 
+// per-cpu cache of free blocks of one order
+struct pcp_list {
+    struct page *head, *tail;   // hot blocks at head, cold blocks at tail
+    size_t count;
+};
+
+// referenced by cpu_local_t, allocated with page_pcp_init_cpu()
+struct per_cpu_pages {
+    struct pcp_list lists[PCP_HIGH_ORDER + 1];
+};
+
+// caches that can give memory back under pressure. count returns how many pages
+// could be freed right now, scan tries to free nr pages and returns how many it did.
+// both get called with interrupts disabled and may be called from inside an allocation,
+// so never wait for a lock that might be held while allocating (use spin_trylock()).
+// kfree() and page_free() of what they drop are fine, they only take allocator locks
+struct shrinker {
+    const char *name;
+    size_t (*count)(struct shrinker *this);
+    size_t (*scan)(struct shrinker *this, size_t nr);
+    void *private;
+    struct shrinker *next;
+};
+
 // frame_alloc.c
 void allocator_init();
 // call this for physically contiguous, pow2 sized blocks
 struct page *page_alloc(size_t order);
 struct page *page_calloc(size_t order);
+// never reclaims or compacts, but may take the reserve below the min watermarks. for
+// allocations under locks the shrinkers or compaction could need (map_page_lock, vma_lock)
+struct page *page_alloc_atomic(size_t order);
+struct page *page_calloc_atomic(size_t order);
+// same as page_alloc(), but prefers node over the node of the current cpu
+struct page *page_alloc_node(size_t order, size_t node);
+// count physically contiguous pages, aligned to 2 ^ align_order pages (PAGES_2M_ORDER,
+// PAGES_1G_ORDER, ...). the unused tail of the underlying block is given back right away
+struct page *page_alloc_contig(size_t count, size_t align_order);
+void page_free_contig(struct page *page, size_t count);
+// single page, that can be moved by compaction whenever mapping->lock isn't held, and
+// it isn't shared (page_get()). freeing it only drops the owner's reference of a shared page
+struct page *page_alloc_movable(struct page_mapping *mapping, size_t index);
+void page_free_movable(struct page *page);
+// take another reference of an allocated single page, e.g. for mapping it somewhere else.
+// the first one counts the current owner as well
+void page_get(struct page *page);
+// drop a reference, true if it was the last one and the caller has to free the page
+bool page_put(struct page *page);
+// true while there are references besides the owner's. STRUCT_PAGE_FLAG_SHARED itself
+// stays set until the last page_put(), so a frame whose sharers are gone isn't pinned
+static inline bool page_shared(struct page *page) {
+    return (__atomic_load_n(&page->flags, __ATOMIC_ACQUIRE) & STRUCT_PAGE_FLAG_SHARED)
+        && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) > 1;
+}
+// up to count blocks of order into out, taking the allocator lock once per node instead
+// of once per block. returns how many were allocated, free them with page_free_bulk()
+size_t page_alloc_bulk(size_t order, size_t count, struct page **out);
+void page_free_bulk(size_t order, size_t count, struct page **pages);
+// grow the allocated block page from order to new_order in place, if the blocks
+// following it are free. false (and nothing changed) otherwise
+bool page_grow(struct page *page, size_t order, size_t new_order);
+// move movable pages of node together, until there is a free block of order.
+// returns false if that didn't work out
+bool page_compact(size_t node, size_t order);
 void *page_alloc_temp(size_t order);                // remove
 void page_free(struct page *page, size_t order);
+void page_free_cold(struct page *page, size_t order);
+void page_pcp_init_cpu(cpu_local_t *cpu);
+// start the thread filling the pre-zeroed pool, needs the scheduler
+void page_zero_init(void);
+// start the reclaim thread, needs the scheduler
+void page_reclaim_init(void);
+void shrinker_register(struct shrinker *shrinker);
+void shrinker_unregister(struct shrinker *shrinker);
+// ask the shrinkers for nr pages, returns how many were freed
+size_t page_reclaim(size_t nr);
 void page_free_temp(void *address, size_t size);    // remove
 void phys_stat_memory(struct phys_mem_stat *stat);
 
@@ -119,22 +267,43 @@ void *early_mem_alloc(size_t size);
 void early_mem_statistics(size_t *usable, size_t *free);
 void early_mem_dbg_print(void);
 
+// only pfns inside of sections with ram have a struct page
+static inline bool pfn_valid(size_t pfn) {
+    return (pfn < pages_count) && mem_sections[pfn >> PFN_SECTION_SHIFT].mem_map;
+}
+
+static inline struct page *pfn2page(size_t pfn) {
+    return mem_sections[pfn >> PFN_SECTION_SHIFT].mem_map + pfn;
+}
+
 static inline struct page *phys2page(uintptr_t phys) {
-    return &pages[phys / PAGE_SIZE];
+    return pfn2page(phys / PAGE_SIZE);
 }
 
-// struct page * to idx (= offset into mempages table)
+// struct page * to idx (= pfn)
 static inline size_t page2idx(struct page *page) {
-    if (page < pages || page >= (pages + pages_count)) {
+    size_t section = page->section;
+    if (section >= mem_section_count || !mem_sections[section].mem_map
+        || page < mem_sections[section].mem_map + (section << PFN_SECTION_SHIFT)
+        || page >= mem_sections[section].mem_map + ((section + 1) << PFN_SECTION_SHIFT)) {
         kpanic(0, NULL, "page %p is not in range\n", page);
     }
-    return ((uintptr_t)page - (uintptr_t)pages) / sizeof(struct page);
+    return page - mem_sections[section].mem_map;
 }
 
 static inline uintptr_t page2phys(struct page *page) {
     return page2idx(page) << PAGE_SHIFT;
 }
 
+// compressed struct page * for list links, NULL <-> PAGE_LINK_NONE
+static inline uint32_t page2link(struct page *page) {
+    return page ? (uint32_t)page2idx(page) : PAGE_LINK_NONE;
+}
+
+static inline struct page *link2page(uint32_t link) {
+    return (link == PAGE_LINK_NONE) ? NULL : pfn2page(link);
+}
+
 // returns in what page size category a range falls, in case of unalignment, returns the higher order
 static inline size_t psize2order(size_t size) {
     size_t order = 0;
@@ -156,5 +325,5 @@ static inline size_t size2order(size_t size) {
 }
 
 static inline size_t order2size(size_t order) {
-    return 1 << order;
+    return 1ul << order;
 }
\ No newline at end of file
@@ -14,6 +14,7 @@
 #define INT_VEC_LAPIC_TIMER 101
 
 #define INT_VEC_LAPIC_IPI 200
+#define INT_VEC_TLB_SHOOTDOWN 201
 
 #define INT_VEC_SPURIOUS 254
 #define INT_VEC_GENERAL_PURPOSE 253 // this may only be used for locked operations and has to be freed
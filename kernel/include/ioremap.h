@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mmu.h"
+
+// kernel va range for ioremap areas, one pml4 entry (512 GiB)
+#define IOREMAP_START (0xffffca0000000000ul)
+#define IOREMAP_END (IOREMAP_START + (512ul << 30))
+
+// set up the area cache and the arena, call after vmem_init()
+void ioremap_init(void);
+
+// map phys -> phys + len (any alignment) into the kernel half with cache_type, 2mib aligned
+// ranges get huge leaves. NULL if there's no va range left, or if phys is mapped with an
+// effective cache type differing from cache_type already (hhdm or another ioremap area)
+void *ioremap(uintptr_t phys, size_t len, enum memory_cache_type cache_type);
+void iounmap(void *addr);
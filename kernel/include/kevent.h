@@ -35,6 +35,8 @@ typedef struct kevent_t {
     k_spinlock_t lock;
 } kevent_t;
 
+// set up the subscriber cache, call after slab_init()
+void kevent_init(void);
 // wait for any of the events in the queue to launch, return the launched events index.
 // caller is responsible for removing any unused events from the queue.
 // return KEVENT_POLL_INVALID upon failure.
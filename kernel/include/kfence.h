@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "interrupt.h"
+
+// sampling guard page allocator, cheap enough to leave on (unlike CONFIG_SLAB_SANITIZE)
+#define CONFIG_KFENCE
+
+// guarded objects, each one gets its own page between two unmapped guard pages
+#define KFENCE_NUM_OBJECTS 63
+// every KFENCE_SAMPLE_INTERVAL-th kmalloc of a cpu is sampled
+#define KFENCE_SAMPLE_INTERVAL 1024
+// fills the unused part of an object page, checked on free
+#define KFENCE_CANARY_BYTE ((uint8_t)0xaa)
+// freed objects get unmapped in batches this often
+#define KFENCE_PROTECT_INTERVAL_MS (100)
+
+#ifdef CONFIG_KFENCE
+
+extern uintptr_t kfence_pool_start, kfence_pool_end;
+
+// set up the pool, call after vmalloc_init()
+void kfence_init(void);
+// start the thread unmapping freed objects, needs the scheduler
+void kfence_protect_init(void);
+
+static inline bool is_kfence_addr(const void *addr)
+{
+    return (uintptr_t)addr >= kfence_pool_start && (uintptr_t)addr < kfence_pool_end;
+}
+
+// true if the next kmalloc of this cpu should come from kfence
+bool kfence_should_sample(void);
+// NULL if the size doesn't fit into a page or all objects are in use
+void *kfence_alloc(size_t size, uintptr_t caller);
+// only takes kfence's own lock, safe from any context
+void kfence_free(void *addr, uintptr_t caller);
+// size of a kfence object, as requested at kfence_alloc()
+size_t kfence_ksize(const void *addr);
+// called on #PF. reports and recovers bad accesses to the pool, false if cr2 isn't in it
+bool kfence_handle_fault(cpu_ctx_t *regs);
+
+#endif // CONFIG_KFENCE
@@ -13,6 +13,22 @@
 #define KMALLOC_ALLOC_MAX 8192
 #define KMALLOC_ALLOC_SIZES 10
 
+// objects per per-cpu magazine, sized so a magazine fills a 256 byte object
+#define SLAB_MAGAZINE_SIZE 30
+// empty magazines a depot keeps around, the rest gets freed
+#define SLAB_DEPOT_EMPTY_MAX 8
+
+// the slab reaper gives back free slabs, that weren't used for this long
+#define SLAB_REAP_INTERVAL_MS 2000
+
+// slab colours are multiples of this (and of the cache alignment)
+#define SLAB_COLOR_ALIGN 64
+// track free objects in a u16 index array at the slab end instead of
+// linking them through the objects, for caches with objects of at least this size,
+// whose slab slack can hold the array
+#define CONFIG_SLAB_BUFCTL
+#define SLAB_BUFCTL_MIN_SIZE 64
+
 // enables allocate use-after-free sanitizer and overflow checks
 //#define CONFIG_SLAB_SANITIZE
 
@@ -27,9 +43,23 @@
 
 extern size_t slab_initialized;
 
+struct slab_cache;
+
 void slab_init();
+// set up the per-cpu magazines, call once all cpus are known
+void slab_smp_init(void);
+// start the thread returning idle slabs to the buddy allocator, call once scheduling works
+void slab_reaper_init(void);
 void *kmalloc(size_t size);
 void kfree(void *addr);
 void *krealloc(void *addr, size_t size);
 void *kcalloc(size_t entries, size_t size);
+// dedicated cache for objects of exactly size bytes, aligned to align (at least 8).
+// ctor (may be NULL) runs once per object when its slab is created, freed objects have
+// to be handed back in their constructed state
+struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(struct slab_cache *c);
+void kmem_cache_free(struct slab_cache *c, void *obj);
+// all objects have to be freed before
+void kmem_cache_destroy(struct slab_cache *c);
 void slab_dbg_print(void);
\ No newline at end of file
@@ -28,6 +28,7 @@ void spin_unlock(k_spinlock_t *lock);
 void spin_lock_global(k_spinlock_t *lock);
 void spin_unlock_global(k_spinlock_t *lock);
 bool spin_lock_timeout(k_spinlock_t *lock, size_t millis);
+bool spin_trylock(k_spinlock_t *lock);
 
 void mutex_lock(k_mutex_t *mutex);
 bool mutex_lock_timeout(k_mutex_t *mutex, size_t millis);
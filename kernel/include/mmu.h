@@ -5,6 +5,9 @@
 #include <stddef.h>
 
 #include "limine.h"
+#include "interrupt.h"
+#include "locking.h"
+#include "rbtree.h"
 
 // we urgently need some way to track mappings properly in our vmm
 
@@ -44,15 +47,20 @@
  *   - writes propagated to bus and invalidate corresponding cache lines on all processors on bus
  *   - speculative reads allowed */
 
-/* PCD  PWT  PAT    PATNR    Reset  Limine
- * 0    0    0      PAT0     WB     WB
- * 0    0    1      PAT1     WT     WT
- * 0    1    0      PAT2     UC-    UC-
- * 0    1    1      PAT3     UC     UC
- * 1    0    0      PAT4     WB     WP
- * 1    0    1      PAT5     WT     WC
- * 1    1    0      PAT6     UC-    unspecified
- * 1    1    1      PAT7     UC     unspecified */
+/* PAT  PCD  PWT    PATNR    Reset  Limine       MunkOS (pat_init())
+ * 0    0    0      PAT0     WB     WB           WB
+ * 0    0    1      PAT1     WT     WT           WT
+ * 0    1    0      PAT2     UC-    UC-          UC-
+ * 0    1    1      PAT3     UC     UC           UC
+ * 1    0    0      PAT4     WB     WP           WC
+ * 1    0    1      PAT5     WT     WC           WP
+ * 1    1    0      PAT6     UC-    unspecified  UC-
+ * 1    1    1      PAT7     UC     unspecified  UC
+ * the first four match the reset values, so mappings without the pat bit mean the same
+ * before and after pat_init(). the effective type also depends on the mtrrs of the range,
+ * a WC pat entry wins over every mtrr type, UC mtrrs win over the others */
+#define MSR_IA32_PAT (0x277)
+#define PAT_LAYOUT (0x0007050100070406ul)
 
 
 
@@ -109,6 +117,9 @@
 
 #define PML_LOWER_MASK (0x000ffffffffff000ul)
 
+// software bits (ignored by the mmu)
+#define PT_COW (1ul << 9)      // write protected copy-on-write page, the area is writable
+
 #pragma endregion page_table_format
 
 
@@ -128,22 +139,66 @@ enum memory_cache_type {
     MCT_WRITE_PROTECTED = 4
 };
 
-typedef struct {
+#define HUGE_PAGE_2M (0x200000ul)
+#define HUGE_PAGE_1G (0x40000000ul)
+
+// pages above which a flush reloads cr3 instead of invlpg'ing page by page
+#define TLB_FLUSH_MAX_PAGES 32
+// pages mmu_unmap_range() clears before it shoots them down (one ipi) and frees them
+#define TLB_BATCH_PAGES 64
+
+struct page;
+
+typedef struct page_map_ctx {
     uintptr_t pml4_address;
-    // we really should be tracking allocations for page tables per address space here
+    size_t table_pages;     // pdpts, pds and pts allocated for this address space
+    size_t refcount;        // tasks using it, kernel_pmc isn't counted
+    struct page_map_ctx *next, *prev;   // all address spaces but kernel_pmc
+
+    // vm areas (vma.c), keyed by their start
+    rb_tree_node_t *vma_root;
+    size_t vma_seq;         // bumped whenever an area goes away, or gets forked
+    k_spinlock_t vma_lock;
 } page_map_ctx_t;
 
 extern page_map_ctx_t kernel_pmc;
 extern struct limine_kernel_address_response *kernel_address;
 
 void init_vmm(void);
+// program the pat layout above, on every cpu before it uses kernel_pmc
+void pat_init(void);
+// cache type the mtrrs give pa
+enum memory_cache_type mtrr_cache_type(uintptr_t pa);
+// true if a present mapping in va -> va + len of pmc has another effective cache type
+// than mapping it with type would have. aliases like that are undefined behaviour
+bool mmu_cache_type_conflict(page_map_ctx_t *pmc, uintptr_t va, size_t len, enum memory_cache_type type);
+
+// new address space sharing the kernel half of kernel_pmc, refcount 1. NULL on failure
+page_map_ctx_t *mmu_pmc_create(void);
+// drop a reference, the last one frees all page tables of the user half, the pml4 and pmc.
+// mapped frames aren't freed, their owners have to unmap them first
+void mmu_pmc_put(page_map_ctx_t *pmc);
+page_map_ctx_t *mmu_pmc_get(page_map_ctx_t *pmc);
+// iterate all address spaces but kernel_pmc: returns the one after prev (the first one
+// for NULL) with a reference taken, and drops the reference of prev. NULL at the end
+page_map_ctx_t *mmu_pmc_next(page_map_ctx_t *prev);
 
 // internal
 void mmu_map_single_page_4k(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags);
 void mmu_map_single_page_2m(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags);
 void mmu_map_single_page_1g(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags);
+// results of mmu_try_map_single_page_*()
+#define MMU_TRY_MAP_OK 0
+#define MMU_TRY_MAP_BUSY 1      // something is mapped there already
+#define MMU_TRY_MAP_NOMEM 2     // no memory for a page table
+// map va -> pa, unless something is mapped at va already. never has to flush
+int mmu_try_map_single_page_4k(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags);
+// map the 2mib leaf va -> pa, unless anything is mapped in that range already
+int mmu_try_map_single_page_2m(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags);
 
 // use these for mapping stuff
+void mmu_map_range(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, size_t len,
+    uint64_t flags_pt, uint64_t flags_pdxx);
 void mmu_map_range_linear(page_map_ctx_t *ctx, uintptr_t vbase, uintptr_t pbase,
     size_t len, uint64_t access_flags, enum memory_cache_type cache_type);
 
@@ -153,4 +208,33 @@ uintptr_t virt2phys(page_map_ctx_t *pmc, uintptr_t virt);
 void mmu_set_ctx(const page_map_ctx_t *pmc);
 
 // [FIXME] remove/rewrite (also add to uacpi_kernel_unmap)
-bool mmu_unmap_single_page(page_map_ctx_t *pmc, uintptr_t va, bool free_pa);
\ No newline at end of file
+bool mmu_unmap_single_page(page_map_ctx_t *pmc, uintptr_t va, bool free_pa);
+size_t mmu_unmap_range(page_map_ctx_t *pmc, uintptr_t va, size_t len, bool free_pa);
+
+// share the 4kib pages of src in start -> start + len with dst (page_get()). with cow,
+// writable ones become read only copy-on-write pages in both, and the caller has to shoot
+// down src afterwards. false if there's no memory for dst's page tables, the pages
+// shared until then stay shared
+bool mmu_share_range(page_map_ctx_t *dst, page_map_ctx_t *src, uintptr_t start, size_t len, bool cow);
+// clear the dirty bits of the 4kib pages in va -> va + len, and hand each page that was
+// dirty to writeback, after the shootdown. writes from then on set the bit again
+void mmu_clean_range(page_map_ctx_t *pmc, uintptr_t va, size_t len,
+    void (*writeback)(void *ctx, uintptr_t va, struct page *frame), void *ctx);
+// resolve a write to the cow page at va: take the frame over if it isn't shared anymore,
+// copy it otherwise. false if va isn't a cow page or there's no memory for the copy
+bool mmu_cow_fault(page_map_ctx_t *pmc, uintptr_t va);
+
+// collapse the page table at the 2mib aligned va into a huge leaf, in two steps around
+// the caller's shootdown and copy. begin write protects the ptes (as cow pages, so writes
+// still get resolved), and saves them to ptes. false unless the table maps at least
+// min_present private 4kib pages with the same permissions
+bool mmu_collapse_begin(page_map_ctx_t *pmc, uintptr_t va, uint64_t *ptes, size_t min_present);
+// with commit, and if none of the ptes changed or got shared, replace the table by a
+// leaf mapping huge. otherwise the write protection is undone. returns the old table,
+// to free after a shootdown, NULL if nothing was collapsed
+struct page *mmu_collapse_end(page_map_ctx_t *pmc, uintptr_t va, const uint64_t *ptes, struct page *huge, bool commit);
+
+// invalidate start -> end on every cpu that may cache it, waits until they're done.
+// don't hold a spin_lock_global() other cpus might spin on, they couldn't ack
+void tlb_shootdown(page_map_ctx_t *pmc, uintptr_t start, uintptr_t end);
+void tlb_shootdown_handler(cpu_ctx_t *regs);
\ No newline at end of file
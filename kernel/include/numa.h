@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// upper bounds, so everything can be set up before any allocator exists
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_MEM_RANGES 32
+
+// slit values, 10 is always the local distance
+#define NUMA_DISTANCE_LOCAL 10
+#define NUMA_DISTANCE_REMOTE 20
+
+// physical address range [start, end) belonging to a node
+struct numa_mem_range {
+    uintptr_t start, end;
+    size_t node;
+};
+
+struct numa_node {
+    uint32_t proximity_domain;              // acpi proximity domain
+    uint8_t distance[NUMA_MAX_NODES];       // distance to every other node
+    // all nodes sorted by distance, fallback[0] is this node itself
+    size_t fallback[NUMA_MAX_NODES];
+};
+
+extern struct numa_node numa_nodes[NUMA_MAX_NODES];
+extern size_t numa_node_count;
+
+// parse srat / slit. call before the buddy allocator gets set up.
+// without an srat, all memory and cpus belong to node 0
+void numa_init(void);
+// node a physical address belongs to
+size_t numa_node_of_phys(uintptr_t phys);
+// end of the node range phys is in (or start of the next range, if phys isn't covered)
+uintptr_t numa_range_end(uintptr_t phys);
+size_t numa_node_of_lapic(uint32_t lapic_id);
+// node of the current cpu, 0 until smp is up
+size_t numa_this_node(void);
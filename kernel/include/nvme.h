@@ -504,9 +504,10 @@ struct nvme_cache_hashmap_entry {
     struct nvme_cache_hashmap_entry *next;
 };
 
+// the tables are vmalloc'd, they don't need to be physically contiguous
 struct nvme_cache_container {
-    struct nvme_cache_entry cache[NVME_NCACHES];
-    struct nvme_cache_hashmap_entry hashmap[NVME_HASHMAP_SIZE];
+    struct nvme_cache_entry *cache;                 // NVME_NCACHES entries
+    struct nvme_cache_hashmap_entry *hashmap;       // NVME_HASHMAP_SIZE entries
     struct nvme_cache_dll_node *head;
     struct nvme_cache_dll_node *tail;
 };
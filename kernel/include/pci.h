@@ -72,4 +72,6 @@ void pci_write(pci_device *dev, uint32_t reg, uint32_t val, enum pci_rw_size siz
 void pci_check_device(uint8_t bus, uint8_t dev_slot, uint8_t function);
 void pci_scan_bus(uint8_t bus);
 void pci_read_bar(pci_device *dev, struct pci_base_addr_reg_ctx *bar_ctx, int bar_idx);
+// ioremap() a memory space bar, WC if it's prefetchable, UC otherwise. NULL on failure
+volatile void *pci_map_bar(struct pci_base_addr_reg_ctx *bar_ctx);
 void pci_set_command_reg(pci_device *dev, uint16_t flags);
\ No newline at end of file
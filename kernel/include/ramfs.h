@@ -1,6 +1,7 @@
 #pragma once
 
 #include "vfs.h"
+#include "frame_alloc.h"
 
 #define RAMDISK_DEVICE_SIGNATURE (0xa2b35253eful)
 
@@ -32,9 +33,12 @@ struct ramdisk_file {
             int num_entries;
         } directory;
 
+        // file contents live in movable pages, compaction may swap them out under mapping.lock
         struct {
             size_t size;
-            void *file_contents;
+            struct page **pages;
+            size_t page_count;
+            struct page_mapping mapping;
         } file;
     };
 };
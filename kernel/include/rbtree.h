@@ -41,6 +41,10 @@ struct rb_tree_data *tree_remove(rb_tree_node_t **root, size_t key);
 // return the element associated with the given tree. return the found element,
 // else NULL.
 struct rb_tree_data *tree_find(rb_tree_node_t **root, size_t key);
+// return the element with the greatest key <= key, else NULL
+struct rb_tree_data *tree_find_floor(rb_tree_node_t **root, size_t key);
+// return the element with the smallest key >= key, else NULL
+struct rb_tree_data *tree_find_ceil(rb_tree_node_t **root, size_t key);
 // changes out the data pointer at key. key has to be the same as before.
 // use only for managing buckets.
 void tree_set_data_at(rb_tree_node_t **root, size_t key, struct rb_tree_data *data);
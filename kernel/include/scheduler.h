@@ -9,6 +9,7 @@
 
 #define SPAWN_TASK_THREAD_GROUP (1 << 0)
 #define SPAWN_TASK_NO_KERNEL_STACK (1 << 1)
+#define SPAWN_TASK_FORK_PMC (1 << 2)
 
 #define KERNEL_STACK_SIZE (0x8000)
 
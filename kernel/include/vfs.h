@@ -9,6 +9,7 @@
 #define VFS_FS_OP_STATUS_INVALID_ARGS           1
 #define VFS_FS_OP_STATUS_MOUNTPOINT_INVALID     2
 #define VFS_FS_OP_STATUS_ENOENT                 3
+#define VFS_FS_OP_STATUS_ENOMEM                 4
 
 #define VFS_VN_FLAG_ROOT                        (1 << 0)
 
@@ -26,6 +27,7 @@ struct vfs_vnode;
 struct vfs_vnode_ops;
 struct pnc_entry;
 struct file_handle;
+struct page;
 
 enum vfs_vnode_type {
     VFS_VN_NON,
@@ -56,7 +58,7 @@ struct vfs_fid {
 struct vfs_uio {
     uint8_t *uio_buf;   // buffer
     size_t uio_resid;   // remaining bytes
-    size_t uio_offset;  // curr offset into buffer
+    size_t uio_offset;  // file offset to start at
     enum vfs_uio_rw_type uio;   // rw
 };
 
@@ -172,6 +174,12 @@ struct vfs_vnode_ops {
     int (*vn_strategy)();
     int (*vn_bread)();
     int (*vn_brelse)();
+    // page cache: return the frame caching page index of the file with a reference taken
+    // (page_get()), which the caller drops with page_put(). mappings share these frames
+    // instead of copying them. VFS_FS_OP_STATUS_ENOENT past the end of the file
+    int (*vn_getpage)(struct vfs_vnode *this, size_t index, struct page **result);
+    // write back page index, after it got dirty through a shared mapping
+    int (*vn_putpage)(struct vfs_vnode *this, size_t index, struct page *page);
 };
 
 // pathname cache entry for vnodes.
@@ -201,6 +209,8 @@ static inline size_t pathn_hash(const char *str, size_t len) {
     return hash;
 }
 
+// set up the pnc_entry cache, called by vfs_init()
+void pnc_init(void);
 struct pnc_entry *new_pnc_entry(struct vfs_vnode *vnode, struct pnc_entry *parent, const char *pathn, size_t len, size_t hash);
 // add a given path section inside dir to the path name cache. pathn gets copied.
 struct pnc_entry *pnc_add_section(struct vfs_vnode *vnode, struct pnc_entry *dir, const char *section, size_t len);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "interrupt.h"
+#include "mmu.h"
+
+struct vfs_vnode;
+
+// back 2mib aligned ranges of anonymous areas by huge pages, on the first fault, or
+// later on by the collapse thread
+#define CONFIG_THP
+// page tables mapping at least that many private pages get collapsed into a huge page
+#define THP_COLLAPSE_MIN_PAGES (256ul)
+// huge pages collapsed per pass at most
+#define THP_COLLAPSE_BATCH (16ul)
+#define THP_COLLAPSE_INTERVAL_MS (1000)
+
+// vma_map() flags
+#define VMA_PRIVATE 0               // writes go to private copies of the pages
+#define VMA_SHARED (1 << 0)         // writes go to the file, needs vn_getpage()
+
+// a range of an address space, that gets populated on access by the #PF handler
+struct vma {
+    size_t key;                 // start, has to come first (struct rb_tree_data)
+    uintptr_t end;
+    uint64_t prot;              // MAF_WRITE, MAF_USER, MAF_NX
+    struct vfs_vnode *vnode;    // backing file, NULL for zero fill memory
+    size_t offset;              // file offset of start
+    int flags;                  // VMA_SHARED
+};
+
+// set up the vma cache, call after slab_init()
+void vma_init(void);
+// start the thp collapse thread, needs the scheduler
+void vma_thp_init(void);
+
+// reserve start -> start + len (page aligned) in pmc. nothing gets mapped until it's
+// touched. vnode may be NULL (anonymous zero fill memory), otherwise faulting pages map
+// the file at offset: its page cache frames if it has one (vn_getpage()), copied on the
+// first write unless flags has VMA_SHARED. without a page cache, pages are read into
+// private copies. NULL if the range overlaps another area
+struct vma *vma_map(page_map_ctx_t *pmc, uintptr_t start, size_t len, uint64_t prot,
+    struct vfs_vnode *vnode, size_t offset, int flags);
+// remove the area starting at start, unmap and free the pages faulted in so far.
+// dirty pages of shared areas are written back first. false if there's no area at start
+bool vma_unmap(page_map_ctx_t *pmc, uintptr_t start);
+void vma_unmap_all(page_map_ctx_t *pmc);
+// write back the pages of the shared area starting at start, that were written to since
+// the last sync (msync). false if there's no shared area at start
+bool vma_sync(page_map_ctx_t *pmc, uintptr_t start);
+
+// copy-on-write clone of src's areas and the pages populated so far, with a single
+// reference. NULL if there's no memory left
+page_map_ctx_t *vma_fork(page_map_ctx_t *src);
+
+// area containing va, NULL if there's none. call with pmc->vma_lock held
+struct vma *vma_find(page_map_ctx_t *pmc, uintptr_t va);
+
+// called on #PF. populates the page if it's inside an area and the access is allowed,
+// or breaks the sharing of a cow page that's written to. false if the fault wasn't resolved.
+// runs with interrupts disabled (#PF is an interrupt gate)
+bool vma_handle_fault(cpu_ctx_t *regs);
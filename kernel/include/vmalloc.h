@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// kernel va range for vmalloc areas, one pml4 entry (512 GiB)
+#define VMALLOC_START (0xffffc90000000000ul)
+#define VMALLOC_END (VMALLOC_START + (512ul << 30))
+
+// order 0 frames fetched per page_alloc_bulk() call
+#define VMALLOC_BULK_BATCH 64
+
+// set up the area cache, call after slab_init()
+void vmalloc_init(void);
+
+// virtually contiguous, page granular memory backed by single frames.
+// not physically contiguous, so never hand it to a device
+void *vmalloc(size_t size);
+// same as vmalloc(), but zeroed
+void *vzalloc(size_t size);
+void vfree(void *addr);
+
+static inline bool is_vmalloc_addr(const void *addr)
+{
+    return (uintptr_t)addr >= VMALLOC_START && (uintptr_t)addr < VMALLOC_END;
+}
+
+// kmalloc() for sizes the slab caches serve, vmalloc() above that
+void *kvmalloc(size_t size);
+void *kvcalloc(size_t entries, size_t size);
+// frees kmalloc() and vmalloc() memory
+void kvfree(void *addr);
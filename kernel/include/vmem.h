@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "locking.h"
+
+// free segments are kept in power of two lists, list i holds sizes in [2^i, 2^(i + 1))
+#define VMEM_FREELISTS 64
+// allocated segments are hashed by their start
+#define VMEM_HASH_SHIFT 8
+#define VMEM_HASH_BUCKETS (1 << VMEM_HASH_SHIFT)
+// quantum caches serve sizes of 1 .. VMEM_QCACHE_MAX quanta
+#define VMEM_QCACHE_MAX 8
+// ranges a per-cpu quantum cache holds, refills and flushes move half of them
+#define VMEM_QCACHE_ROUNDS 16
+
+// vmem_alloc() policies
+#define VMEM_INSTANTFIT 0           // first segment of a list that's guaranteed to fit, O(1)
+#define VMEM_BESTFIT (1 << 0)       // smallest fitting segment, less fragmentation
+
+struct vmem_seg;
+
+struct vmem_qcache {
+    size_t rounds;
+    uintptr_t addrs[VMEM_QCACHE_ROUNDS];
+};
+
+struct vmem_arena {
+    const char *name;
+    size_t quantum;                         // pow2, every size gets rounded up to it
+    size_t qcache_max;                      // sizes up to this come from the quantum caches
+
+    struct vmem_seg *segs;                  // spans, free and allocated segments sorted by start
+    struct vmem_seg *freelist[VMEM_FREELISTS];
+    uint64_t freemap;                       // bit i set if freelist[i] isn't empty
+    struct vmem_seg *hash[VMEM_HASH_BUCKETS];
+
+    // [cpu * VMEM_QCACHE_MAX + quanta - 1], NULL until vmem_smp_init()
+    struct vmem_qcache *qcaches;
+
+    size_t total, in_use;                   // bytes in spans / allocated (includes quantum caches)
+    k_spinlock_t lock;
+    struct vmem_arena *next;                // all arenas
+};
+
+// set up the segment cache, call after slab_init()
+void vmem_init(void);
+// set up the quantum caches of all arenas, call once all cpus are known
+void vmem_smp_init(void);
+
+// arena managing base -> base + size (may be empty, see vmem_add()). qcache_max = 0
+// disables the quantum caches. NULL on failure. 0 is never handed out, so don't add it
+struct vmem_arena *vmem_create(const char *name, uintptr_t base, size_t size, size_t quantum, size_t qcache_max);
+// add another span to vm, false on failure
+bool vmem_add(struct vmem_arena *vm, uintptr_t base, size_t size);
+// 0 if there's no range of size left
+uintptr_t vmem_alloc(struct vmem_arena *vm, size_t size, int flags);
+// size has to match the allocation
+void vmem_free(struct vmem_arena *vm, uintptr_t addr, size_t size);
+void vmem_dbg_print(struct vmem_arena *vm);
@@ -7,6 +7,8 @@
 #include "stacktrace.h"
 #include "smp.h"
 #include "compiler.h"
+#include "kfence.h"
+#include "vma.h"
 
 #include <stdarg.h>
 
@@ -66,6 +68,15 @@ void default_interrupt_handler(cpu_ctx_t *regs)
 
 void cpu_exception_handler(cpu_ctx_t *regs)
 {
+#ifdef CONFIG_KFENCE
+    if (regs->vector == 14 && kfence_handle_fault(regs))
+        return;
+#endif
+
+    // demand paging
+    if (regs->vector == 14 && vma_handle_fault(regs))
+        return;
+
     kpanic(0, regs, "cpu_exception_handler() called\n");
 }
 
@@ -162,6 +173,9 @@ void init_idt(void)
         idt_set_descriptor(vector, isr_stub_table[vector], 0b10001111);
         handlers[vector] = (uintptr_t)cpu_exception_handler;
     }
+    // #PF is an interrupt gate: vma_handle_fault() uses the cpu locals and takes
+    // the vma lock, so it must neither be preempted nor interrupted
+    idt_set_descriptor(14, isr_stub_table[14], 0b10001110);
     for (size_t vector = 32; vector < 256; vector++) {
         idt_set_descriptor(vector, isr_stub_table[vector], 0b10001110);
         handlers[vector] = (uintptr_t)default_interrupt_handler;
@@ -14,13 +14,21 @@
 #include "macros.h"
 #include "cpu_id.h"
 #include "memory.h"
+#include "kheap.h"
+#include "vma.h"
+#include "scheduler.h"
+#include "smp.h"
 
 // THIS NEEDS A REWORK
 
 static uint64_t phys_addr_width = 0;
 static uint64_t lin_addr_width = 0;
 
-page_map_ctx_t kernel_pmc = { 0x0 };
+page_map_ctx_t kernel_pmc = { .pml4_address = 0x0, .vma_root = RB_NIL };
+
+// every other address space, see mmu_pmc_next()
+static page_map_ctx_t *pmc_list;
+static k_spinlock_t pmc_list_lock;
 
 struct limine_kernel_address_request kernel_address_request = {
     .id = LIMINE_KERNEL_ADDRESS_REQUEST,
@@ -31,7 +39,6 @@ struct limine_kernel_address_response *kernel_address;
 // get rid of this lock
 static k_spinlock_t map_page_lock;
 
-static uint64_t *pml4_to_pt(uint64_t *pml4, uint64_t va, bool force);
 static void init_kpm();
 
 void init_vmm(void)
@@ -44,21 +51,131 @@ void init_vmm(void)
     lin_addr_width = (ctx.eax >> 8) & 0xFF;
     kprintf_verbose("  - vmm: phys_addr_width: %lu / lin_addr_width: %lu\n", phys_addr_width, lin_addr_width);
 
+    pat_init();
     init_kpm();
 
+    interrupts_register_vector(INT_VEC_TLB_SHOOTDOWN, (uintptr_t)tlb_shootdown_handler);
+
     kprintf("%s initialized mmu, set up kernel page tables\n", ansi_okay_string);
 }
 
-// [FIXME] this is NOT sufficient or efficient AT ALL
-static inline void tlb_flush()
+/*
+ * TLB shootdown. Page table changes that drop or downgrade a present entry have to be
+ * flushed on every cpu that may cache it: the kernel half on all of them, a user address
+ * space only on the cpus that currently run it (cpu->active_pml4, written before cr3 is
+ * loaded). There is one request in flight at a time, the initiator flushes locally while
+ * the targets handle INT_VEC_TLB_SHOOTDOWN, and waits until all of them acked.
+ * Cpus waiting for the shootdown lock serve requests aimed at them, so two initiators
+ * can't deadlock each other.
+*/
+
+static struct {
+    uintptr_t pml4;         // 0 for kernel mappings (every address space)
+    uintptr_t start, end;
+    size_t pending;         // targets that didn't ack yet
+} tlb_request;
+static k_spinlock_t tlb_shootdown_lock;
+
+static inline void tlb_flush_all(void)
 {
     __asm__ volatile (
         "movq %%cr3, %%rax\n\
 	    movq %%rax, %%cr3\n"
-        : : : "rax"
+        : : : "rax", "memory"
    );
 }
 
+static inline void invlpg(uintptr_t va)
+{
+    __asm__ volatile ("invlpg (%0)" : : "r" (va) : "memory");
+}
+
+static void tlb_flush_local(uintptr_t start, uintptr_t end)
+{
+    if ((end - start) / PAGE_SIZE > TLB_FLUSH_MAX_PAGES) {
+        tlb_flush_all();
+        return;
+    }
+
+    // invlpg drops the whole (2m/1g) translation for any va inside of it
+    for (uintptr_t va = ALIGN_DOWN(start, PAGE_SIZE); va < end; va += PAGE_SIZE)
+        invlpg(va);
+}
+
+// flush the current request if it's aimed at cpu. interrupts have to be disabled
+static void tlb_shootdown_serve(cpu_local_t *cpu)
+{
+    if (!__atomic_load_n(&cpu->tlb_shootdown_pending, __ATOMIC_ACQUIRE))
+        return;
+
+    // switching away reloaded cr3 already
+    if (!tlb_request.pml4 || tlb_request.pml4 == __atomic_load_n(&cpu->active_pml4, __ATOMIC_RELAXED))
+        tlb_flush_local(tlb_request.start, tlb_request.end);
+
+    __atomic_store_n(&cpu->tlb_shootdown_pending, false, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&tlb_request.pending, 1, __ATOMIC_RELEASE);
+}
+
+void tlb_shootdown_handler(cpu_ctx_t *regs)
+{
+    (void)regs;
+
+    tlb_shootdown_serve(get_this_cpu());
+    lapic_send_eoi_signal();
+}
+
+void tlb_shootdown(page_map_ctx_t *pmc, uintptr_t start, uintptr_t end)
+{
+    if (start >= end)
+        return;
+
+    // the kernel half is shared by all address spaces
+    bool kernel = pmc == &kernel_pmc || start >= 0xffff800000000000ul;
+
+    // no other cpus (or cpu locals) yet
+    if (!smp_initialized) {
+        tlb_flush_local(start, end);
+        return;
+    }
+
+    int_status_t old = preempt_fetch_disable();
+    cpu_local_t *this_cpu = get_this_cpu();
+
+    while (!spin_trylock(&tlb_shootdown_lock)) {
+        tlb_shootdown_serve(this_cpu);
+        arch_spin_hint();
+    }
+
+    tlb_request.pml4 = kernel ? 0 : pmc->pml4_address;
+    tlb_request.start = start;
+    tlb_request.end = end;
+    tlb_request.pending = 0;
+
+    // the page table writes have to be visible before active_pml4 is sampled
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < smp_cpu_count; i++) {
+        cpu_local_t *cpu = &global_cpus[i];
+        if (cpu == this_cpu)
+            continue;
+        if (!kernel && __atomic_load_n(&cpu->active_pml4, __ATOMIC_RELAXED) != tlb_request.pml4)
+            continue;
+
+        __atomic_add_fetch(&tlb_request.pending, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&cpu->tlb_shootdown_pending, true, __ATOMIC_RELEASE);
+        lapic_send_ipi(cpu->lapic_id, INT_VEC_TLB_SHOOTDOWN, ICR_DEST_FIELD);
+    }
+
+    if (kernel || this_cpu->active_pml4 == tlb_request.pml4)
+        tlb_flush_local(start, end);
+
+    while (__atomic_load_n(&tlb_request.pending, __ATOMIC_ACQUIRE))
+        arch_spin_hint();
+
+    spin_unlock(&tlb_shootdown_lock);
+    preempt_restore(old);
+}
+
 // try  to fin the pagemap. don't allocate on failure.
 static uint64_t *attempt_walk_pagemap_single_lvl(uint64_t *pml_pointer, uint64_t index)
 {
@@ -70,23 +187,62 @@ static uint64_t *attempt_walk_pagemap_single_lvl(uint64_t *pml_pointer, uint64_t
     return NULL;
 }
 
+static inline struct page *table2page(uint64_t *table)
+{
+    return phys2page((uintptr_t)table - hhdm->offset);
+}
+
+// flags of intermediate entries. the leaves decide about user access
+static inline uint64_t table_flags(uintptr_t va)
+{
+    return PM_COMMON_PRESENT | PM_COMMON_WRITE | (va < 0xffff800000000000ul ? PM_COMMON_USER : 0);
+}
+
+// write table[index], keeping track of the present entries of every table but the
+// pml4 (page->pt_used). call with map_page_lock held
+static inline void table_entry_set(page_map_ctx_t *pmc, uint64_t *table, size_t index, uint64_t entry)
+{
+    if (!(table[index] & PM_COMMON_PRESENT) && (uintptr_t)table != pmc->pml4_address)
+        table2page(table)->pt_used++;
+    table[index] = entry;
+}
+
+// clear the present table[index], true if table is empty now
+static inline bool table_entry_clear(page_map_ctx_t *pmc, uint64_t *table, size_t index)
+{
+    table[index] = 0;
+    if ((uintptr_t)table == pmc->pml4_address)
+        return false;
+    return !--table2page(table)->pt_used;
+}
+
 // walk the page tables by one level, starting at pml_pointer[index]. force
-// the traversal by allocating new tables with flags set.
-// [TODO] all allocations are tracked in ctx (is this necessary? we could just walk the tables
-// and find the pmls addresses this way...)
-static uint64_t *force_walk_pagemap_single_lvl(uint64_t *pml_pointer, uint64_t index, uint64_t flags)
+// the traversal by allocating new tables with flags set. new tables are
+// accounted in pmc. NULL if there's no memory for a new table
+static uint64_t *force_walk_pagemap_single_lvl(page_map_ctx_t *pmc, uint64_t *pml_pointer, uint64_t index, uint64_t flags)
 {
     if (pml_pointer[index] & PM_COMMON_PRESENT) {
         return (uint64_t *)((pml_pointer[index] & PML_LOWER_MASK) + hhdm->offset);
     }
 
-    // if pml_pointer[index] contains no entry
+    // if pml_pointer[index] contains no entry. map_page_lock is held, so no reclaim
+    struct page *table = page_calloc_atomic(PAGES_1_ORDER);
+    if (!table)
+        return NULL;
+    table->pt_used = 0;
+    pmc->table_pages++;
 
-    // track this in ctx
-    void *below_pml = (void *)page2phys(page_calloc(PAGES_1_ORDER));
+    table_entry_set(pmc, pml_pointer, index, page2phys(table) | flags);
+    return (uint64_t *)(page2phys(table) + hhdm->offset);
+}
 
-    pml_pointer[index] = (uint64_t)below_pml | flags;
-    return (uint64_t *)((uint64_t)below_pml + hhdm->offset);
+// same, for the kernel mappings, which have no way to fail
+static uint64_t *must_walk_pagemap_single_lvl(page_map_ctx_t *pmc, uint64_t *pml_pointer, uint64_t index, uint64_t flags)
+{
+    uint64_t *table = force_walk_pagemap_single_lvl(pmc, pml_pointer, index, flags);
+    if (!table)
+        kpanic(0, NULL, "out of memory allocating a page table\n");
+    return table;
 }
 
 void mmu_map_single_page_4k(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags)
@@ -103,23 +259,58 @@ void mmu_map_single_page_4k(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uin
 
     spin_lock_global(&map_page_lock);
 
-    uint64_t *pmlx = force_walk_pagemap_single_lvl(pml4, pml4_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    uint64_t *pmlx = must_walk_pagemap_single_lvl(pmc, pml4, pml4_index, table_flags(va));
+
+    pmlx = must_walk_pagemap_single_lvl(pmc, pmlx, pdpt_index, table_flags(va));
 
-    pmlx = force_walk_pagemap_single_lvl(pmlx, pdpt_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    pmlx = must_walk_pagemap_single_lvl(pmc, pmlx, pd_index, table_flags(va));
 
-    pmlx = force_walk_pagemap_single_lvl(pmlx, pd_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    uint64_t old = pmlx[pt_index];
+    table_entry_set(pmc, pmlx, pt_index, pa | flags);
 
-    pmlx[pt_index] = pa | flags;
+    spin_unlock_global(&map_page_lock);
+
+    // not present entries are never cached
+    if (old & PM_COMMON_PRESENT)
+        tlb_shootdown(pmc, va, va + 0x1000);
+}
 
-    tlb_flush();
+int mmu_try_map_single_page_4k(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags)
+{
+    if (pa & 0xfff || va & 0xfff)
+        kpanic(0, NULL, "bad alignment (map 4kib)\n");
+
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
+
+    size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+        pdpt_index = (va & (0x1fful << 30)) >> 30,
+        pd_index = (va & (0x1fful << 21)) >> 21,
+        pt_index = (va & (0x1fful << 12)) >> 12;
+
+    spin_lock_global(&map_page_lock);
+
+    // tables allocated before running out stay, they're reused by the next try
+    int status = MMU_TRY_MAP_NOMEM;
+    uint64_t *pmlx = force_walk_pagemap_single_lvl(pmc, pml4, pml4_index, table_flags(va));
+    if (pmlx && (pmlx[pdpt_index] & PDXX_COMMON_PS))
+        status = MMU_TRY_MAP_BUSY;
+    else if (pmlx && (pmlx = force_walk_pagemap_single_lvl(pmc, pmlx, pdpt_index, table_flags(va)))) {
+        if (pmlx[pd_index] & PDXX_COMMON_PS)
+            status = MMU_TRY_MAP_BUSY;
+        else if ((pmlx = force_walk_pagemap_single_lvl(pmc, pmlx, pd_index, table_flags(va)))) {
+            status = MMU_TRY_MAP_BUSY;
+            if (!(pmlx[pt_index] & PM_COMMON_PRESENT)) {
+                table_entry_set(pmc, pmlx, pt_index, pa | flags);
+                status = MMU_TRY_MAP_OK;
+            }
+        }
+    }
 
     spin_unlock_global(&map_page_lock);
+    return status;
 }
 
-void mmu_map_single_page_2m(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags)
+int mmu_try_map_single_page_2m(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags)
 {
     if (pa & 0x1fffff || va & 0x1fffff)
         kpanic(0, NULL, "bad alignment (map 2mib)\n");
@@ -132,17 +323,47 @@ void mmu_map_single_page_2m(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uin
 
     spin_lock_global(&map_page_lock);
 
-    uint64_t *pmlx = force_walk_pagemap_single_lvl(pml4, pml4_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    int status = MMU_TRY_MAP_NOMEM;
+    uint64_t *pmlx = force_walk_pagemap_single_lvl(pmc, pml4, pml4_index, table_flags(va));
+    if (pmlx && (pmlx[pdpt_index] & PDXX_COMMON_PS))
+        status = MMU_TRY_MAP_BUSY;
+    else if (pmlx && (pmlx = force_walk_pagemap_single_lvl(pmc, pmlx, pdpt_index, table_flags(va)))) {
+        // a page table counts as mapped, even if it's empty by now
+        status = MMU_TRY_MAP_BUSY;
+        if (!(pmlx[pd_index] & PM_COMMON_PRESENT)) {
+            table_entry_set(pmc, pmlx, pd_index, pa | flags | PDXX_COMMON_PS);
+            status = MMU_TRY_MAP_OK;
+        }
+    }
+
+    spin_unlock_global(&map_page_lock);
+    return status;
+}
+
+void mmu_map_single_page_2m(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags)
+{
+    if (pa & 0x1fffff || va & 0x1fffff)
+        kpanic(0, NULL, "bad alignment (map 2mib)\n");
+
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
+
+    size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+        pdpt_index = (va & (0x1fful << 30)) >> 30,
+        pd_index = (va & (0x1fful << 21)) >> 21;
 
-    pmlx = force_walk_pagemap_single_lvl(pmlx, pdpt_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    spin_lock_global(&map_page_lock);
+
+    uint64_t *pmlx = must_walk_pagemap_single_lvl(pmc, pml4, pml4_index, table_flags(va));
 
-    pmlx[pd_index] = pa | flags | PDXX_COMMON_PS;
+    pmlx = must_walk_pagemap_single_lvl(pmc, pmlx, pdpt_index, table_flags(va));
 
-    tlb_flush();
+    uint64_t old = pmlx[pd_index];
+    table_entry_set(pmc, pmlx, pd_index, pa | flags | PDXX_COMMON_PS);
 
     spin_unlock_global(&map_page_lock);
+
+    if (old & PM_COMMON_PRESENT)
+        tlb_shootdown(pmc, va, va + 0x200000);
 }
 
 void mmu_map_single_page_1g(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uint64_t flags)
@@ -157,79 +378,342 @@ void mmu_map_single_page_1g(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, uin
 
     spin_lock_global(&map_page_lock);
 
-    uint64_t *pmlx = force_walk_pagemap_single_lvl(pml4, pml4_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    uint64_t *pmlx = must_walk_pagemap_single_lvl(pmc, pml4, pml4_index, table_flags(va));
+
+    uint64_t old = pmlx[pdpt_index];
+    table_entry_set(pmc, pmlx, pdpt_index, pa | flags | PDXX_COMMON_PS);
+
+    spin_unlock_global(&map_page_lock);
+
+    if (old & PM_COMMON_PRESENT)
+        tlb_shootdown(pmc, va, va + 0x40000000);
+}
+
+// replace the 1gib/2mib leaf at *entry by a table of 512 leaves mapping the same range.
+// call with map_page_lock held, the caller has to flush. NULL (and nothing changed) if
+// there's no memory for the table
+static uint64_t *split_leaf(page_map_ctx_t *pmc, uint64_t *entry, bool to_pt)
+{
+    uint64_t leaf = *entry;
+    uintptr_t pa = leaf & (to_pt ? PD_PHYS_MASK : PDPT_PHYS_MASK);
+    size_t child_size = to_pt ? PAGE_SIZE : HUGE_PAGE_2M;
+
+    // pat sits at bit 12 in pdxx leaves, at bit 7 (ps) in ptes
+    uint64_t flags = leaf & (0xfffull | PM_COMMON_NX) & ~(PDXX_COMMON_PS | PDXX_COMMON_PAT);
+    if (to_pt)
+        flags |= (leaf & PDXX_COMMON_PAT) ? PT_PAT : 0;
+    else
+        flags |= PDXX_COMMON_PS | (leaf & PDXX_COMMON_PAT);
+
+    struct page *table_page = page_alloc_atomic(PAGES_1_ORDER);
+    if (!table_page)
+        return NULL;
+    uintptr_t table_pa = page2phys(table_page);
+    uint64_t *table = (uint64_t *)(table_pa + hhdm->offset);
+    for (size_t i = 0; i < 512; i++)
+        table[i] = (pa + i * child_size) | flags;
+    table_page->pt_used = 512;
+    pmc->table_pages++;
+
+    *entry = table_pa | PM_COMMON_PRESENT | PM_COMMON_WRITE | (leaf & PM_COMMON_USER);
+    return table;
+}
 
-    pmlx[pdpt_index] = pa | flags | PDXX_COMMON_PS;
+// same, for callers that can't back out anymore
+static uint64_t *must_split_leaf(page_map_ctx_t *pmc, uint64_t *entry, bool to_pt)
+{
+    uint64_t *table = split_leaf(pmc, entry, to_pt);
+    if (!table)
+        kpanic(0, NULL, "out of memory splitting a huge page\n");
+    return table;
+}
 
-    tlb_flush();
+// next level table below entry, allocated if it's missing, split if it's a leaf. call
+// with map_page_lock held. *split is set if a present translation changed
+static uint64_t *walk_or_split(page_map_ctx_t *pmc, uint64_t *table, size_t index, uintptr_t va,
+    bool to_pt, bool *split)
+{
+    if ((table[index] & (PM_COMMON_PRESENT | PDXX_COMMON_PS)) == (PM_COMMON_PRESENT | PDXX_COMMON_PS)) {
+        *split = true;
+        return must_split_leaf(pmc, &table[index], to_pt);
+    }
+    return must_walk_pagemap_single_lvl(pmc, table, index, table_flags(va));
+}
+
+// a leaf of size may replace entry: aligned, fits, and entry isn't a table we'd leak
+static inline bool leaf_fits(uint64_t entry, uintptr_t va, uintptr_t pa, uintptr_t end, size_t size)
+{
+    return !(va & (size - 1)) && !(pa & (size - 1)) && end - va >= size
+        && (!(entry & PM_COMMON_PRESENT) || (entry & PDXX_COMMON_PS));
+}
+
+// map va -> va + len to pa in one pass, with 1gib and 2mib leaves wherever both sides are
+// aligned. the tables of the last iteration are reused until va crosses their span, and
+// there's (at most) a single shootdown at the end, if present mappings got replaced
+void mmu_map_range(page_map_ctx_t *pmc, uintptr_t va, uintptr_t pa, size_t len,
+    uint64_t flags_pt, uint64_t flags_pdxx)
+{
+    if (pa & 0xfff || va & 0xfff || len & 0xfff)
+        kpanic(0, NULL, "bad alignment (map range)\n");
+
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
+    uint64_t *pdpt = NULL, *pd = NULL, *pt = NULL;
+    uintptr_t start = va, end = va + len;
+    bool flush = false;
+
+    spin_lock_global(&map_page_lock);
+
+    while (va < end) {
+        size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+            pdpt_index = (va & (0x1fful << 30)) >> 30,
+            pd_index = (va & (0x1fful << 21)) >> 21,
+            pt_index = (va & (0x1fful << 12)) >> 12;
+
+        // crossed into another table
+        if (!pdpt_index && !pd_index && !pt_index) pdpt = NULL;
+        if (!pd_index && !pt_index) pd = NULL;
+        if (!pt_index) pt = NULL;
+
+        if (!pdpt)
+            pdpt = must_walk_pagemap_single_lvl(pmc, pml4, pml4_index, table_flags(va));
+
+        if (leaf_fits(pdpt[pdpt_index], va, pa, end, HUGE_PAGE_1G)) {
+            flush |= !!(pdpt[pdpt_index] & PM_COMMON_PRESENT);
+            table_entry_set(pmc, pdpt, pdpt_index, pa | flags_pdxx | PDXX_COMMON_PS);
+            va += HUGE_PAGE_1G;
+            pa += HUGE_PAGE_1G;
+            continue;
+        }
+
+        if (!pd)
+            pd = walk_or_split(pmc, pdpt, pdpt_index, va, false, &flush);
+
+        if (leaf_fits(pd[pd_index], va, pa, end, HUGE_PAGE_2M)) {
+            flush |= !!(pd[pd_index] & PM_COMMON_PRESENT);
+            table_entry_set(pmc, pd, pd_index, pa | flags_pdxx | PDXX_COMMON_PS);
+            va += HUGE_PAGE_2M;
+            pa += HUGE_PAGE_2M;
+            continue;
+        }
+
+        if (!pt)
+            pt = walk_or_split(pmc, pd, pd_index, va, true, &flush);
+
+        flush |= !!(pt[pt_index] & PM_COMMON_PRESENT);
+        table_entry_set(pmc, pt, pt_index, pa | flags_pt);
+        va += PAGE_SIZE;
+        pa += PAGE_SIZE;
+    }
 
     spin_unlock_global(&map_page_lock);
+
+    if (flush)
+        tlb_shootdown(pmc, start, end);
 }
 
 // map a range from base -> base + len with the biggest mapping sizes available.
 // base and len have to be page aligned.
 // [FIXME] use custom flags since PAT is not always at the same bit position!!!
-void mmu_map_range_linear(page_map_ctx_t *ctx, uintptr_t vbase, uintptr_t pbase,
-    size_t len, uint64_t access_flags, enum memory_cache_type cache_type)
+// pat bits selecting cache_type in PAT_LAYOUT
+static void cache_type_flags(enum memory_cache_type cache_type, uint64_t *flags_pt, uint64_t *flags_pdxx)
 {
-    if (pbase & 0xfff || vbase & 0xfff || len & 0xfff)
-        kpanic(0, NULL, "bad alignment (map 1gib)\n");
-
-    uintptr_t off = DIFF(vbase, pbase);
-    uintptr_t lo = pbase, limit = pbase + len;
-
-    uint64_t flags_pt, flags_pdxx;
-    flags_pt = flags_pdxx = access_flags | PM_COMMON_PRESENT;
-    // cache type
     switch (cache_type)
     {
         case MCT_UNCACHEABLE:
-            flags_pt |= PM_COMMON_PWT | PT_PAT;
-            flags_pdxx |= PM_COMMON_PWT | PDXX_COMMON_PAT;
+            *flags_pt |= PM_COMMON_PCD | PM_COMMON_PWT;
+            *flags_pdxx |= PM_COMMON_PCD | PM_COMMON_PWT;
             break;
         case MCT_WRITE_BACK:
             break;
         case MCT_WRITE_COMBINING:
-            flags_pt |= PM_COMMON_PCD | PT_PAT;
-            flags_pdxx |= PM_COMMON_PCD | PDXX_COMMON_PAT;
+            *flags_pt |= PT_PAT;
+            *flags_pdxx |= PDXX_COMMON_PAT;
             break;
         case MCT_WRITE_PROTECTED:
-            flags_pt |= PM_COMMON_PCD;
+            *flags_pt |= PT_PAT | PM_COMMON_PWT;
+            *flags_pdxx |= PDXX_COMMON_PAT | PM_COMMON_PWT;
             break;
         case MCT_WRITE_THROUGH:
-            flags_pt |= PT_PAT;
-            flags_pdxx |= PDXX_COMMON_PAT;
+            *flags_pt |= PM_COMMON_PWT;
+            *flags_pdxx |= PM_COMMON_PWT;
             break;
         default:
             kpanic(0, NULL, "unreachable\n");
     }
+}
 
-    uintptr_t end = MIN(ALIGN_UP(lo, 0x200000), ALIGN_DOWN(limit, 0x1000));
-    for (; lo < end; lo += 0x1000) {
-        mmu_map_single_page_4k(ctx, lo + off, lo, flags_pt);
-    }
+// cache type of a leaf in PAT_LAYOUT, UC- counts as UC
+static enum memory_cache_type leaf_cache_type(uint64_t entry, bool pdxx)
+{
+    static const enum memory_cache_type types[8] = {
+        MCT_WRITE_BACK, MCT_WRITE_THROUGH, MCT_UNCACHEABLE, MCT_UNCACHEABLE,
+        MCT_WRITE_COMBINING, MCT_WRITE_PROTECTED, MCT_UNCACHEABLE, MCT_UNCACHEABLE
+    };
+
+    size_t index = ((entry & PM_COMMON_PCD) ? 2 : 0) | ((entry & PM_COMMON_PWT) ? 1 : 0);
+    if (entry & (pdxx ? PDXX_COMMON_PAT : PT_PAT))
+        index |= 4;
+    return types[index];
+}
+
+// what the cpu makes of pat type over mtrr type (sdm vol. 3, 11.5.2.2, roughly)
+static enum memory_cache_type effective_cache_type(enum memory_cache_type pat, enum memory_cache_type mtrr)
+{
+    if (pat == MCT_WRITE_COMBINING)
+        return MCT_WRITE_COMBINING;
+    if (pat == MCT_UNCACHEABLE || mtrr == MCT_UNCACHEABLE)
+        return MCT_UNCACHEABLE;
+    if (mtrr == MCT_WRITE_COMBINING)
+        return pat == MCT_WRITE_BACK ? MCT_WRITE_COMBINING : MCT_UNCACHEABLE;
+    if (mtrr == MCT_WRITE_BACK || pat == MCT_WRITE_PROTECTED)
+        return pat;
+    // wt / wp mtrrs only weaken wb and wt
+    return (pat == MCT_WRITE_BACK || mtrr == MCT_WRITE_PROTECTED) ? mtrr : pat;
+}
+
+void pat_init(void)
+{
+    // nothing may stay cached under the old layout
+    __asm__ volatile ("wbinvd" : : : "memory");
+    write_msr(MSR_IA32_PAT, PAT_LAYOUT);
+    __asm__ volatile ("wbinvd" : : : "memory");
+    tlb_flush_all();
+}
 
-    end = MIN(ALIGN_UP(lo, 0x40000000), ALIGN_DOWN(limit, 0x200000));
-    for (; lo < end; lo += 0x200000) {
-        mmu_map_single_page_2m(ctx, lo + off, lo, flags_pdxx);
+static enum memory_cache_type mtrr_type2mct(uint8_t type)
+{
+    switch (type) {
+        case 1: return MCT_WRITE_COMBINING;
+        case 4: return MCT_WRITE_THROUGH;
+        case 5: return MCT_WRITE_PROTECTED;
+        case 6: return MCT_WRITE_BACK;
+        default: return MCT_UNCACHEABLE;
     }
+}
 
-    // middle 1gib mappings
-    end = ALIGN_DOWN(limit, 0x40000000);
-    for (; lo < end; lo += 0x40000000) {
-        mmu_map_single_page_1g(ctx, lo + off, lo, flags_pdxx);
+enum memory_cache_type mtrr_cache_type(uintptr_t pa)
+{
+    struct cpuid_ctx ctx = {.leaf = 0x1};
+    cpuid(&ctx);
+    if (!(ctx.edx & (1 << 12)))
+        return MCT_WRITE_BACK;
+
+    uint64_t def_type = read_msr(0x2ff);
+    if (!(def_type & (1 << 11)))
+        return MCT_UNCACHEABLE;
+
+    // fixed ranges below 1 MiB: 8 x 64 KiB, 16 x 16 KiB, 64 x 4 KiB
+    if (pa < 0x100000 && (def_type & (1 << 10)) && (read_msr(0xfe) & (1 << 8))) {
+        uint32_t msr;
+        size_t byte;
+        if (pa < 0x80000) {
+            msr = 0x250;
+            byte = pa >> 16;
+        } else if (pa < 0xc0000) {
+            msr = 0x258 + ((pa - 0x80000) >> 17);
+            byte = ((pa - 0x80000) >> 14) & 7;
+        } else {
+            msr = 0x268 + ((pa - 0xc0000) >> 15);
+            byte = ((pa - 0xc0000) >> 12) & 7;
+        }
+        return mtrr_type2mct((read_msr(msr) >> (byte * 8)) & 0xff);
     }
 
-    end = ALIGN_DOWN(limit, 0x200000);
-    for (; lo < end; lo += 0x200000) {
-        mmu_map_single_page_2m(ctx, lo + off, lo, flags_pdxx);
+    // overlapping variable ranges: uc wins, wt beats wb
+    size_t count = read_msr(0xfe) & 0xff;
+    bool matched = false;
+    enum memory_cache_type type = MCT_WRITE_BACK;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t mask = read_msr(0x201 + 2 * i);
+        if (!(mask & (1 << 11)))
+            continue;
+        uint64_t base = read_msr(0x200 + 2 * i);
+        mask &= ~0xffful;
+        if ((pa & mask) != (base & mask))
+            continue;
+
+        enum memory_cache_type curr = mtrr_type2mct(base & 0xff);
+        if (!matched || curr == MCT_UNCACHEABLE || (curr == MCT_WRITE_THROUGH && type == MCT_WRITE_BACK))
+            type = curr;
+        matched = true;
+        if (type == MCT_UNCACHEABLE)
+            break;
     }
 
-    end = ALIGN_DOWN(limit, 0x1000);
-    for (; lo < end; lo += 0x1000) {
-        mmu_map_single_page_4k(ctx, lo + off, lo, flags_pt);
+    return matched ? type : mtrr_type2mct(def_type & 0xff);
+}
+
+bool mmu_cache_type_conflict(page_map_ctx_t *pmc, uintptr_t va, size_t len, enum memory_cache_type type)
+{
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
+    uintptr_t end = va + len;
+    bool conflict = false;
+
+    spin_lock_global(&map_page_lock);
+
+    // the mtrrs are looked up once per leaf
+    while (va < end && !conflict) {
+        size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+            pdpt_index = (va & (0x1fful << 30)) >> 30,
+            pd_index = (va & (0x1fful << 21)) >> 21,
+            pt_index = (va & (0x1fful << 12)) >> 12;
+
+        uint64_t *pdpt = attempt_walk_pagemap_single_lvl(pml4, pml4_index);
+        if (!pdpt) {
+            va = ALIGN_DOWN(va, 1ul << 39) + (1ul << 39);
+            continue;
+        }
+
+        uint64_t entry;
+        bool pdxx = true;
+        size_t size;
+        uintptr_t pa;
+        if (pdpt[pdpt_index] & PDXX_COMMON_PS) {
+            entry = pdpt[pdpt_index];
+            size = HUGE_PAGE_1G;
+            pa = (entry & PDPT_PHYS_MASK) + (va & (HUGE_PAGE_1G - 1));
+        } else {
+            uint64_t *pd = attempt_walk_pagemap_single_lvl(pdpt, pdpt_index);
+            if (!pd) {
+                va = ALIGN_DOWN(va, HUGE_PAGE_1G) + HUGE_PAGE_1G;
+                continue;
+            }
+            if (pd[pd_index] & PDXX_COMMON_PS) {
+                entry = pd[pd_index];
+                size = HUGE_PAGE_2M;
+                pa = (entry & PD_PHYS_MASK) + (va & (HUGE_PAGE_2M - 1));
+            } else {
+                uint64_t *pt = attempt_walk_pagemap_single_lvl(pd, pd_index);
+                if (!pt) {
+                    va = ALIGN_DOWN(va, HUGE_PAGE_2M) + HUGE_PAGE_2M;
+                    continue;
+                }
+                entry = pt[pt_index];
+                size = PAGE_SIZE;
+                pdxx = false;
+                pa = entry & PT_PHYS_MASK;
+            }
+        }
+
+        if (entry & PM_COMMON_PRESENT) {
+            enum memory_cache_type mtrr = mtrr_cache_type(pa);
+            conflict = effective_cache_type(leaf_cache_type(entry, pdxx), mtrr) != effective_cache_type(type, mtrr);
+        }
+        va = ALIGN_DOWN(va, size) + size;
     }
+
+    spin_unlock_global(&map_page_lock);
+    return conflict;
+}
+
+void mmu_map_range_linear(page_map_ctx_t *ctx, uintptr_t vbase, uintptr_t pbase,
+    size_t len, uint64_t access_flags, enum memory_cache_type cache_type)
+{
+    uint64_t flags_pt, flags_pdxx;
+    flags_pt = flags_pdxx = access_flags | PM_COMMON_PRESENT;
+    cache_type_flags(cache_type, &flags_pt, &flags_pdxx);
+
+    mmu_map_range(ctx, vbase, pbase, len, flags_pt, flags_pdxx);
 }
 
 // depth 1 = 1gib, 2 = 2mib, 3 = 4kib
@@ -282,62 +766,514 @@ uint64_t *mmu_walk_table(page_map_ctx_t *pmc, uintptr_t va, int *depth, size_t *
         return pt;
     }
 
-    tlb_flush();
-
     spin_unlock_global(&map_page_lock);
 
     return NULL;
 }
 
-// return NULL if requested PT doesn't exist and shouldn't be allocated
-static uint64_t *pml4_to_pt(uint64_t *pml4, uint64_t va, bool force)
+// free the tables on the way to a cleared entry that became empty, bottom up. pt / pd
+// are NULL if the cleared entry was a 2mib / 1gib leaf. the kernel half pdpts are shared
+// by all address spaces and stay. the tables are only queued, since the paging structure
+// caches may still reference them until the shootdown. call with map_page_lock held
+static size_t prune_tables(page_map_ctx_t *pmc, size_t pml4_index, size_t pdpt_index, size_t pd_index,
+    uint64_t *pdpt, uint64_t *pd, uint64_t *pt, struct page **tables)
 {
-    (void)force;
+    size_t count = 0;
+
+    if (pt) {
+        if (table2page(pt)->pt_used)
+            return count;
+        tables[count++] = table2page(pt);
+        if (!table_entry_clear(pmc, pd, pd_index))
+            goto out;
+    }
+
+    if (pd) {
+        if (table2page(pd)->pt_used)
+            goto out;
+        tables[count++] = table2page(pd);
+        if (!table_entry_clear(pmc, pdpt, pdpt_index))
+            goto out;
+    }
+
+    if (pml4_index < 256 && !table2page(pdpt)->pt_used) {
+        tables[count++] = table2page(pdpt);
+        table_entry_clear(pmc, (uint64_t *)pmc->pml4_address, pml4_index);
+    }
+
+out:
+    pmc->table_pages -= count;
+    return count;
+}
+
+// drop the mappings of frames, keeping the ones to free at the front
+static size_t frames_put(struct page **frames, size_t count)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++)
+        if (page_put(frames[i]))
+            frames[kept++] = frames[i];
+    return kept;
+}
+
+// unmap va -> va + len in one pass. huge leaves inside the range are dropped as a whole,
+// the ones sticking out of it get split first, tables that became empty are freed.
+// without free_pa or emptied tables there's a single shootdown at the end, otherwise one
+// per TLB_BATCH_PAGES leaves, since the frames may only be freed once no cpu can reach
+// them anymore. huge frames are freed as order 9/18 blocks, cow shared frames only once
+// their last mapping is gone. physical ranges without struct pages (mmio) are never
+// freed. returns the unmapped 4kib pages
+size_t mmu_unmap_range(page_map_ctx_t *pmc, uintptr_t va, size_t len, bool free_pa)
+{
+    if (va & 0xfff || len & 0xfff)
+        kpanic(0, NULL, "bad alignment (unmap range)\n");
+
+    struct page *frames[TLB_BATCH_PAGES];
+    struct page *huge_frames[TLB_BATCH_PAGES];
+    uint8_t huge_orders[TLB_BATCH_PAGES];
+    struct page *tables[TLB_BATCH_PAGES];
+    size_t batched = 0, huge_batched = 0, tables_batched = 0, unmapped = 0;
+
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
+    uintptr_t batch_start = va, end = va + len;
+    bool flush = false;
+
+    spin_lock_global(&map_page_lock);
+
+    while (va < end) {
+        size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+            pdpt_index = (va & (0x1fful << 30)) >> 30,
+            pd_index = (va & (0x1fful << 21)) >> 21,
+            pt_index = (va & (0x1fful << 12)) >> 12;
+
+        // skip whatever isn't mapped at the highest level possible
+        uint64_t *pdpt = attempt_walk_pagemap_single_lvl(pml4, pml4_index);
+        if (!pdpt) {
+            va = ALIGN_DOWN(va, 1ul << 39) + (1ul << 39);
+            continue;
+        }
+
+        uint64_t *pd = NULL, *pt = NULL;
+        if (pdpt[pdpt_index] & PDXX_COMMON_PS) {
+            if (!(va & (HUGE_PAGE_1G - 1)) && end - va >= HUGE_PAGE_1G) {
+                if (free_pa && pfn_valid((pdpt[pdpt_index] & PDPT_PHYS_MASK) >> PAGE_SHIFT)) {
+                    huge_orders[huge_batched] = 18;
+                    huge_frames[huge_batched++] = phys2page(pdpt[pdpt_index] & PDPT_PHYS_MASK);
+                }
+                if (table_entry_clear(pmc, pdpt, pdpt_index))
+                    tables_batched += prune_tables(pmc, pml4_index, pdpt_index, pd_index,
+                        pdpt, NULL, NULL, &tables[tables_batched]);
+                unmapped += HUGE_PAGE_1G / PAGE_SIZE;
+                va += HUGE_PAGE_1G;
+                flush = true;
+                goto next;
+            }
+            pd = must_split_leaf(pmc, &pdpt[pdpt_index], false);
+            flush = true;
+        } else if (!(pd = attempt_walk_pagemap_single_lvl(pdpt, pdpt_index))) {
+            va = ALIGN_DOWN(va, HUGE_PAGE_1G) + HUGE_PAGE_1G;
+            continue;
+        }
+
+        if (pd[pd_index] & PDXX_COMMON_PS) {
+            if (!(va & (HUGE_PAGE_2M - 1)) && end - va >= HUGE_PAGE_2M) {
+                if (free_pa && pfn_valid((pd[pd_index] & PD_PHYS_MASK) >> PAGE_SHIFT)) {
+                    huge_orders[huge_batched] = 9;
+                    huge_frames[huge_batched++] = phys2page(pd[pd_index] & PD_PHYS_MASK);
+                }
+                if (table_entry_clear(pmc, pd, pd_index))
+                    tables_batched += prune_tables(pmc, pml4_index, pdpt_index, pd_index,
+                        pdpt, pd, NULL, &tables[tables_batched]);
+                unmapped += HUGE_PAGE_2M / PAGE_SIZE;
+                va += HUGE_PAGE_2M;
+                flush = true;
+                goto next;
+            }
+            pt = must_split_leaf(pmc, &pd[pd_index], true);
+            flush = true;
+        } else if (!(pt = attempt_walk_pagemap_single_lvl(pd, pd_index))) {
+            va = ALIGN_DOWN(va, HUGE_PAGE_2M) + HUGE_PAGE_2M;
+            continue;
+        }
+
+        // clear the rest of this table in one go
+        bool empty = false;
+        for (; pt_index < 512 && va < end; pt_index++, va += PAGE_SIZE) {
+            if (!(pt[pt_index] & PM_COMMON_PRESENT))
+                continue;
+            if (free_pa && pfn_valid((pt[pt_index] & PT_PHYS_MASK) >> PAGE_SHIFT))
+                frames[batched++] = phys2page(pt[pt_index] & PT_PHYS_MASK);
+            empty = table_entry_clear(pmc, pt, pt_index);
+            unmapped++;
+            flush = true;
+            if (batched == TLB_BATCH_PAGES) {
+                va += PAGE_SIZE;
+                break;
+            }
+        }
+        if (empty)
+            tables_batched += prune_tables(pmc, pml4_index, pdpt_index, pd_index,
+                pdpt, pd, pt, &tables[tables_batched]);
+
+next:
+        if (va > end)
+            va = end;
+
+        // a single iteration queues up to three tables
+        if (batched == TLB_BATCH_PAGES || huge_batched == TLB_BATCH_PAGES
+            || tables_batched > TLB_BATCH_PAGES - 3) {
+            // flush and free this batch before clearing more
+            spin_unlock_global(&map_page_lock);
+            tlb_shootdown(pmc, batch_start, va);
+            page_free_bulk(PAGES_1_ORDER, frames_put(frames, batched), frames);
+            page_free_bulk(PAGES_1_ORDER, tables_batched, tables);
+            for (size_t i = 0; i < huge_batched; i++)
+                page_free(huge_frames[i], huge_orders[i]);
+            batched = huge_batched = tables_batched = 0;
+            batch_start = va;
+            flush = false;
+            spin_lock_global(&map_page_lock);
+        }
+    }
+
+    spin_unlock_global(&map_page_lock);
+
+    if (flush)
+        tlb_shootdown(pmc, batch_start, end);
+    page_free_bulk(PAGES_1_ORDER, frames_put(frames, batched), frames);
+    page_free_bulk(PAGES_1_ORDER, tables_batched, tables);
+    for (size_t i = 0; i < huge_batched; i++)
+        page_free(huge_frames[i], huge_orders[i]);
+
+    return unmapped;
+}
+
+// return 1 if successful, 0 if nothing got unmapped. a huge leaf covering va gets split,
+// and only the 4kib page at va goes away. that's intended: kfence punches its guard pages
+// into the pool this way, whatever page size vmalloc backed it with
+bool mmu_unmap_single_page(page_map_ctx_t *pmc, uintptr_t va, bool free_pa)
+{
+    return mmu_unmap_range(pmc, va, PAGE_SIZE, free_pa);
+}
+
+bool mmu_share_range(page_map_ctx_t *dst, page_map_ctx_t *src, uintptr_t start, size_t len, bool cow)
+{
+    if (start & 0xfff || len & 0xfff)
+        kpanic(0, NULL, "bad alignment (share range)\n");
+
+    uint64_t *src_pml4 = (uint64_t *)src->pml4_address;
+    uint64_t *dst_pml4 = (uint64_t *)dst->pml4_address;
+    uintptr_t va = start, end = start + len;
+
+    spin_lock_global(&map_page_lock);
+
+    while (va < end) {
+        size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+            pdpt_index = (va & (0x1fful << 30)) >> 30,
+            pd_index = (va & (0x1fful << 21)) >> 21,
+            pt_index = (va & (0x1fful << 12)) >> 12;
+
+        uint64_t *pdpt = attempt_walk_pagemap_single_lvl(src_pml4, pml4_index);
+        if (!pdpt) {
+            va = ALIGN_DOWN(va, 1ul << 39) + (1ul << 39);
+            continue;
+        }
+
+        // frames are shared (and refcounted) 4kib wise, so huge leaves get split
+        uint64_t *pd, *pt;
+        if (pdpt[pdpt_index] & PDXX_COMMON_PS) {
+            if (!(pd = split_leaf(src, &pdpt[pdpt_index], false)))
+                goto fail;
+        } else if (!(pd = attempt_walk_pagemap_single_lvl(pdpt, pdpt_index))) {
+            va = ALIGN_DOWN(va, HUGE_PAGE_1G) + HUGE_PAGE_1G;
+            continue;
+        }
+
+        if (pd[pd_index] & PDXX_COMMON_PS) {
+            if (!(pt = split_leaf(src, &pd[pd_index], true)))
+                goto fail;
+        } else if (!(pt = attempt_walk_pagemap_single_lvl(pd, pd_index))) {
+            va = ALIGN_DOWN(va, HUGE_PAGE_2M) + HUGE_PAGE_2M;
+            continue;
+        }
+
+        uint64_t *dst_pt = NULL;
+        for (; pt_index < 512 && va < end; pt_index++, va += PAGE_SIZE) {
+            uint64_t entry = pt[pt_index];
+            if (!(entry & PM_COMMON_PRESENT))
+                continue;
+
+            if (!dst_pt) {
+                dst_pt = force_walk_pagemap_single_lvl(dst, dst_pml4, pml4_index, table_flags(va));
+                if (dst_pt)
+                    dst_pt = force_walk_pagemap_single_lvl(dst, dst_pt, pdpt_index, table_flags(va));
+                if (dst_pt)
+                    dst_pt = force_walk_pagemap_single_lvl(dst, dst_pt, pd_index, table_flags(va));
+                if (!dst_pt)
+                    goto fail;
+            }
+
+            if (cow && (entry & PM_COMMON_WRITE)) {
+                entry = (entry & ~PM_COMMON_WRITE) | PT_COW;
+                pt[pt_index] = entry;
+            }
+            page_get(phys2page(entry & PT_PHYS_MASK));
+            table_entry_set(dst, dst_pt, pt_index, entry);
+        }
+    }
+
+    spin_unlock_global(&map_page_lock);
+    return true;
+
+fail:
+    spin_unlock_global(&map_page_lock);
+    return false;
+}
+
+// until the shootdown, writes through cached translations don't set the dirty bits again
+static void clean_batch(page_map_ctx_t *pmc, uintptr_t start, uintptr_t end, struct page **frames,
+    uintptr_t *vas, size_t count, void (*writeback)(void *ctx, uintptr_t va, struct page *frame), void *ctx)
+{
+    tlb_shootdown(pmc, start, end);
+    for (size_t i = 0; i < count; i++) {
+        writeback(ctx, vas[i], frames[i]);
+        if (page_put(frames[i]))
+            page_free(frames[i], PAGES_1_ORDER);
+    }
+}
+
+void mmu_clean_range(page_map_ctx_t *pmc, uintptr_t va, size_t len,
+    void (*writeback)(void *ctx, uintptr_t va, struct page *frame), void *ctx)
+{
+    if (va & 0xfff || len & 0xfff)
+        kpanic(0, NULL, "bad alignment (clean range)\n");
+
+    struct page *frames[TLB_BATCH_PAGES];
+    uintptr_t vas[TLB_BATCH_PAGES];
+    size_t batched = 0;
+
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
+    uintptr_t batch_start = va, end = va + len;
+
+    spin_lock_global(&map_page_lock);
+
+    while (va < end) {
+        size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+            pdpt_index = (va & (0x1fful << 30)) >> 30,
+            pd_index = (va & (0x1fful << 21)) >> 21,
+            pt_index = (va & (0x1fful << 12)) >> 12;
+
+        uint64_t *pdpt = attempt_walk_pagemap_single_lvl(pml4, pml4_index);
+        if (!pdpt) {
+            va = ALIGN_DOWN(va, 1ul << 39) + (1ul << 39);
+            continue;
+        }
+
+        // huge leaves don't map files
+        uint64_t *pd = (pdpt[pdpt_index] & PDXX_COMMON_PS) ? NULL : attempt_walk_pagemap_single_lvl(pdpt, pdpt_index);
+        if (!pd) {
+            va = ALIGN_DOWN(va, HUGE_PAGE_1G) + HUGE_PAGE_1G;
+            continue;
+        }
+
+        uint64_t *pt = (pd[pd_index] & PDXX_COMMON_PS) ? NULL : attempt_walk_pagemap_single_lvl(pd, pd_index);
+        if (!pt) {
+            va = ALIGN_DOWN(va, HUGE_PAGE_2M) + HUGE_PAGE_2M;
+            continue;
+        }
+
+        for (; pt_index < 512 && va < end && batched < TLB_BATCH_PAGES; pt_index++, va += PAGE_SIZE) {
+            if ((pt[pt_index] & (PM_COMMON_PRESENT | PT_DIRTY)) != (PM_COMMON_PRESENT | PT_DIRTY))
+                continue;
+            pt[pt_index] &= ~PT_DIRTY;
+            // the mapping may go away during the writeback
+            frames[batched] = phys2page(pt[pt_index] & PT_PHYS_MASK);
+            page_get(frames[batched]);
+            vas[batched++] = va;
+        }
+
+        if (va > end)
+            va = end;
+
+        if (batched == TLB_BATCH_PAGES) {
+            spin_unlock_global(&map_page_lock);
+            clean_batch(pmc, batch_start, va, frames, vas, batched, writeback, ctx);
+            batched = 0;
+            batch_start = va;
+            spin_lock_global(&map_page_lock);
+        }
+    }
+
+    spin_unlock_global(&map_page_lock);
+
+    if (batched)
+        clean_batch(pmc, batch_start, end, frames, vas, batched, writeback, ctx);
+}
+
+bool mmu_cow_fault(page_map_ctx_t *pmc, uintptr_t va)
+{
+    va = ALIGN_DOWN(va, PAGE_SIZE);
+
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
 
     size_t pml4_index = (va & (0x1fful << 39)) >> 39,
         pdpt_index = (va & (0x1fful << 30)) >> 30,
-        pd_index = (va & (0x1fful << 21)) >> 21;
+        pd_index = (va & (0x1fful << 21)) >> 21,
+        pt_index = (va & (0x1fful << 12)) >> 12;
+
+    // the copy gets allocated up front, there's no reclaim with map_page_lock held
+    struct page *copy = page_alloc(PAGES_1_ORDER);
+
+    spin_lock_global(&map_page_lock);
+
+    uint64_t *pmlx = attempt_walk_pagemap_single_lvl(pml4, pml4_index);
+    if (pmlx && !(pmlx[pdpt_index] & PDXX_COMMON_PS))
+        pmlx = attempt_walk_pagemap_single_lvl(pmlx, pdpt_index);
+    else
+        pmlx = NULL;
+    if (pmlx && !(pmlx[pd_index] & PDXX_COMMON_PS))
+        pmlx = attempt_walk_pagemap_single_lvl(pmlx, pd_index);
+    else
+        pmlx = NULL;
+
+    uint64_t entry = pmlx ? pmlx[pt_index] : 0;
+    if ((entry & (PM_COMMON_PRESENT | PT_COW)) != (PM_COMMON_PRESENT | PT_COW)) {
+        spin_unlock_global(&map_page_lock);
+        if (copy)
+            page_free(copy, PAGES_1_ORDER);
+        // another cpu broke the sharing already, the access can be retried
+        return (entry & (PM_COMMON_PRESENT | PM_COMMON_WRITE)) == (PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    }
+
+    struct page *old = phys2page(entry & PT_PHYS_MASK);
+    entry = (entry & ~PT_COW) | PM_COMMON_WRITE;
 
-    uint64_t *pmlx = force_walk_pagemap_single_lvl(pml4, pml4_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    // the last mapping left takes the frame over. raising permissions needs no shootdown,
+    // a stale read only translation just faults again
+    if (!page_shared(old)) {
+        pmlx[pt_index] = entry;
+        spin_unlock_global(&map_page_lock);
+        if (copy)
+            page_free(copy, PAGES_1_ORDER);
+        return true;
+    }
 
-    pmlx = force_walk_pagemap_single_lvl(pmlx, pdpt_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    if (!copy) {
+        spin_unlock_global(&map_page_lock);
+        kprintf("  - mmu: out of memory breaking cow at 0x%p\n", va);
+        return false;
+    }
+    memcpy((void *)(page2phys(copy) + hhdm->offset), (void *)(page2phys(old) + hhdm->offset), PAGE_SIZE);
+    pmlx[pt_index] = page2phys(copy) | (entry & ~PT_PHYS_MASK);
 
-    pmlx = force_walk_pagemap_single_lvl(pmlx, pd_index,
-        PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    spin_unlock_global(&map_page_lock);
 
-    return pmlx;
+    // other cpus may still read the old frame through this address space
+    tlb_shootdown(pmc, va, va + PAGE_SIZE);
+    if (page_put(old))
+        page_free(old, PAGES_1_ORDER);
+    return true;
 }
 
-// return 1 if successful, 0 if nothing got unmapped
-bool mmu_unmap_single_page(page_map_ctx_t *pmc, uintptr_t va, bool free_pa)
+// page table mapping the 2mib aligned va, NULL if there's none. call with map_page_lock held
+static uint64_t *collapse_walk(page_map_ctx_t *pmc, uintptr_t va, uint64_t **pd, size_t *pd_index)
 {
-    (void)pmc;
-    (void)va;
-    (void)free_pa;
+    size_t pml4_index = (va & (0x1fful << 39)) >> 39,
+        pdpt_index = (va & (0x1fful << 30)) >> 30;
+    *pd_index = (va & (0x1fful << 21)) >> 21;
 
-    /*spin_lock_global(&map_page_lock);
-    size_t pt_index = (va & (0x1fful << 12)) >> 12;
-    uint64_t *pt = pml4_to_pt((uint64_t *)pmc->pml4_address, va, false);
-    if (pt == NULL) {
+    uint64_t *pdpt = attempt_walk_pagemap_single_lvl((uint64_t *)pmc->pml4_address, pml4_index);
+    if (!pdpt || (pdpt[pdpt_index] & PDXX_COMMON_PS))
+        return NULL;
+    if (!(*pd = attempt_walk_pagemap_single_lvl(pdpt, pdpt_index)) || ((*pd)[*pd_index] & PDXX_COMMON_PS))
+        return NULL;
+    return attempt_walk_pagemap_single_lvl(*pd, *pd_index);
+}
+
+// permissions a collapsed leaf keeps, cow marks of mmu_collapse_begin() count as writable
+static inline uint64_t collapse_prot(uint64_t pte)
+{
+    return (pte & (PM_COMMON_PRESENT | PM_COMMON_WRITE | PM_COMMON_USER | PM_COMMON_NX))
+        | ((pte & PT_COW) ? PM_COMMON_WRITE : 0);
+}
+
+bool mmu_collapse_begin(page_map_ctx_t *pmc, uintptr_t va, uint64_t *ptes, size_t min_present)
+{
+    if (va & (HUGE_PAGE_2M - 1))
+        kpanic(0, NULL, "bad alignment (collapse)\n");
+
+    spin_lock_global(&map_page_lock);
+
+    uint64_t *pd;
+    size_t pd_index;
+    uint64_t *pt = collapse_walk(pmc, va, &pd, &pd_index);
+    if (!pt || table2page(pt)->pt_used < min_present) {
         spin_unlock_global(&map_page_lock);
         return false;
     }
 
-    // free page
-    if (free_pa) {
-        page_free_temp((void *)(pt[pt_index] & PML_LOWER_MASK), 1);
+    // only private frames with plain write back caching and one set of permissions
+    uint64_t prot = 0;
+    for (size_t i = 0; i < 512; i++) {
+        uint64_t entry = pt[i];
+        if (!(entry & PM_COMMON_PRESENT))
+            continue;
+        if ((entry & (PT_COW | PM_COMMON_PWT | PM_COMMON_PCD | PT_PAT))
+            || page_shared(phys2page(entry & PT_PHYS_MASK))
+            || (prot && collapse_prot(entry) != prot)) {
+            spin_unlock_global(&map_page_lock);
+            return false;
+        }
+        prot = collapse_prot(entry);
     }
 
-    // unmap page
-    pt[pt_index] = 0;
+    for (size_t i = 0; i < 512; i++) {
+        if (pt[i] & PM_COMMON_WRITE)
+            pt[i] = (pt[i] & ~PM_COMMON_WRITE) | PT_COW;
+        ptes[i] = pt[i];
+    }
 
-    tlb_flush();
+    spin_unlock_global(&map_page_lock);
+    return true;
+}
 
-    spin_unlock_global(&map_page_lock);*/
+struct page *mmu_collapse_end(page_map_ctx_t *pmc, uintptr_t va, const uint64_t *ptes, struct page *huge, bool commit)
+{
+    spin_lock_global(&map_page_lock);
 
-    return true;
+    uint64_t *pd;
+    size_t pd_index;
+    uint64_t *pt = collapse_walk(pmc, va, &pd, &pd_index);
+
+    // reads may have set accessed bits in between. a fork leaves our cow entries as they
+    // are, but takes references of their frames
+    uint64_t prot = 0;
+    for (size_t i = 0; pt && i < 512; i++) {
+        if ((pt[i] ^ ptes[i]) & ~PM_COMMON_ACCESSED)
+            commit = false;
+        if (ptes[i] & PM_COMMON_PRESENT) {
+            prot = collapse_prot(ptes[i]);
+            if (page_shared(phys2page(ptes[i] & PT_PHYS_MASK)))
+                commit = false;
+        }
+    }
+
+    if (!pt || !commit) {
+        // raising permissions doesn't need a flush. frames shared since then stay cow
+        for (size_t i = 0; pt && i < 512; i++)
+            if (!((pt[i] ^ ptes[i]) & ~PM_COMMON_ACCESSED) && (ptes[i] & PT_COW)
+                && !page_shared(phys2page(ptes[i] & PT_PHYS_MASK)))
+                pt[i] = (pt[i] & ~PT_COW) | PM_COMMON_WRITE;
+        spin_unlock_global(&map_page_lock);
+        return NULL;
+    }
+
+    // the pd entry stays present, its pt_used doesn't change
+    pd[pd_index] = page2phys(huge) | prot | PDXX_COMMON_PS;
+    pmc->table_pages--;
+
+    spin_unlock_global(&map_page_lock);
+    return table2page(pt);
 }
 
 uintptr_t virt2phys(page_map_ctx_t *pmc, uintptr_t virt)
@@ -398,6 +1334,14 @@ static void init_kpm(void)
         kpanic(0, NULL, "Kernel Address request failed!\n");
     }
 
+    // every pdpt of the kernel half exists from the start and is never freed, so other
+    // address spaces can share them by copying the upper pml4 half once
+    spin_lock_global(&map_page_lock);
+    for (size_t i = 256; i < 512; i++)
+        must_walk_pagemap_single_lvl(&kernel_pmc, (uint64_t *)kernel_pmc.pml4_address, i,
+            PM_COMMON_PRESENT | PM_COMMON_WRITE);
+    spin_unlock_global(&map_page_lock);
+
     // limine
     kernel_address = kernel_address_request.response;
     mmu_map_single_page_4k(&kernel_pmc, ALIGN_DOWN((lapic_address + hhdm->offset), PAGE_SIZE),
@@ -408,9 +1352,10 @@ static void init_kpm(void)
     for (size_t i = 0; i < early_mem_allocations; i++) {
         struct early_mem_alloc_mapping *mapping = &early_mem_mappings[i];
 
-        for (size_t off = ALIGN_DOWN(mapping->start, PAGE_SIZE); off < ALIGN_UP(mapping->start + mapping->length, PAGE_SIZE); off += PAGE_SIZE) {
-            mmu_map_single_page_4k(&kernel_pmc, off + hhdm->offset, off, PM_COMMON_PRESENT | PM_COMMON_WRITE);
-        }
+        uintptr_t start = ALIGN_DOWN(mapping->start, PAGE_SIZE);
+        mmu_map_range(&kernel_pmc, start + hhdm->offset, start,
+            ALIGN_UP(mapping->start + mapping->length, PAGE_SIZE) - start,
+            PM_COMMON_PRESENT | PM_COMMON_WRITE, PM_COMMON_PRESENT | PM_COMMON_WRITE);
     }
 
     for (size_t i = 0; i < memmap_entry_count; i++) {
@@ -431,7 +1376,6 @@ static void init_kpm(void)
             mmu_map_range_linear(&kernel_pmc, ALIGN_DOWN(entry->start + hhdm->offset, PAGE_SIZE),
                 ALIGN_DOWN(entry->start, PAGE_SIZE), ALIGN_UP(entry->length, PAGE_SIZE),
                 MAF_NX | MAF_WRITE, MCT_WRITE_COMBINING);
-                // [FIXME] pat!!!
         }
         // bootloader reclaimable
         else if (entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
@@ -454,7 +1398,121 @@ static void init_kpm(void)
         data_end - data_start, MAF_WRITE | MAF_NX, MCT_WRITE_BACK);
 
     mmu_set_ctx(&kernel_pmc);
-    tlb_flush();
+}
+
+page_map_ctx_t *mmu_pmc_create(void)
+{
+    page_map_ctx_t *pmc = kcalloc(1, sizeof(page_map_ctx_t));
+    if (!pmc)
+        return NULL;
+
+    struct page *pml4 = page_calloc(PAGES_1_ORDER);
+    if (!pml4) {
+        kfree(pmc);
+        return NULL;
+    }
+
+    pmc->pml4_address = page2phys(pml4) + hhdm->offset;
+    pmc->refcount = 1;
+    init_root_node(&pmc->vma_root);
+
+    memcpy((uint64_t *)pmc->pml4_address + 256, (uint64_t *)kernel_pmc.pml4_address + 256,
+        256 * sizeof(uint64_t));
+
+    spin_lock_global(&pmc_list_lock);
+    pmc->prev = NULL;
+    pmc->next = pmc_list;
+    if (pmc_list)
+        pmc_list->prev = pmc;
+    pmc_list = pmc;
+    spin_unlock_global(&pmc_list_lock);
+
+    return pmc;
+}
+
+page_map_ctx_t *mmu_pmc_get(page_map_ctx_t *pmc)
+{
+    if (pmc != &kernel_pmc)
+        __atomic_add_fetch(&pmc->refcount, 1, __ATOMIC_RELAXED);
+    return pmc;
+}
+
+// free the user half tables below pmc. no cpu runs it anymore, so nothing to flush
+static void pmc_destroy(page_map_ctx_t *pmc)
+{
+    uint64_t *pml4 = (uint64_t *)pmc->pml4_address;
+    size_t freed = 0;
+
+    for (size_t i = 0; i < 256; i++) {
+        uint64_t *pdpt = attempt_walk_pagemap_single_lvl(pml4, i);
+        if (!pdpt)
+            continue;
+
+        for (size_t j = 0; j < 512; j++) {
+            if (pdpt[j] & PDXX_COMMON_PS)
+                continue;
+            uint64_t *pd = attempt_walk_pagemap_single_lvl(pdpt, j);
+            if (!pd)
+                continue;
+
+            for (size_t k = 0; k < 512; k++) {
+                if (pd[k] & PDXX_COMMON_PS)
+                    continue;
+                uint64_t *pt = attempt_walk_pagemap_single_lvl(pd, k);
+                if (pt) {
+                    page_free(table2page(pt), PAGES_1_ORDER);
+                    freed++;
+                }
+            }
+            page_free(table2page(pd), PAGES_1_ORDER);
+            freed++;
+        }
+        page_free(table2page(pdpt), PAGES_1_ORDER);
+        freed++;
+    }
+
+    if (freed != pmc->table_pages)
+        kprintf("  - mmu: pmc 0x%p had %lu page tables, freed %lu\n", pmc, pmc->table_pages, freed);
+
+    page_free(table2page(pml4), PAGES_1_ORDER);
+    kfree(pmc);
+}
+
+void mmu_pmc_put(page_map_ctx_t *pmc)
+{
+    if (pmc == &kernel_pmc)
+        return;
+
+    // mmu_pmc_next() only picks up listed address spaces, which are still referenced
+    spin_lock_global(&pmc_list_lock);
+    bool last = !__atomic_sub_fetch(&pmc->refcount, 1, __ATOMIC_ACQ_REL);
+    if (last) {
+        if (pmc->prev)
+            pmc->prev->next = pmc->next;
+        else
+            pmc_list = pmc->next;
+        if (pmc->next)
+            pmc->next->prev = pmc->prev;
+    }
+    spin_unlock_global(&pmc_list_lock);
+
+    if (last) {
+        vma_unmap_all(pmc);
+        pmc_destroy(pmc);
+    }
+}
+
+page_map_ctx_t *mmu_pmc_next(page_map_ctx_t *prev)
+{
+    spin_lock_global(&pmc_list_lock);
+    page_map_ctx_t *next = prev ? prev->next : pmc_list;
+    if (next)
+        mmu_pmc_get(next);
+    spin_unlock_global(&pmc_list_lock);
+
+    if (prev)
+        mmu_pmc_put(prev);
+    return next;
 }
 
 inline void mmu_set_ctx(const page_map_ctx_t *pmc)
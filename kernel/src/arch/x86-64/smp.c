@@ -6,6 +6,7 @@
 #include "gdt.h"
 #include "interrupt.h"
 #include "frame_alloc.h"
+#include "numa.h"
 #include "mmu.h"
 #include "cpu.h"
 #include "apic.h"
@@ -31,6 +32,7 @@ static void processor_core_entry(struct limine_smp_info *smp_info)
     rld_gdt();
     load_idt();
 
+    pat_init();
     mmu_set_ctx(&kernel_pmc);
 
     cpu_local_t *this_cpu = (cpu_local_t *)smp_info->extra_argument;
@@ -42,6 +44,7 @@ static void processor_core_entry(struct limine_smp_info *smp_info)
 
     write_gs_base(0x12345);
     write_kernel_gs_base(this_cpu);
+    this_cpu->active_pml4 = kernel_pmc.pml4_address;
 
     // NOT lapic id in IA32_TSC_AUX
     if (tscp_supported())
@@ -92,6 +95,8 @@ void boot_other_cores(void)
 
         global_cpus[i].id = smp_info->processor_id;
         global_cpus[i].lapic_id = smp_info->lapic_id;
+        global_cpus[i].numa_node = numa_node_of_lapic(smp_info->lapic_id);
+        page_pcp_init_cpu(&global_cpus[i]);
 
         smp_info->extra_argument = (uintptr_t)(&global_cpus[i]);
 
@@ -40,6 +40,22 @@ static bool validate_table(volatile struct acpi_sdt_header *table_header)
     return (sum == 0);
 }
 
+// find the rsdt / xsdt without touching the page tables, so get_sdt() can be
+// used before the vmm is up. limines hhdm covers the acpi tables until then.
+void acpi_early_init(void)
+{
+    if (rsdp_request.response == NULL || rsdp_request.response->address == NULL) {
+        kpanic(0, NULL, "ACPI is not supported\n");
+    }
+
+    rsdp_ptr = rsdp_request.response->address;
+
+    xsdt_present = (rsdp_ptr->revision >= 2) ? true : false;
+    rsdt_ptr = xsdt_present ?
+        (struct acpi_rsdt *)((uintptr_t)rsdp_ptr->xsdt_address + hhdm->offset)
+        : (struct acpi_rsdt *)((uintptr_t)rsdp_ptr->rsdt_address + hhdm->offset);
+}
+
 // [FIXME] fix this shitty stuff with the mapping
 void parse_acpi(void)
 {
@@ -9,6 +9,7 @@
 #include "math.h"
 #include "device.h"
 #include "disk_partition.h"
+#include "vmalloc.h"
 
 VECTOR_TMPL_TYPE_NON_NATIVE(nvme_ns_ctx)
 
@@ -40,8 +41,17 @@ static void nvme_cmdset_struct_verify_size()
 }
 #endif // MUNKOS_DEBUG_BUILD
 
+// lru nodes and hashmap collision entries of all block caches
+static struct slab_cache *nvme_lru_node_cache;
+static struct slab_cache *nvme_hashmap_entry_cache;
+
 static void nvme_cache_container_init(struct nvme_cache_container *container)
 {
+    container->cache = kvmalloc(NVME_NCACHES * sizeof(struct nvme_cache_entry));
+    container->hashmap = kvmalloc(NVME_HASHMAP_SIZE * sizeof(struct nvme_cache_hashmap_entry));
+    if (!container->cache || !container->hashmap)
+        kpanic(0, NULL, "NVME_INIT: couldn't allocate block cache tables\n");
+
     for (size_t i = 0; i < NVME_NCACHES; i++) {
         container->cache[i].status = NVME_CACHE_EMPTY;
         container->cache[i].bid = NVME_IDX_INV;
@@ -56,7 +66,7 @@ static void nvme_cache_container_init(struct nvme_cache_container *container)
 
     container->head = container->tail = NULL;
     for (size_t i = 0; i < NVME_NCACHES - 0; i++) {
-        struct nvme_cache_dll_node *new = kcalloc(1, sizeof(struct nvme_cache_dll_node));
+        struct nvme_cache_dll_node *new = kmem_cache_alloc(nvme_lru_node_cache);
         new->next = NULL;
         new->prev = NULL;
         new->index = i;
@@ -82,8 +92,19 @@ static void nvme_cache_container_cleanup(struct nvme_cache_container *container)
         struct nvme_cache_dll_node *cpy = node;
         node = node->next;
         kfree(container->cache[cpy->index].block);
-        kfree(cpy);
+        kmem_cache_free(nvme_lru_node_cache, cpy);
+    }
+
+    for (size_t i = 0; i < NVME_HASHMAP_SIZE; i++) {
+        while (container->hashmap[i].next) {
+            struct nvme_cache_hashmap_entry *next = container->hashmap[i].next->next;
+            kmem_cache_free(nvme_hashmap_entry_cache, container->hashmap[i].next);
+            container->hashmap[i].next = next;
+        }
     }
+
+    kvfree(container->cache);
+    kvfree(container->hashmap);
 }
 
 // call if some block isn't yet cached
@@ -93,6 +114,8 @@ static size_t nvme_cache_lru_evict(struct nvme_cache_container *container)
     size_t index = container->tail->index;
     if (container->cache[index].status == NVME_CACHE_EMPTY) {
         container->cache[index].block = kcalloc(1, NVME_BLOCK_SIZE);
+        if (!container->cache[index].block)
+            return NVME_IDX_INV;
         container->cache[index].status = NVME_CACHE_VALID;
     }
     return index;
@@ -127,6 +150,32 @@ static void nvme_cache_inform_usage(struct nvme_cache_container *container, size
     container->head = node;
 }
 
+// move entry at index to the end of the queue, so it gets reused first
+static void nvme_cache_lru_demote(struct nvme_cache_container *container, size_t index)
+{
+    struct nvme_cache_dll_node *node = container->cache[index].lruref;
+
+    if (node == container->tail) {
+        return;
+    }
+
+    // unlink it
+    if (node->prev) {
+        node->prev->next = node->next;
+    }
+    node->next->prev = node->prev;
+
+    if (node == container->head) {
+        container->head = node->next;
+    }
+
+    // insert it at the back
+    node->prev = container->tail;
+    node->next = NULL;
+    container->tail->next = node;
+    container->tail = node;
+}
+
 // jenkins hash. why? because it was the first result on google
 static inline uint64_t nvme_cache_hash_func(uint64_t in)
 {
@@ -137,26 +186,32 @@ static inline uint64_t nvme_cache_hash_func(uint64_t in)
     return in % NVME_HASHMAP_SIZE;
 }
 
+// remove the mapping for old_bid
+static void nvme_cache_hashmap_remove(struct nvme_cache_hashmap_entry *hashmap, uint64_t old_bid)
+{
+    uint64_t old_idx = nvme_cache_hash_func(old_bid);
+
+    if (hashmap[old_idx].bid == old_bid) {
+        // if it's in the array
+        hashmap[old_idx].bid = NVME_IDX_INV;
+        hashmap[old_idx].index = NVME_IDX_INV;
+    } else {
+        struct nvme_cache_hashmap_entry *item = &hashmap[old_idx];
+        while (item->next->bid != old_bid) {
+            item = item->next;
+        }
+        struct nvme_cache_hashmap_entry *next = item->next->next;
+        kmem_cache_free(nvme_hashmap_entry_cache, item->next);
+        item->next = next;
+    }
+}
+
 // if old_bid == NVME_IDX_INV: add new entry for bid with the value index
 // else: remove old_bid mapping, --||--
 static void nvme_cache_hashmap_update(struct nvme_cache_hashmap_entry *hashmap, uint64_t old_bid, uint64_t bid, uint64_t index)
 {
     if (old_bid != NVME_IDX_INV) {
-        uint64_t old_idx = nvme_cache_hash_func(old_bid);
-
-        if (hashmap[old_idx].bid == old_bid) {
-            // if it's in the array
-            hashmap[old_idx].bid = NVME_IDX_INV;
-            hashmap[old_idx].index = NVME_IDX_INV;
-        } else {
-            struct nvme_cache_hashmap_entry *item = &hashmap[old_idx];
-            while (item->next->bid != old_bid) {
-                item = item->next;
-            }
-            struct nvme_cache_hashmap_entry *next = item->next->next;
-            kfree(item->next);
-            item->next = next;
-        }
+        nvme_cache_hashmap_remove(hashmap, old_bid);
     }
 
     uint64_t idx = nvme_cache_hash_func(bid);
@@ -167,7 +222,7 @@ static void nvme_cache_hashmap_update(struct nvme_cache_hashmap_entry *hashmap,
         hashmap[idx].index = index;
     } else {
         struct nvme_cache_hashmap_entry *old_next = hashmap[idx].next;
-        hashmap[idx].next = kcalloc(1, sizeof(struct nvme_cache_hashmap_entry));
+        hashmap[idx].next = kmem_cache_alloc(nvme_hashmap_entry_cache);
         hashmap[idx].next->bid = bid;
         hashmap[idx].next->index = index; 
         hashmap[idx].next->next = old_next;
@@ -200,6 +255,10 @@ static size_t nvme_read_block(struct nvme_ns_ctx *ns, size_t block)
         return index;
     } else {
         size_t evicted_idx = nvme_cache_lru_evict(container);
+        if (evicted_idx == NVME_IDX_INV) {
+            kprintf_verbose("Failed to allocate cache block for block %lu\n", block);
+            return NVME_IDX_INV;
+        }
         if (container->cache[evicted_idx].status == NVME_CACHE_DIRTY) {
             if (!nvme_rw_blocking(ns, (NVME_BLOCK_SIZE / ns->lba_size)
                     * container->cache[evicted_idx].bid, (NVME_BLOCK_SIZE / ns->lba_size),
@@ -241,6 +300,10 @@ static size_t nvme_prep_write_full_block(struct nvme_ns_ctx *ns, size_t block)
         return index;
     } else {
         size_t evicted_idx = nvme_cache_lru_evict(container);
+        if (evicted_idx == NVME_IDX_INV) {
+            kprintf_verbose("Failed to allocate cache block for block %lu\n", block);
+            return NVME_IDX_INV;
+        }
         if (container->cache[evicted_idx].status == NVME_CACHE_DIRTY) {
             if (!nvme_rw_blocking(ns, (NVME_BLOCK_SIZE / ns->lba_size)
                     * container->cache[evicted_idx].bid, (NVME_BLOCK_SIZE / ns->lba_size),
@@ -274,6 +337,57 @@ static void nvme_flush_blocks(struct nvme_cache_container *container)
     }
 }
 
+// clean cached blocks of a namespace device, in pages
+static size_t nvme_cache_shrink_count(struct shrinker *this)
+{
+    struct device *dev = this->private;
+    struct nvme_cache_container *container = &((struct nvme_ns_ctx *)dev->dev_specific)->cache_container;
+
+    // just a hint, no need to lock
+    size_t clean = 0;
+    for (size_t i = 0; i < NVME_NCACHES; i++) {
+        if (container->cache[i].status == NVME_CACHE_VALID)
+            clean++;
+    }
+    return (clean * NVME_BLOCK_SIZE) / PAGE_SIZE;
+}
+
+// drop clean blocks, least recently used first. dirty blocks stay, since writing
+// them back would have to wait for the device
+static size_t nvme_cache_shrink_scan(struct shrinker *this, size_t nr)
+{
+    struct device *dev = this->private;
+    struct nvme_cache_container *container = &((struct nvme_ns_ctx *)dev->dev_specific)->cache_container;
+
+    // the device lock is held while allocating cache blocks
+    if (!spin_trylock(&dev->lock))
+        return 0;
+
+    size_t dropped = 0;
+    struct nvme_cache_dll_node *node = container->tail;
+    while (node && dropped * NVME_BLOCK_SIZE < nr * PAGE_SIZE) {
+        struct nvme_cache_dll_node *prev = node->prev;
+        struct nvme_cache_entry *entry = &container->cache[node->index];
+
+        if (entry->status == NVME_CACHE_VALID) {
+            nvme_cache_hashmap_remove(container->hashmap, entry->bid);
+            kfree(entry->block);
+            entry->block = NULL;
+            entry->bid = NVME_IDX_INV;
+            entry->status = NVME_CACHE_EMPTY;
+            nvme_cache_lru_demote(container, node->index);
+            dropped++;
+        }
+
+        node = prev;
+    }
+
+    spin_unlock(&dev->lock);
+
+    // the blocks are slab objects, the slab shrinker turns them into pages
+    return (dropped * NVME_BLOCK_SIZE) / PAGE_SIZE;
+}
+
 static void nvme_debug_cqe_unsuccessful(nvme_ccmd_t cqe)
 {
     kprintf("  - nvme: cqe failed!\ncid = %u, phase = %u, status = %u [sct=0x%X, sc=0x%X], sqid = %u\n",
@@ -375,7 +489,8 @@ static nvme_ccmd_t nvme_queue_poll_single_cqe(struct nvme_queue_ctx *queue)
     // free prp list if one was used
     uintptr_t cpy = queue->prp_list_container[out.cid % queue->entries];
     if (cpy != 0) {
-        mmu_unmap_single_page(&kernel_pmc, cpy, true);
+        // the list is a hhdm page, just give it back
+        page_free(phys2page(cpy - hhdm->offset), 0);
         queue->prp_list_container[out.cid % queue->entries] = 0;
     }
 
@@ -439,6 +554,14 @@ void init_nvme_controller(pci_device *dev)
     nvme_cmdset_struct_verify_size();
 #endif // MUNKOS_DEBUG_BUILD
 
+    // controllers are probed one after another during pci enumeration
+    if (!nvme_lru_node_cache) {
+        nvme_lru_node_cache = kmem_cache_create("nvme_lru_node", sizeof(struct nvme_cache_dll_node), 8, NULL);
+        nvme_hashmap_entry_cache = kmem_cache_create("nvme_hashmap_entry", sizeof(struct nvme_cache_hashmap_entry), 8, NULL);
+        if (!nvme_lru_node_cache || !nvme_hashmap_entry_cache)
+            kpanic(0, NULL, "NVME_INIT: couldn't create block cache caches\n");
+    }
+
     struct nvme_controller *controller = kcalloc(1, sizeof(struct nvme_controller));
     VECTOR_REINIT(controller->active_ns, nvme_ns_ctx);
 
@@ -449,15 +572,8 @@ void init_nvme_controller(pci_device *dev)
     pci_read_bar(dev, &nvme_pci_bar0, 0);
 
     //if (!nvme_pci_bar0.is_mmio_bar) kpanic(0, NULL, "NVME_INIT: pci bar0 is not mmio mapped\n");
-    for (uintptr_t ptr = ALIGN_DOWN((uintptr_t)nvme_pci_bar0.base, PAGE_SIZE);
-        ptr < ALIGN_UP((uintptr_t)nvme_pci_bar0.base + nvme_pci_bar0.size, PAGE_SIZE); ptr += PAGE_SIZE) {
-        mmu_unmap_single_page(&kernel_pmc, ptr + hhdm->offset, false); // do not free page
-        mmu_map_single_page_4k(&kernel_pmc, ptr + hhdm->offset, ptr,
-            PM_COMMON_PCD | PM_COMMON_NX | PM_COMMON_PRESENT | PM_COMMON_WRITE);
-    }
-
-
-    controller->properties = (volatile struct nvme_controller_properties *)((uintptr_t)nvme_pci_bar0.base + hhdm->offset);
+    controller->properties = (volatile struct nvme_controller_properties *)pci_map_bar(&nvme_pci_bar0);
+    if (!controller->properties) kpanic(0, NULL, "NVME_INIT: couldn't map pci bar0\n");
 
     if (!controller->properties->version) kpanic(0, NULL, "NVME_INIT: invalid controller version\n");
 
@@ -612,6 +728,14 @@ not_supported:
         nvme_ns_dev->read = nvme_read;
         nvme_ns_dev->write = nvme_write;
 
+        // let the block cache shrink under memory pressure
+        struct shrinker *shrinker = kcalloc(1, sizeof(struct shrinker));
+        shrinker->name = "nvme block cache";
+        shrinker->count = nvme_cache_shrink_count;
+        shrinker->scan = nvme_cache_shrink_scan;
+        shrinker->private = nvme_ns_dev;
+        shrinker_register(shrinker);
+
         tempdev = nvme_ns_dev;
     }
 
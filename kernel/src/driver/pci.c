@@ -5,6 +5,7 @@
 #include "kprintf.h"
 #include "frame_alloc.h"
 #include "mmu.h"
+#include "ioremap.h"
 #include "nvme.h"
 
 VECTOR_TMPL_TYPE_NON_NATIVE(mcfg_entry);
@@ -242,6 +243,15 @@ void pci_read_bar(pci_device *dev, struct pci_base_addr_reg_ctx *bar_ctx, int ba
     pci_write(dev, PCI_HEADER_REG0x1, cmd_reg, WORD);
 }
 
+volatile void *pci_map_bar(struct pci_base_addr_reg_ctx *bar_ctx)
+{
+    if (!bar_ctx->is_mmio_bar)
+        return NULL;
+
+    return ioremap((uintptr_t)bar_ctx->base, bar_ctx->size,
+        bar_ctx->is_prefetchable ? MCT_WRITE_COMBINING : MCT_UNCACHEABLE);
+}
+
 // ZEROES OUT the reg and then sets all flags
 void pci_set_command_reg(pci_device *dev, uint16_t flags)
 {
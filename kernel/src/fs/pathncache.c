@@ -5,9 +5,18 @@
 #include "kheap.h"
 #include "kprintf.h"
 
+static struct slab_cache *pnc_entry_cache;
+
+void pnc_init(void)
+{
+    pnc_entry_cache = kmem_cache_create("pnc_entry", sizeof(struct pnc_entry), 8, NULL);
+    if (!pnc_entry_cache)
+        kpanic(0, NULL, "couldn't create pnc_entry cache\n");
+}
+
 struct pnc_entry *new_pnc_entry(struct vfs_vnode *vnode, struct pnc_entry *parent, const char *pathn, size_t len, size_t hash)
 {
-    struct pnc_entry *ent = kmalloc(sizeof(struct pnc_entry));
+    struct pnc_entry *ent = kmem_cache_alloc(pnc_entry_cache);
     init_root_node(&ent->entries_root);
     ent->next = NULL;
     ent->prev = NULL;
@@ -92,7 +101,7 @@ retry:
         entry->parent->name_len, entry->parent->path_section);
 
     kfree(evicted->path_section);
-    kfree(evicted);
+    kmem_cache_free(pnc_entry_cache, evicted);
 }
 
 struct pnc_entry *pnc_lookup_section(struct pnc_entry *dir, const char *section, size_t len)
@@ -3,6 +3,7 @@
 #include "interrupt.h"
 #include "kheap.h"
 #include "kprintf.h"
+#include "macros.h"
 #include "process.h"
 #include "time.h"
 #include "vfs.h"
@@ -32,9 +33,32 @@ int ramfs_vn_rdwr(struct vfs_vnode *this, struct vfs_uio *uiop, size_t flags);
 int ramfs_vn_lookup(struct vfs_vnode *dir, const char *pathn, size_t len, struct vfs_vnode **result);
 int ramfs_vn_create(struct vfs_vnode *dir, const char *filen, size_t len,
         struct vfs_vattr *attribs, struct vfs_vnode **result);
+int ramfs_vn_getpage(struct vfs_vnode *this, size_t index, struct page **result);
+int ramfs_vn_putpage(struct vfs_vnode *this, size_t index, struct page *page);
 
 struct ramdisk *ramdisks;
 
+// called by compaction with mapping->lock being held
+static void rd_migrate_page(struct page_mapping *mapping, size_t index, struct page *old, struct page *new)
+{
+    struct ramdisk_file *file = mapping->private;
+
+    if (file->file.pages[index] != old)
+        kpanic(0, NULL, "ramfs: migrating page %lu of %s, which isn't mapped there\n", index, file->name);
+    file->file.pages[index] = new;
+}
+
+static void rd_free_pages(struct ramdisk_file *file)
+{
+    for (size_t i = 0; i < file->file.page_count; i++)
+        page_free_movable(file->file.pages[i]);
+
+    kfree(file->file.pages);
+    file->file.pages = NULL;
+    file->file.page_count = 0;
+    file->file.size = 0;
+}
+
 // make sure to clean up ramdisk device
 struct ramdisk *rd_new_ramdisk(void)
 {
@@ -50,6 +74,8 @@ struct ramdisk *rd_new_ramdisk(void)
     new_rd->vnodeops.vn_rdwr = ramfs_vn_rdwr;
     new_rd->vnodeops.vn_lookup = ramfs_vn_lookup;
     new_rd->vnodeops.vn_create = ramfs_vn_create;
+    new_rd->vnodeops.vn_getpage = ramfs_vn_getpage;
+    new_rd->vnodeops.vn_putpage = ramfs_vn_putpage;
 
     return new_rd;
 }
@@ -65,6 +91,11 @@ struct ramdisk_file *rd_create_file(struct ramdisk_file *dir, enum ramdisk_file_
     pathn_buffer_n(file->name, name, len);
     file->name_len = len;
 
+    if (type == RAMD_FILE) {
+        file->file.mapping.private = file;
+        file->file.mapping.migrate = rd_migrate_page;
+    }
+
     return file;
 }
 
@@ -195,15 +226,49 @@ int ramfs_vn_rdwr(struct vfs_vnode *this, struct vfs_uio *uiop, size_t flags)
 
     struct ramdisk_file *file = (struct ramdisk_file *)this->v_data;
 
+    // pages can't get migrated while the lock is held
+    spin_lock_global(&file->file.mapping.lock);
+
     if (uiop->uio == UIO_READ) {
-        memcpy(uiop->uio_buf, file->file.file_contents, uiop->uio_resid);
+        // uio_offset is the file offset to read from
+        size_t size = uiop->uio_offset < file->file.size ? MIN(uiop->uio_resid, file->file.size - uiop->uio_offset) : 0;
+        for (size_t done = 0; done < size; ) {
+            size_t pos = uiop->uio_offset + done;
+            size_t chunk = MIN(size - done, PAGE_SIZE - pos % PAGE_SIZE);
+            void *src = (void *)(page2phys(file->file.pages[pos / PAGE_SIZE]) + hhdm->offset + pos % PAGE_SIZE);
+            memcpy(uiop->uio_buf + done, src, chunk);
+            done += chunk;
+        }
+        uiop->uio_resid -= size;
     } else if (uiop->uio == UIO_WRITE) {
-        // [FIXME] missing free
-        file->file.file_contents = kmalloc(uiop->uio_resid);
-        memcpy(file->file.file_contents, uiop->uio_buf, uiop->uio_resid);
+        rd_free_pages(file);
+
+        size_t count = ALIGN_UP(uiop->uio_resid, PAGE_SIZE) / PAGE_SIZE;
+        file->file.pages = kmalloc(MAX(count, 1ul) * sizeof(struct page *));
+        if (!file->file.pages) {
+            spin_unlock_global(&file->file.mapping.lock);
+            return VFS_FS_OP_STATUS_ENOMEM;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            struct page *pg = page_alloc_movable(&file->file.mapping, i);
+            if (!pg) {
+                spin_unlock_global(&file->file.mapping.lock);
+                return VFS_FS_OP_STATUS_ENOMEM;
+            }
+
+            // the tail of the last page is visible through mappings
+            size_t off = i * PAGE_SIZE, chunk = MIN(uiop->uio_resid - off, PAGE_SIZE);
+            memcpy((void *)(page2phys(pg) + hhdm->offset), uiop->uio_buf + off, chunk);
+            memset((void *)(page2phys(pg) + hhdm->offset + chunk), 0, PAGE_SIZE - chunk);
+            file->file.pages[i] = pg;
+            file->file.page_count++;
+            file->file.size += chunk;
+        }
+        uiop->uio_resid = 0;
     } else kpanic(0, NULL, "oof\n");
 
-    uiop->uio_resid = 0;
+    spin_unlock_global(&file->file.mapping.lock);
 
     return VFS_FS_OP_STATUS_OK;
 }
@@ -259,4 +324,38 @@ int ramfs_vn_create(struct vfs_vnode *dir, const char *filen, size_t len,
         return VFS_FS_OP_STATUS_INVALID_ARGS;
 
     return VFS_FS_OP_STATUS_OK;
-}
\ No newline at end of file
+}
+
+// the file pages are the page cache. mapped pages aren't migrated, and a write replacing
+// the file contents leaves them to the mappings
+int ramfs_vn_getpage(struct vfs_vnode *this, size_t index, struct page **result)
+{
+    struct ramdisk_file *file = (struct ramdisk_file *)this->v_data;
+    if (file->type != RAMD_FILE)
+        return VFS_FS_OP_STATUS_INVALID_ARGS;
+
+    spin_lock_global(&file->file.mapping.lock);
+
+    if (index >= file->file.page_count) {
+        spin_unlock_global(&file->file.mapping.lock);
+        return VFS_FS_OP_STATUS_ENOENT;
+    }
+
+    *result = file->file.pages[index];
+    page_get(*result);
+
+    spin_unlock_global(&file->file.mapping.lock);
+    return VFS_FS_OP_STATUS_OK;
+}
+
+// the mapping wrote to the cached page itself, there's nothing left to write
+int ramfs_vn_putpage(struct vfs_vnode *this, size_t index, struct page *page)
+{
+    (void)index;
+    (void)page;
+
+    struct ramdisk_file *file = (struct ramdisk_file *)this->v_data;
+    file->mtime = get_unixtime();
+
+    return VFS_FS_OP_STATUS_OK;
+}
@@ -12,6 +12,8 @@
 // system wide vfs root mount point.
 struct vfs_fs *root_fs = NULL;
 
+static struct slab_cache *vnode_cache;
+
 const file_handle_t null_handle = {
     .cache_entry = NULL,
     .fs = NULL
@@ -32,7 +34,8 @@ static void vfs_fs_list_remove()
 struct vfs_vnode *vfs_vnode_alloc(struct vfs_fs *owner, size_t flags,
     struct vfs_vnode_ops *ops, enum vfs_vnode_type type, gen_dptr data)
 {
-    struct vfs_vnode *node = kcalloc(1, sizeof(struct vfs_vnode));
+    struct vfs_vnode *node = kmem_cache_alloc(vnode_cache);
+    memset(node, 0, sizeof(struct vfs_vnode));
     node->v_flag = flags;
     node->v_refc = 0;
     node->v_vfs_mounted_here = NULL;
@@ -47,7 +50,7 @@ struct vfs_vnode *vfs_vnode_alloc(struct vfs_fs *owner, size_t flags,
 static void vfs_vnode_free(struct vfs_vnode **node_ptr)
 {
     kfree((*node_ptr)->v_data);
-    kfree(*node_ptr);
+    kmem_cache_free(vnode_cache, *node_ptr);
     *node_ptr = NULL;
 }
 
@@ -275,6 +278,11 @@ void vfs_init()
 {
     kprintf("Initializing vfs\n");
 
+    vnode_cache = kmem_cache_create("vfs_vnode", sizeof(struct vfs_vnode), 8, NULL);
+    if (!vnode_cache)
+        kpanic(0, NULL, "couldn't create vnode cache\n");
+    pnc_init();
+
     struct ramdisk *rd_root = rd_new_ramdisk();
     struct vfs_fs *ramfs_root = ramfs_new_fs();
 
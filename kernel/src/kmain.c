@@ -26,6 +26,12 @@
 #include "compiler.h"
 #include "process.h"
 #include "locking.h"
+#include "kevent.h"
+#include "vmem.h"
+#include "vmalloc.h"
+#include "ioremap.h"
+#include "vma.h"
+#include "kfence.h"
 #include "uacpi/kernel_api.h"
 
 LIMINE_BASE_REVISION(1)
@@ -241,6 +247,13 @@ void kernel_entry(void)
     slab_init();
     kprintf("%s mm setup done\n", ansi_okay_string);
 
+    vmem_init();
+    vmalloc_init();
+    ioremap_init();
+    kfence_init();
+    vma_init();
+    kevent_init();
+
     parse_acpi();
 
     init_ioapic();
@@ -249,6 +262,19 @@ void kernel_entry(void)
 
     boot_other_cores();
 
+    slab_smp_init();
+    vmem_smp_init();
+
+    page_zero_init();
+
+    page_reclaim_init();
+
+    vma_thp_init();
+
+    slab_reaper_init();
+
+    kfence_protect_init();
+
     time_init();
 
     ps2_init();
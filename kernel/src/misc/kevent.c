@@ -1,32 +1,32 @@
 #include "kevent.h"
 #include "compiler.h"
+#include "kheap.h"
+#include "kprintf.h"
+#include "memory.h"
 
-#define KEVENT_SUBSCRIBER_POOL_REFILL_AMOUNT (128)
+// subscribers come from their own cache, its per-cpu magazines make this cheap
+static struct slab_cache *subscriber_cache;
 
-// keep a small pool of kevent_subscriber_t's to avoid calling kmalloc too often
-static kevent_subscriber_t *subscriber_pool;
+void kevent_init(void)
+{
+    subscriber_cache = kmem_cache_create("kevent_subscriber", sizeof(kevent_subscriber_t), 8, NULL);
+    if (!subscriber_cache)
+        kpanic(0, NULL, "couldn't create kevent subscriber cache\n");
+}
 
 static inline kevent_subscriber_t *_subscriber_pool_alloc(void)
 {
-    if (!subscriber_pool) {
-        // empty: fill up again
-        for (int i = 0; i < KEVENT_SUBSCRIBER_POOL_REFILL_AMOUNT; i++) {
-            kevent_subscriber_t *old = subscriber_pool;
-            subscriber_pool = kcalloc(1, sizeof(kevent_subscriber_t));
-            subscriber_pool->next = old;
-        }
-    }
+    kevent_subscriber_t *ret = kmem_cache_alloc(subscriber_cache);
+    if (!ret)
+        kpanic(0, NULL, "out of memory for kevent subscribers\n");
 
-    kevent_subscriber_t *ret = subscriber_pool;
-    subscriber_pool = subscriber_pool->next;
+    memset(ret, 0, sizeof(kevent_subscriber_t));
     return ret;
 }
 
 static inline void _subscriber_pool_free(kevent_subscriber_t *s)
 {
-    kevent_subscriber_t *old = subscriber_pool;
-    subscriber_pool = s;
-    subscriber_pool->next = old;
+    kmem_cache_free(subscriber_cache, s);
 }
 
 static inline void _subscriber_list_link(kevent_t *ev, struct task *t) {
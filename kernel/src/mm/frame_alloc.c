@@ -3,26 +3,43 @@
  * a buddy or bitmap allocator is used for allocating contiguous physical pages.
  * The configuration can be set by defining MUNKOS_CONFIG_BUDDY or MUNKOS_CONFIG_BITMAP.
  * It is highly recommended to stay with the default buddy configuration.
- * Some problems with this are the assumptions that memory holes arent too big,
- * because this would waste some RAM, and that the system doesn't have a high
- * NUMA ratio. I'll keep a NUMA domain based allocator in mind tho, maybe in a few more
- * lifespans I'll implement one. The exposed functions are:
+ * The struct pages only exist for sections of memory that contain ram (see
+ * mem_init.c), memory holes only cost the buddy bitmaps. The buddy allocator is split up into one
+ * buddy_context per NUMA node (see numa.c), allocations are served from the node
+ * of the current cpu first, and fall back to the other nodes ordered by distance.
+ * Small buddy allocations are cached in per-cpu lists once smp is up
+ * (see PER-CPU PAGE LISTS). The exposed functions are:
  * allocator_init(), which initializes the necessary structures for the chosen allocator.
  * page_alloc(order), which returns a blob of physical memory of size order².
+ * page_alloc_node(order, node), same as page_alloc, but prefers node.
+ * page_alloc_contig(count, align_order), count contiguous pages, for big aligned regions.
+ * page_alloc_movable(mapping, index), a single page compaction may move around
+ * (see MIGRATE TYPES AND COMPACTION).
+ * page_alloc_bulk(order, count, out), up to count blocks under a single lock round trip.
  * page_free(page, order), which frees the allocated block again.
+ * page_free_bulk(order, count, pages), frees many blocks of the same order at once.
+ * page_get(page) / page_put(page), reference counting for pages with several owners.
+ * page_free_cold(page, order), same as page_free, for blocks that aren't cache hot.
+ * page_calloc(order), same as page_alloc, but zeroed. single pages usually come
+ * out of a pool that gets zeroed in the background (see PRE-ZEROED POOL).
+ * shrinker_register(shrinker), lets a cache give memory back under pressure (see RECLAIM).
  * phys_stat_memory(&stat), returns a structure with allocator data
 */
 
 #include "frame_alloc.h"
+#include "kheap.h"
 #include "kprintf.h"
 #include "memory.h"
 #include "macros.h"
 #include "interrupt.h"
 #include "locking.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "numa.h"
 
-// this is convinient and all, but uses up BRUTAL amounts of sys mem if there
-// are huge memory holes. [TODO] make this memory area based
-struct page *pages;
+// sparse struct page map, set up by early_mem_init()
+struct mem_section *mem_sections;
+size_t mem_section_count;
 size_t pages_count;
 
 // in pages
@@ -52,25 +69,67 @@ static size_t bitmap_last_index = 0;
 // per-order structure
 struct buddy_zone {
     uint8_t *bitmap;        // each buddy pair has a state-bit
-    struct page *list;      // freelist for all free pages in an order
+    struct page *lists[PAGE_MIGRATE_TYPES];     // freelists for all free pages in an order
+    size_t free_count;      // free blocks of this order, over all types
 };
 
+// one bit per order in buddy_context.nonempty
+_Static_assert(BUDDY_HIGH_ORDER < 32, "buddy orders don't fit the non-empty masks");
+
+// one per numa node
 struct buddy_context {
     k_spinlock_t this_lock;
-    size_t region_start;
+    size_t region_start;    // first pfn the bitmaps cover, aligned to the biggest buddy pair
+    size_t region_end;      // pfn after the last usable page of this node
+    uint8_t *pageblock_types;   // one bit per pageblock, set if movable
+    // bit n is set if the order n list of that type has a block, so allocations can
+    // find the smallest fitting order without walking the empty ones
+    uint32_t nonempty[PAGE_MIGRATE_TYPES];
+
+    // in pages, see WATERMARK_MIN_FRACTION
+    size_t watermark_min,
+           watermark_low,
+           watermark_high;
+
+    // in pages
+    size_t usable_pages,
+           free_pages;
 
     // debugging
     size_t allocation_count,
-           deallocation_count;
+           deallocation_count,
+           steal_count,
+           compact_count,
+           compact_migrated;
     struct buddy_zone orders[BUDDY_HIGH_ORDER + 1];
 };
 
-struct buddy_context buddy_allocator;
+struct buddy_context buddy_nodes[NUMA_MAX_NODES];
 
 void buddy_init(void);
 void buddy_print(void);
 struct page *buddy_alloc(size_t order);
+struct page *buddy_alloc_node(size_t order, size_t node);
 void buddy_free(struct page *page, size_t order);
+static struct page *_buddy_alloc_locked(struct buddy_context *ctx, size_t order, size_t type);
+static struct page *_buddy_alloc_fallback(size_t order, size_t node, size_t type, bool reserve);
+static size_t buddy_alloc_bulk(size_t order, size_t node, size_t count, struct page **out);
+static void buddy_free_bulk(size_t order, size_t count, struct page **pages);
+static bool buddy_grow(struct page *page, size_t order, size_t new_order);
+static bool _buddy_compact(struct buddy_context *ctx, size_t order);
+static void _buddy_free_locked(struct buddy_context *ctx, struct page *page, size_t order);
+static void _buddy_free_range(size_t start, size_t end);
+
+static struct page *pcp_alloc(size_t order, bool reclaim);
+static void pcp_free(struct page *page, size_t order, bool cold);
+
+static struct page *zero_pool_get(size_t node);
+static size_t zero_pool_drain(void);
+static size_t zero_pool_count(void);
+static void page_zero_thread(void *arg);
+
+static void kswapd_wake(void);
+static void kswapd_thread(void *arg);
 
 #endif // MUNKOS_CONFIG_BUDDY
 
@@ -79,6 +138,9 @@ inline void allocator_init()
     pages_count = frame_allocator_total = early_mem_init();
     early_mem_statistics(&frame_allocator_usable, &frame_allocator_free);
 
+    // the buddy allocator needs the node layout before setting up its zones
+    numa_init();
+
     // this part is responsible for exiting early mem phase
     // (BEFORE allocating any memory themselves)
 #ifdef MUNKOS_CONFIG_BITMAP
@@ -101,15 +163,233 @@ inline struct page *page_alloc(size_t order)
     return NULL;
 #endif
 #ifdef MUNKOS_CONFIG_BUDDY
+    // the per-cpu lists only exist once all cores are up
+    if (order <= PCP_HIGH_ORDER && smp_initialized)
+        return pcp_alloc(order, true);
     return buddy_alloc(order);
 #endif
 }
 
-// since we should implement userspace page sanitization at some point anyways,
-// we could use it here to avoid the memset call...
+inline struct page *page_alloc_node(size_t order, size_t node)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    (void)node;
+    return page_alloc(order);
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (node >= numa_node_count)
+        node = 0;
+    // the per-cpu lists only cache pages of the local node
+    if (order <= PCP_HIGH_ORDER && smp_initialized && node == numa_this_node())
+        return pcp_alloc(order, true);
+    return buddy_alloc_node(order, node);
+#endif
+}
+
+struct page *page_alloc_contig(size_t count, size_t align_order)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    (void)count;
+    (void)align_order;
+    return NULL;
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (!count) return NULL;
+
+    // buddy blocks are aligned to their size
+    size_t order = align_order;
+    while (order2size(order) < count)
+        order++;
+
+    struct page *pg = buddy_alloc(order);
+    if (!pg) return NULL;
+
+    _buddy_free_range(page2idx(pg) + count, page2idx(pg) + order2size(order));
+    return pg;
+#endif
+}
+
+void page_free_contig(struct page *page, size_t count)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    bitmap_page_free((void *)(page2idx(page) * PAGE_SIZE), count);
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    _buddy_free_range(page2idx(page), page2idx(page) + count);
+#endif
+}
+
+size_t page_alloc_bulk(size_t order, size_t count, struct page **out)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    (void)order;
+    (void)count;
+    (void)out;
+    return 0;
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (order > BUDDY_HIGH_ORDER) {
+        kprintf("  - buddy: allocations of order > %lu are not supported!\n", BUDDY_HIGH_ORDER);
+        return 0;
+    }
+
+    // bypasses the per-cpu lists, the lock is already taken only once per node
+    return buddy_alloc_bulk(order, numa_this_node(), count, out);
+#endif
+}
+
+void page_free_bulk(size_t order, size_t count, struct page **pages)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    for (size_t i = 0; i < count; i++)
+        page_free(pages[i], order);
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    buddy_free_bulk(order, count, pages);
+#endif
+}
+
+bool page_grow(struct page *page, size_t order, size_t new_order)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    (void)page;
+    (void)order;
+    (void)new_order;
+    return false;
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (new_order > BUDDY_HIGH_ORDER)
+        return false;
+    return buddy_grow(page, order, new_order);
+#endif
+}
+
+struct page *page_alloc_movable(struct page_mapping *mapping, size_t index)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    (void)mapping;
+    (void)index;
+    return NULL;
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    struct page *pg = _buddy_alloc_fallback(PAGES_1_ORDER, numa_this_node(), PAGE_MIGRATE_MOVABLE, false);
+    if (!pg && (zero_pool_drain() || page_reclaim(RECLAIM_BATCH)))
+        pg = _buddy_alloc_fallback(PAGES_1_ORDER, numa_this_node(), PAGE_MIGRATE_MOVABLE, false);
+    if (!pg) return NULL;
+
+    // compaction only looks at movable pages with the buddy lock held
+    struct buddy_context *ctx = &buddy_nodes[pg->node];
+    spin_lock_global(&ctx->this_lock);
+    pg->mapping = mapping;
+    pg->index = index;
+    pg->flags |= STRUCT_PAGE_FLAG_MOVABLE;
+    spin_unlock_global(&ctx->this_lock);
+
+    return pg;
+#endif
+}
+
+void page_free_movable(struct page *page)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    if (page_put(page))
+        page_free(page, PAGES_1_ORDER);
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    struct buddy_context *ctx = &buddy_nodes[page->node];
+
+    spin_lock_global(&ctx->this_lock);
+    if (!(page->flags & STRUCT_PAGE_FLAG_MOVABLE))
+        kpanic(0, NULL, "page %lu isn't movable\n", page2idx(page));
+    // a page that's still mapped stays around as a plain page, until the last page_put()
+    page->flags &= ~STRUCT_PAGE_FLAG_MOVABLE;
+    page->mapping = NULL;
+    if (page_put(page))
+        _buddy_free_locked(ctx, page, PAGES_1_ORDER);
+    spin_unlock_global(&ctx->this_lock);
+#endif
+}
+
+void page_get(struct page *page)
+{
+    if (!(__atomic_load_n(&page->flags, __ATOMIC_ACQUIRE) & STRUCT_PAGE_FLAG_SHARED)) {
+        page->refcount = 1;
+        __atomic_or_fetch(&page->flags, STRUCT_PAGE_FLAG_SHARED, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+bool page_put(struct page *page)
+{
+    if (!(__atomic_load_n(&page->flags, __ATOMIC_ACQUIRE) & STRUCT_PAGE_FLAG_SHARED))
+        return true;
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL))
+        return false;
+    __atomic_and_fetch(&page->flags, ~STRUCT_PAGE_FLAG_SHARED, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool page_compact(size_t node, size_t order)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    (void)node;
+    (void)order;
+    return false;
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (node >= numa_node_count || order > BUDDY_HIGH_ORDER)
+        return false;
+    return _buddy_compact(&buddy_nodes[node], order);
+#endif
+}
+
+inline struct page *page_alloc_atomic(size_t order)
+{
+#ifdef MUNKOS_CONFIG_BITMAP
+    return page_alloc(order);
+#endif
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (order > BUDDY_HIGH_ORDER)
+        return NULL;
+
+    struct page *pg = NULL;
+    if (order <= PCP_HIGH_ORDER && smp_initialized)
+        pg = pcp_alloc(order, false);
+    if (pg) return pg;
+
+    // whatever got dipped into gets refilled in the background
+    kswapd_wake();
+    return _buddy_alloc_fallback(order, numa_this_node(), PAGE_MIGRATE_UNMOVABLE, true);
+#endif
+}
+
+inline struct page *page_calloc_atomic(size_t order)
+{
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (order == 0) {
+        struct page *pg = zero_pool_get(numa_this_node());
+        if (pg) return pg;
+    }
+#endif
+    struct page *out = page_alloc_atomic(order);
+    if (!out)
+        return NULL;
+    memset((void *)((uintptr_t)page2phys(out) + hhdm->offset), 0, order2size(order) << PAGE_SHIFT);
+    return out;
+}
+
 inline struct page *page_calloc(size_t order)
 {
+#ifdef MUNKOS_CONFIG_BUDDY
+    // no memset for the common case (page tables), if the pool isn't empty
+    if (order == 0) {
+        struct page *pg = zero_pool_get(numa_this_node());
+        if (pg) return pg;
+    }
+#endif
     struct page *out = page_alloc(order);
+    if (!out)
+        return NULL;
     memset((void *)((uintptr_t)page2phys(out) + hhdm->offset), 0, order2size(order) << PAGE_SHIFT);
     return out;
 }
@@ -132,33 +412,75 @@ inline void page_free(struct page *page, size_t order)
     bitmap_page_free((void *)(page2idx(page) * PAGE_SIZE), order2size(order));
 #endif
 #ifdef MUNKOS_CONFIG_BUDDY
+    if (order <= PCP_HIGH_ORDER && smp_initialized) {
+        pcp_free(page, order, false);
+        return;
+    }
     buddy_free(page, order);
 #endif
 }
 
-void page_free_temp(void *address, size_t size)
+// same as page_free(), but hints that the block isn't cache hot anymore (e.g. it
+// has been touched by another cpu or a device last), so it gets handed out last
+void page_free_cold(struct page *page, size_t order)
 {
-    page_free(phys2page((uintptr_t)address), psize2order(size));
+#ifdef MUNKOS_CONFIG_BUDDY
+    if (order <= PCP_HIGH_ORDER && smp_initialized) {
+        pcp_free(page, order, true);
+        return;
+    }
+#endif
+    page_free(page, order);
 }
 
-void phys_stat_memory(struct phys_mem_stat *stat)
+void page_pcp_init_cpu(cpu_local_t *cpu)
 {
-#ifdef MUNKOS_CONFIG_BITMAP
-    spin_lock_global(&bitmap_lock);
+#ifdef MUNKOS_CONFIG_BUDDY
+    cpu->pcp = kcalloc(1, sizeof(struct per_cpu_pages));
+#else
+    cpu->pcp = NULL;
 #endif
+}
+
+void page_zero_init(void)
+{
 #ifdef MUNKOS_CONFIG_BUDDY
-    spin_lock_global(&buddy_allocator.this_lock);
+    scheduler_new_kernel_thread(page_zero_thread, NULL, TASK_PRIORITY_IDLE);
 #endif
+}
 
-    stat->free_pages = frame_allocator_free;
+void page_reclaim_init(void)
+{
+#ifdef MUNKOS_CONFIG_BUDDY
+    scheduler_new_kernel_thread(kswapd_thread, NULL, TASK_PRIORITY_LOW);
+#endif
+}
+
+void page_free_temp(void *address, size_t size)
+{
+    page_free(phys2page((uintptr_t)address), psize2order(size));
+}
+
+void phys_stat_memory(struct phys_mem_stat *stat)
+{
     stat->total_pages = frame_allocator_total;
     stat->usable_pages = frame_allocator_usable;
 
 #ifdef MUNKOS_CONFIG_BITMAP
+    spin_lock_global(&bitmap_lock);
+    stat->free_pages = frame_allocator_free;
     spin_unlock_global(&bitmap_lock);
 #endif
 #ifdef MUNKOS_CONFIG_BUDDY
-    spin_unlock_global(&buddy_allocator.this_lock);
+    // every node is consistent by itself, the sum is only a snapshot
+    stat->free_pages = 0;
+    for (size_t i = 0; i < numa_node_count; i++) {
+        spin_lock_global(&buddy_nodes[i].this_lock);
+        stat->free_pages += buddy_nodes[i].free_pages;
+        spin_unlock_global(&buddy_nodes[i].this_lock);
+    }
+    // the zeroed pages are still up for grabs
+    stat->free_pages += zero_pool_count();
 #endif
 }
 
@@ -287,10 +609,10 @@ void bitmap_page_free(void *ptr, size_t count)
 #ifdef MUNKOS_CONFIG_BUDDY
 // lru insertion of new into dll at head
 static inline void _list_link(struct page *new, struct page **head) {
-    new->prev = NULL;
-    new->next = *head;
+    new->prev = PAGE_LINK_NONE;
+    new->next = page2link(*head);
     if (*head)
-        (*head)->prev = new;
+        (*head)->prev = page2link(new);
     *head = new;
 }
 
@@ -299,18 +621,18 @@ static inline void _list_unlink(struct page *entry, struct page **head) {
     if (!*head) kpanic(0, NULL, "trying to unlink list entry from empty head (%s:%d)\n", __FILE__, __LINE__);
 
     if (*head == entry) {
-        *head = entry->next;
+        *head = link2page(entry->next);
         // unnecessary
         //(*head)->prev = NULL;
     }
 
-    if (entry->prev)
-        entry->prev->next = entry->next;
-    if (entry->next)
-        entry->next->prev = entry->prev;
+    if (entry->prev != PAGE_LINK_NONE)
+        pfn2page(entry->prev)->next = entry->next;
+    if (entry->next != PAGE_LINK_NONE)
+        pfn2page(entry->next)->prev = entry->prev;
 
-    entry->prev = (struct page *)0xDEADBEEF;
-    entry->next = (struct page *)0xDEADBEEF;
+    entry->prev = PAGE_LINK_POISON;
+    entry->next = PAGE_LINK_POISON;
 }
 
 // remove first entry from list and return it
@@ -318,12 +640,12 @@ static inline struct page *_list_get(struct page **head) {
     if (!*head) return NULL;
 
     struct page *ret = *head;
-    *head = ret->next;
+    *head = link2page(ret->next);
     if (*head)
-        (*head)->prev = NULL;
+        (*head)->prev = PAGE_LINK_NONE;
 
-    ret->next = (struct page *)0xDEADBEEF;
-    ret->prev = (struct page *)0xDEADBEEF;
+    ret->next = PAGE_LINK_POISON;
+    ret->prev = PAGE_LINK_POISON;
 
     return ret;
 }
@@ -344,14 +666,62 @@ static inline uint8_t _bitmap_status(size_t n, uint8_t *bitmap) {
 
 // does all the necessary calculations to flip
 // the correct bit in the correct bitmap for page n with order
-static inline void order_flip_at(size_t n, size_t order) {
-    _bitmap_flip(n >> (order + 1), buddy_allocator.orders[order].bitmap);
+static inline void order_flip_at(struct buddy_context *ctx, size_t n, size_t order) {
+    _bitmap_flip((n - ctx->region_start) >> (order + 1), ctx->orders[order].bitmap);
 }
 
 // does all the necessary calculations to return
 // the corresponding bit for page n with order
-static inline uint8_t order_status_at(size_t n, size_t order) {
-    return _bitmap_status(n >> (order + 1), buddy_allocator.orders[order].bitmap);
+static inline uint8_t order_status_at(struct buddy_context *ctx, size_t n, size_t order) {
+    return _bitmap_status((n - ctx->region_start) >> (order + 1), ctx->orders[order].bitmap);
+}
+
+static inline size_t pageblock_type(struct buddy_context *ctx, size_t pfn) {
+    return _bitmap_status((pfn - ctx->region_start) >> PAGEBLOCK_ORDER, ctx->pageblock_types);
+}
+
+static inline void set_pageblock_type(struct buddy_context *ctx, size_t pfn, size_t type) {
+    if (pageblock_type(ctx, pfn) != type)
+        _bitmap_flip((pfn - ctx->region_start) >> PAGEBLOCK_ORDER, ctx->pageblock_types);
+}
+
+// free lists: free block heads are marked with STRUCT_PAGE_FLAG_BUDDY and their order,
+// STRUCT_PAGE_FLAG_MOVABLE tells which list they're on
+static inline void _free_list_add(struct buddy_context *ctx, struct page *pg, size_t order, size_t type) {
+    pg->flags |= STRUCT_PAGE_FLAG_BUDDY;
+    if (type == PAGE_MIGRATE_MOVABLE)
+        pg->flags |= STRUCT_PAGE_FLAG_MOVABLE;
+    else
+        pg->flags &= ~STRUCT_PAGE_FLAG_MOVABLE;
+    pg->order = order;
+    _list_link(pg, &ctx->orders[order].lists[type]);
+    ctx->orders[order].free_count++;
+    ctx->nonempty[type] |= 1u << order;
+}
+
+static inline void _free_list_del(struct buddy_context *ctx, struct page *pg) {
+    size_t type = (pg->flags & STRUCT_PAGE_FLAG_MOVABLE) ? PAGE_MIGRATE_MOVABLE : PAGE_MIGRATE_UNMOVABLE;
+    struct buddy_zone *zone = &ctx->orders[pg->order];
+
+    _list_unlink(pg, &zone->lists[type]);
+    zone->free_count--;
+    if (!zone->lists[type])
+        ctx->nonempty[type] &= ~(1u << pg->order);
+
+    pg->flags &= ~(STRUCT_PAGE_FLAG_BUDDY | STRUCT_PAGE_FLAG_MOVABLE);
+    pg->order = 0;
+}
+
+static inline struct page *_free_list_get(struct buddy_context *ctx, size_t order, size_t type) {
+    struct page *pg = ctx->orders[order].lists[type];
+    if (pg)
+        _free_list_del(ctx, pg);
+    return pg;
+}
+
+// mask of the orders >= order
+static inline uint32_t orders_from(size_t order) {
+    return ~((1u << order) - 1);
 }
 
 static inline size_t get_alignment_order(uintptr_t address) {
@@ -383,45 +753,134 @@ static inline size_t _slice_range(uintptr_t low, uintptr_t high) {
     return order;
 }
 
+// split every usable memmap entry at node boundaries, and pass the pieces to fn
+static void _for_each_usable_range(void (*fn)(size_t node, uintptr_t start, uintptr_t end))
+{
+    for (size_t i = 0; i < memmap_entry_count; i++) {
+        struct memmap_entry *ent = &memmap[i];
+        if (ent->type != LIMINE_MEMMAP_USABLE) continue;
+
+        uintptr_t current = ent->start;
+        uintptr_t end = ent->start + ent->length;
+        while (current < end) {
+            uintptr_t piece_end = MIN(end, numa_range_end(current));
+            fn(numa_node_of_phys(current), current, piece_end);
+            current = piece_end;
+        }
+    }
+}
+
+// grow the pfn span of node, so the bitmaps cover start - end
+static void _node_span_range(size_t node, uintptr_t start, uintptr_t end)
+{
+    struct buddy_context *ctx = &buddy_nodes[node];
+    ctx->region_start = MIN(ctx->region_start, start / PAGE_SIZE);
+    ctx->region_end = MAX(ctx->region_end, end / PAGE_SIZE);
+}
+
+// split the memory up in as big blocks as possible, add these to the
+// freelists of node and mark the entries in the bitmap
+static void _node_free_range(size_t node, uintptr_t start, uintptr_t end)
+{
+    struct buddy_context *ctx = &buddy_nodes[node];
+
+    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE)
+        phys2page(addr)->node = node;
+
+    uintptr_t current = start;
+    while (current < end) {
+        size_t buddy = _slice_range(current, end);
+        struct page *pg = phys2page(current);
+        _free_list_add(ctx, pg, buddy, pageblock_type(ctx, page2idx(pg)));
+        order_flip_at(ctx, page2idx(pg), buddy);
+
+        current += order2size(buddy) * PAGE_SIZE;
+    }
+
+    ctx->usable_pages += (end - start) / PAGE_SIZE;
+    ctx->free_pages += (end - start) / PAGE_SIZE;
+}
+
 void buddy_print(void) {
-    size_t free = frame_allocator_free, usable = frame_allocator_usable;
+    size_t free = 0, usable = frame_allocator_usable;
+    for (size_t n = 0; n < numa_node_count; n++)
+        free += buddy_nodes[n].free_pages;
+
     kprintf("buddy allocator: %lu pages out of %lu free (~%lu.%02lu%%)\n", 
         free, usable, (free * 100) / usable, ((free * 10000) / usable) % 100);
-    kprintf("buddy allocator: allocations: %lu, deallocations: %lu\n",
-        buddy_allocator.allocation_count, buddy_allocator.deallocation_count);
 
-    for (size_t i = 0; i <= BUDDY_HIGH_ORDER; i++) {
-        kprintf("freelist: order %lu (%lu): ", i, order2size(i));
-        struct page *curr = buddy_allocator.orders[i].list;
+    for (size_t n = 0; n < numa_node_count; n++) {
+        struct buddy_context *ctx = &buddy_nodes[n];
+        if (!ctx->usable_pages) {
+            kprintf("buddy allocator: node %lu: no memory\n", n);
+            continue;
+        }
 
-        size_t limit = 0;
-        while (curr) {
-            if (limit++ > 10) {
-                kprintf("...");
-                break;
+        kprintf("buddy allocator: node %lu: %lu pages out of %lu free, allocations: %lu, deallocations: %lu\n",
+            n, ctx->free_pages, ctx->usable_pages, ctx->allocation_count, ctx->deallocation_count);
+        kprintf("buddy allocator: node %lu: steals: %lu, compactions: %lu (%lu pages migrated)\n",
+            n, ctx->steal_count, ctx->compact_count, ctx->compact_migrated);
+
+        for (size_t i = 0; i <= BUDDY_HIGH_ORDER; i++) {
+            for (size_t t = 0; t < PAGE_MIGRATE_TYPES; t++) {
+                kprintf("freelist: order %lu (%lu, %lu free) %s: ", i, order2size(i), ctx->orders[i].free_count,
+                    (t == PAGE_MIGRATE_MOVABLE) ? "movable" : "unmovable");
+                struct page *curr = ctx->orders[i].lists[t];
+
+                size_t limit = 0;
+                while (curr) {
+                    if (limit++ > 10) {
+                        kprintf("...");
+                        break;
+                    }
+
+                    if (i == BUDDY_HIGH_ORDER)
+                        kprintf("%lu ", page2idx(curr));
+                    else
+                        kprintf("%lu(%lu) ", page2idx(curr), (uint64_t)order_status_at(ctx, page2idx(curr), i));
+                    curr = link2page(curr->next);
+                }
+                kprintf("\n");
             }
-
-            if (i == BUDDY_HIGH_ORDER)
-                kprintf("%lu ", page2idx(curr));
-            else
-                kprintf("%lu(%lu) ", page2idx(curr), (uint64_t)order_status_at(page2idx(curr), i));
-            curr = curr->next;
         }
-        kprintf("\n");
     }
 }
 
 void buddy_init()
 {
-    // find space for bitmap
-    for (size_t order = 0; order <= BUDDY_HIGH_ORDER; order++) {
-        struct buddy_zone *zone = &buddy_allocator.orders[order];
+    // find out how much of the pfn space every node spans
+    for (size_t n = 0; n < NUMA_MAX_NODES; n++)
+        buddy_nodes[n].region_start = SIZE_MAX;
+    _for_each_usable_range(_node_span_range);
+
+    // find space for the bitmaps
+    for (size_t n = 0; n < numa_node_count; n++) {
+        struct buddy_context *ctx = &buddy_nodes[n];
+
+        // node without memory (cpus only), never gets allocated from
+        if (ctx->region_start == SIZE_MAX) {
+            ctx->region_start = ctx->region_end = 0;
+            continue;
+        }
+
+        // keep buddy pairs in the same bitmap byte position as in the pfn space
+        ctx->region_start = ALIGN_DOWN(ctx->region_start, order2size(BUDDY_HIGH_ORDER + 1));
+        size_t span = ctx->region_end - ctx->region_start;
 
-        size_t bitmap_order_size = (frame_allocator_total / order2size(order) / sizeof(uint8_t)) + 1;
-        zone->bitmap = early_mem_alloc(bitmap_order_size);
+        for (size_t order = 0; order <= BUDDY_HIGH_ORDER; order++) {
+            struct buddy_zone *zone = &ctx->orders[order];
+
+            size_t bitmap_order_size = (span >> (order + 1)) / 8 + 1;
+            zone->bitmap = early_mem_alloc(bitmap_order_size);
+
+            // required, since real hardware doesnt like it if this isnt zeroed
+            memset(zone->bitmap, 0, bitmap_order_size);
+        }
 
-        // required, since real hardware doesnt like it if this isnt zeroed
-        memset(zone->bitmap, 0, bitmap_order_size);
+        // every pageblock starts out movable, unmovable allocations claim them
+        size_t types_size = (span >> PAGEBLOCK_ORDER) / 8 + 1;
+        ctx->pageblock_types = early_mem_alloc(types_size);
+        memset(ctx->pageblock_types, 0xff, types_size);
     }
 
     early_mem_statistics(&frame_allocator_usable, &frame_allocator_free);
@@ -432,31 +891,21 @@ void buddy_init()
     kprintf("  - buddy: %lu pages (~%lu.%lu%%) used\n", allocated / PAGE_SIZE,
         ((allocated / PAGE_SIZE) * 100) / frame_allocator_total, (allocated / frame_allocator_total) % 100);
 
-    // find out which pages are actually free to use. Mark the entries in the bitmap,
-    // and split the memory up in as big blocks as possible. Add these to the freelists.
-    for (size_t i = 0; i < memmap_entry_count; i++) {
-        struct memmap_entry *ent = &memmap[i];
-        if (ent->type != LIMINE_MEMMAP_USABLE) continue;
+    // find out which pages are actually free to use, and hand them to their node
+    _for_each_usable_range(_node_free_range);
 
-        uintptr_t current = ent->start;
-        uintptr_t end = ent->start + ent->length;
-        while (current < end) {
-            size_t buddy = _slice_range(current, end);
-            struct page *start = phys2page(current);
-            _list_link(start, &buddy_allocator.orders[buddy].list);
+    for (size_t n = 0; n < numa_node_count; n++) {
+        struct buddy_context *ctx = &buddy_nodes[n];
 
-            current += order2size(buddy) * PAGE_SIZE;
-        }
-    }
+        // never reserve more than a quarter of a (tiny) node
+        ctx->watermark_min = MIN(MAX(ctx->usable_pages / WATERMARK_MIN_FRACTION, WATERMARK_MIN_PAGES),
+            ctx->usable_pages / 4);
+        ctx->watermark_low = ctx->watermark_min + ctx->watermark_min / 4;
+        ctx->watermark_high = ctx->watermark_min + ctx->watermark_min / 2;
 
-    for (size_t i = 0; i <= BUDDY_HIGH_ORDER; i++) {
-        struct page *curr = buddy_allocator.orders[i].list;
-        while (curr) {
-            size_t this_idx = page2idx(curr);
-            order_flip_at(this_idx, i);
-
-            curr = curr->next;
-        }
+        kprintf_verbose("  - buddy: node %lu: %luMiB usable, watermarks %lu/%lu/%lu pages\n",
+            n, (ctx->usable_pages * PAGE_SIZE) / MiB,
+            ctx->watermark_min, ctx->watermark_low, ctx->watermark_high);
     }
 
     //buddy_print();
@@ -465,64 +914,260 @@ void buddy_init()
 // allocate 2 ^ order pages. these are not guaranteed to be linked,
 // but will be physically contiguous. performs sanity checks.
 struct page *buddy_alloc(size_t order) {
-    size_t cpy_order = order;
+    return buddy_alloc_node(order, numa_this_node());
+}
 
+// same as buddy_alloc(), but starts looking at node. if node is out of memory,
+// the other nodes are tried ordered by their distance to node
+struct page *buddy_alloc_node(size_t order, size_t node) {
     if (order > BUDDY_HIGH_ORDER) {
         kprintf("  - buddy: allocations of order > %lu are not supported!\n", BUDDY_HIGH_ORDER);
         return NULL;
     }
 
-    // no need to lock before the check
-    spin_lock_global(&buddy_allocator.this_lock);
+    struct page *pg = _buddy_alloc_fallback(order, node, PAGE_MIGRATE_UNMOVABLE, false);
+    if (pg) return pg;
 
-    struct page *pg;
+    // every node is at its min watermark. let the reclaim thread catch up
+    // in the background, while this allocation tries to get memory back directly
+    kswapd_wake();
+
+    // give the pre-zeroed pages back and try again
+    if (zero_pool_drain() && (pg = _buddy_alloc_fallback(order, node, PAGE_MIGRATE_UNMOVABLE, false)))
+        return pg;
+
+    // shrink the caches
+    if (page_reclaim(MAX(RECLAIM_BATCH, order2size(order)))
+        && (pg = _buddy_alloc_fallback(order, node, PAGE_MIGRATE_UNMOVABLE, false)))
+        return pg;
+
+    // move movable pages out of the way, to rebuild a block of order
+    if (order && _buddy_compact(&buddy_nodes[node], order)
+        && (pg = _buddy_alloc_fallback(order, node, PAGE_MIGRATE_UNMOVABLE, false)))
+        return pg;
+
+    // last resort: the reserve below the min watermarks
+    if ((pg = _buddy_alloc_fallback(order, node, PAGE_MIGRATE_UNMOVABLE, true)))
+        return pg;
 
-    // find first either splittable or returnable buddy
-    while (order <= BUDDY_HIGH_ORDER) {
-        pg = _list_get(&buddy_allocator.orders[order].list);
-        if (pg) goto found_buddy;
-        // try splitting at next order
-        order++;
-    }
     // no order to split from found
     kprintf("  - buddy: no page to split from\n");
-    spin_unlock_global(&buddy_allocator.this_lock);
     return NULL;
+}
+
+// call with ctx->this_lock being held
+static inline bool _above_min(struct buddy_context *ctx, size_t order) {
+    return ctx->free_pages >= ctx->watermark_min + order2size(order);
+}
+
+// try node first, then the other nodes ordered by their distance to node.
+// without reserve, nodes are skipped if the allocation would take them below their min watermark
+static struct page *_buddy_alloc_fallback(size_t order, size_t node, size_t type, bool reserve) {
+    for (size_t i = 0; i < numa_node_count; i++) {
+        struct buddy_context *ctx = &buddy_nodes[numa_nodes[node].fallback[i]];
+        if (!ctx->usable_pages) continue;
+
+        struct page *pg = NULL;
+        bool low;
+
+        // no need to lock before the check
+        spin_lock_global(&ctx->this_lock);
+        if (reserve || _above_min(ctx, order))
+            pg = _buddy_alloc_locked(ctx, order, type);
+        low = ctx->free_pages < ctx->watermark_low;
+        spin_unlock_global(&ctx->this_lock);
+
+        if (low)
+            kswapd_wake();
+        if (pg) return pg;
+    }
+
+    return NULL;
+}
+
+// fill out with up to count blocks of order, taking each node lock once.
+// returns the number of blocks allocated
+static size_t buddy_alloc_bulk(size_t order, size_t node, size_t count, struct page **out) {
+    size_t done = 0;
+
+    for (size_t pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < numa_node_count && done < count; i++) {
+            struct buddy_context *ctx = &buddy_nodes[numa_nodes[node].fallback[i]];
+            if (!ctx->usable_pages) continue;
+
+            spin_lock_global(&ctx->this_lock);
+            while (done < count && _above_min(ctx, order)) {
+                struct page *pg = _buddy_alloc_locked(ctx, order, PAGE_MIGRATE_UNMOVABLE);
+                if (!pg) break;
+                out[done++] = pg;
+            }
+            spin_unlock_global(&ctx->this_lock);
+        }
+
+        // give the pre-zeroed pages back for the second pass
+        if (done == count || pass || !zero_pool_drain())
+            break;
+    }
+
+    return done;
+}
+
+// free count blocks of order, runs of blocks on the same node share one lock round trip
+static void buddy_free_bulk(size_t order, size_t count, struct page **pages) {
+    for (size_t i = 0; i < count; ) {
+        struct buddy_context *ctx = &buddy_nodes[pages[i]->node];
+
+        spin_lock_global(&ctx->this_lock);
+        for (; i < count && pages[i]->node == ctx - buddy_nodes; i++)
+            _buddy_free_locked(ctx, pages[i], order);
+        spin_unlock_global(&ctx->this_lock);
+    }
+}
+
+// claim the pageblocks of the (already unlinked) block pg of order for type, and move all
+// other free blocks in there to the lists of type. call with ctx->this_lock being held
+static void _claim_pageblock(struct buddy_context *ctx, struct page *pg, size_t order, size_t type) {
+    size_t start = ALIGN_DOWN(page2idx(pg), PAGEBLOCK_PAGES);
+    size_t node = ctx - buddy_nodes;
+
+    // a big block is the only thing in its pageblocks
+    if (order >= PAGEBLOCK_ORDER) {
+        for (size_t pfn = start; pfn < start + order2size(order); pfn += PAGEBLOCK_PAGES)
+            set_pageblock_type(ctx, pfn, type);
+        return;
+    }
+
+    set_pageblock_type(ctx, start, type);
+
+    // pageblocks never span sections, so either all or none of the struct pages exist.
+    // they may span nodes though, the other node's free blocks aren't ours to move
+    for (size_t pfn = start; pfn < MIN(start + PAGEBLOCK_PAGES, ctx->region_end); ) {
+        struct page *curr = pfn2page(pfn);
+        if (curr->node != node || !(curr->flags & STRUCT_PAGE_FLAG_BUDDY)) {
+            pfn++;
+            continue;
+        }
+
+        size_t order = curr->order;
+        _free_list_del(ctx, curr);
+        _free_list_add(ctx, curr, order, type);
+        pfn += order2size(order);
+    }
+}
+
+// no free block of type left: take the biggest one of the other type instead, to
+// keep the number of mixed pageblocks low. call with ctx->this_lock being held
+static struct page *_steal_block(struct buddy_context *ctx, size_t order, size_t type, size_t *found_order) {
+    size_t other = (type == PAGE_MIGRATE_MOVABLE) ? PAGE_MIGRATE_UNMOVABLE : PAGE_MIGRATE_MOVABLE;
+
+    uint32_t avail = ctx->nonempty[other] & orders_from(order);
+    if (!avail) return NULL;
+
+    size_t o = 31 - __builtin_clz(avail);
+    struct page *pg = _free_list_get(ctx, o, other);
+
+    _claim_pageblock(ctx, pg, o, type);
+    ctx->steal_count++;
+    *found_order = o;
+    return pg;
+}
+
+// free 2 ^ n pages. performs sanity checks.
+void buddy_free(struct page *page, size_t order) {
+    struct buddy_context *ctx = &buddy_nodes[page->node];
+
+    spin_lock_global(&ctx->this_lock);
+    _buddy_free_locked(ctx, page, order);
+    spin_unlock_global(&ctx->this_lock);
+}
+
+// take the free upper buddies of the allocated block page, until it is of new_order.
+// page has to be the lower buddy on every level, so the block only grows upwards
+static bool buddy_grow(struct page *page, size_t order, size_t new_order) {
+    struct buddy_context *ctx = &buddy_nodes[page->node];
+    size_t idx = page2idx(page);
+
+    if (idx % order2size(new_order) || idx + order2size(new_order) > ctx->region_end)
+        return false;
+
+    spin_lock_global(&ctx->this_lock);
+
+    // growing is optional, leave the reserve alone
+    if (ctx->free_pages < ctx->watermark_min + order2size(new_order) - order2size(order)) {
+        spin_unlock_global(&ctx->this_lock);
+        return false;
+    }
+
+    // check all levels first, nothing must be taken if one of them isn't free
+    for (size_t o = order; o < new_order; o++) {
+        // page is allocated, so a set pair bit means the upper buddy is a free block of order o
+        if (!order_status_at(ctx, idx + order2size(o), o)
+            || pageblock_type(ctx, idx + order2size(o)) != PAGE_MIGRATE_UNMOVABLE) {
+            spin_unlock_global(&ctx->this_lock);
+            return false;
+        }
+    }
+
+    for (size_t o = order; o < new_order; o++) {
+        struct page *buddy = pfn2page(idx + order2size(o));
+        _free_list_del(ctx, buddy);
+        // both halves allocated now
+        order_flip_at(ctx, idx, o);
+        ctx->free_pages -= order2size(o);
+    }
+
+    spin_unlock_global(&ctx->this_lock);
+    return true;
+}
+
+// call with ctx->this_lock being held. returns NULL if the node ran dry
+static struct page *_buddy_alloc_locked(struct buddy_context *ctx, size_t order, size_t type) {
+    size_t cpy_order = order;
+    struct page *pg;
+
+    // jump to the smallest order that's either splittable or returnable
+    uint32_t avail = ctx->nonempty[type] & orders_from(order);
+    if (avail) {
+        order = __builtin_ctz(avail);
+        pg = _free_list_get(ctx, order, type);
+    } else {
+        pg = _steal_block(ctx, cpy_order, type, &order);
+        if (!pg) return NULL;
+    }
 
-found_buddy:
     // split buddy: add second buddy to free list, flip its bit
-    order_flip_at(page2idx(pg), order);
+    order_flip_at(ctx, page2idx(pg), order);
 
     while (order > cpy_order) {
         order--;
 
         struct page *buddy = get_buddy(pg, order);
-        if (order_status_at(page2idx(buddy), order)) {
+        if (order_status_at(ctx, page2idx(buddy), order)) {
             kpanic(0, NULL, "trying to split into invalid buddy entry\n");
         }
 
-        // add split entry to free list
-        _list_link(buddy, &buddy_allocator.orders[order].list);
+        // add split entry to free list, splits of big blocks may land in other pageblocks
+        _free_list_add(ctx, buddy, order, pageblock_type(ctx, page2idx(buddy)));
 
         // flip split buddy pair
-        order_flip_at(page2idx(pg), order);
+        order_flip_at(ctx, page2idx(pg), order);
     }
 
-    frame_allocator_free -= order2size(cpy_order);
-    buddy_allocator.allocation_count++;
+    ctx->free_pages -= order2size(cpy_order);
+    ctx->allocation_count++;
 
-    spin_unlock_global(&buddy_allocator.this_lock);
     return pg;
 }
 
-// free 2 ^ n pages. performs sanity checks.
 // double free check?
-void buddy_free(struct page *page, size_t order) {
-    spin_lock_global(&buddy_allocator.this_lock);
-
+// call with ctx->this_lock being held, ctx has to be the node of page
+static void _buddy_free_locked(struct buddy_context *ctx, struct page *page, size_t order) {
     size_t cpy_order = order;
 
     // firstly, perform some sanity checks
+    if (page->flags & STRUCT_PAGE_FLAG_BUDDY)
+        kpanic(0, NULL, "double free of page %lu (order %lu)\n", page2idx(page), order);
+
     if (page2idx(page) % order2size(order)) {
         kpanic(0, NULL, "trying to free page %lu of order %lu, when alignment order is %lu\n",
             page2idx(page), order, get_alignment_order(page2idx(page) * PAGE_SIZE));
@@ -531,11 +1176,12 @@ void buddy_free(struct page *page, size_t order) {
     // try to merge up to highest possible order: while bitmap entry for this buddy == 0,
     // delete buddy from it's free list, and go up one order.
     // finally, add merged entry back into freelist.
+    // buddies never cross node boundaries, since those split the blocks in buddy_init()
 
     while (order < BUDDY_HIGH_ORDER) {
-        order_flip_at(page2idx(page), order);
+        order_flip_at(ctx, page2idx(page), order);
 
-        if (order_status_at(page2idx(page), order)) {
+        if (order_status_at(ctx, page2idx(page), order)) {
 
             // not ready to merge
             break;
@@ -543,21 +1189,595 @@ void buddy_free(struct page *page, size_t order) {
 
         // unlink the buddy to merge with, and flip it's bit (1 to zero)
         struct page *buddy = get_buddy(page, order);
-        _list_unlink(buddy, &buddy_allocator.orders[order].list);
+        _free_list_del(ctx, buddy);
 
         // the buddies have effectively been merged, try to jump up one order,
-        // which requires page to hold the struct for the first one of the two buddies
-        page = (struct page *)MIN((uintptr_t)page, (uintptr_t)buddy);
+        // which requires page to hold the struct for the first one of the two buddies.
+        // compare pfns, struct pages of different sections aren't ordered
+        if (page2idx(buddy) < page2idx(page))
+            page = buddy;
 
         order++;
     }
 
     // page holds the pointer to the merged buddy, add it back to it's free list
-    _list_link(page, &buddy_allocator.orders[order].list);
+    _free_list_add(ctx, page, order, pageblock_type(ctx, page2idx(page)));
+
+    ctx->free_pages += order2size(cpy_order);
+    ctx->deallocation_count++;
+}
+
+// free the pfns start - end as the biggest aligned blocks that fit.
+// the range has to be allocated, and can't cross nodes (buddy blocks never do)
+static void _buddy_free_range(size_t start, size_t end) {
+    if (start >= end) return;
+
+    struct buddy_context *ctx = &buddy_nodes[pfn2page(start)->node];
+
+    spin_lock_global(&ctx->this_lock);
+    while (start < end) {
+        size_t order = _slice_range(start * PAGE_SIZE, end * PAGE_SIZE);
+        _buddy_free_locked(ctx, pfn2page(start), order);
+        start += order2size(order);
+    }
+    spin_unlock_global(&ctx->this_lock);
+}
+
+// ============================================================================
+// MIGRATE TYPES AND COMPACTION
+// ============================================================================
+
+// Every pageblock (PAGEBLOCK_PAGES pages) is either movable or unmovable, and free
+// blocks sit on the list of their pageblock's type. Allocations take blocks of their
+// own type first, and only steal from the other type once it ran dry, claiming the
+// whole pageblock. That keeps unmovable pages clustered, instead of every pageblock
+// getting pinned by a single kernel page.
+// Movable pages (page_alloc_movable) belong to a page_mapping, which gets told when
+// one of its pages is replaced. When a big allocation fails, compaction moves the
+// movable pages from the bottom of the node into free pages from the top, until a
+// free block of the wanted order has formed.
+
+static bool _has_free_order(struct buddy_context *ctx, size_t order) {
+    return (ctx->nonempty[PAGE_MIGRATE_UNMOVABLE] | ctx->nonempty[PAGE_MIGRATE_MOVABLE]) & orders_from(order);
+}
+
+// take the small free blocks of the next movable pageblock at or below *free_pfn, and
+// return them as order 0 pages linked through next. doesn't go below migrate_pfn.
+// call with ctx->this_lock being held
+static struct page *_isolate_free_pages(struct buddy_context *ctx, size_t *free_pfn, size_t migrate_pfn) {
+    struct page *list = NULL;
+    size_t node = ctx - buddy_nodes;
+
+    for (; !list && *free_pfn > migrate_pfn; *free_pfn -= PAGEBLOCK_PAGES) {
+        size_t start = *free_pfn;
+        if (!pfn_valid(start) || pageblock_type(ctx, start) != PAGE_MIGRATE_MOVABLE)
+            continue;
+
+        for (size_t pfn = start; pfn < MIN(start + PAGEBLOCK_PAGES, ctx->region_end); pfn++) {
+            struct page *pg = pfn2page(pfn);
+            if (pg->node != node || !(pg->flags & STRUCT_PAGE_FLAG_BUDDY))
+                continue;
+
+            // whole pageblocks are worth more as they are
+            size_t order = pg->order;
+            if (order >= PAGEBLOCK_ORDER)
+                break;
+
+            _free_list_del(ctx, pg);
+            order_flip_at(ctx, pfn, order);
+            ctx->free_pages -= order2size(order);
+
+            for (size_t i = 0; i < order2size(order); i++) {
+                struct page *curr = pfn2page(pfn + i);
+                curr->next = page2link(list);
+                list = curr;
+            }
+            pfn += order2size(order) - 1;
+        }
+    }
+
+    return list;
+}
+
+// copy pg into new, and let the mapping swap them. returns false if the mapping is busy,
+// or the page is shared.
+// call with ctx->this_lock being held
+static bool _migrate_page(struct page *pg, struct page *new) {
+    struct page_mapping *mapping = pg->mapping;
+
+    // the mapping lock gets held while allocating, so never wait for it here
+    if (!spin_trylock(&mapping->lock))
+        return false;
+
+    // pages mapped into address spaces are pinned
+    if (page_shared(pg)) {
+        spin_unlock(&mapping->lock);
+        return false;
+    }
+
+    memcpy((void *)(page2phys(new) + hhdm->offset), (void *)(page2phys(pg) + hhdm->offset), PAGE_SIZE);
+
+    new->mapping = mapping;
+    new->index = pg->index;
+    new->flags |= STRUCT_PAGE_FLAG_MOVABLE;
+    mapping->migrate(mapping, pg->index, pg, new);
+
+    spin_unlock(&mapping->lock);
+
+    // the owner's reference went over to new
+    pg->flags &= ~(STRUCT_PAGE_FLAG_MOVABLE | STRUCT_PAGE_FLAG_SHARED);
+    pg->mapping = NULL;
+    return true;
+}
+
+static bool _buddy_compact(struct buddy_context *ctx, size_t order) {
+    if (!ctx->usable_pages)
+        return false;
+
+    size_t node = ctx - buddy_nodes;
+    size_t free_pfn = ALIGN_DOWN(ctx->region_end - 1, PAGEBLOCK_PAGES);
+    struct page *targets = NULL;
+    size_t migrated = 0;
+    bool done = false;
+
+    // the lock only gets held for one pageblock at a time, isolated targets stay ours
+    for (size_t block = ctx->region_start; block < free_pfn; block += PAGEBLOCK_PAGES) {
+        spin_lock_global(&ctx->this_lock);
+
+        if ((done = _has_free_order(ctx, order))) {
+            spin_unlock_global(&ctx->this_lock);
+            break;
+        }
+
+        if (!pfn_valid(block) || pageblock_type(ctx, block) != PAGE_MIGRATE_MOVABLE) {
+            spin_unlock_global(&ctx->this_lock);
+            continue;
+        }
+
+        for (size_t pfn = block; pfn < MIN(block + PAGEBLOCK_PAGES, ctx->region_end); pfn++) {
+            struct page *pg = pfn2page(pfn);
+            if (pg->node != node)
+                continue;
+
+            if (pg->flags & STRUCT_PAGE_FLAG_BUDDY) {
+                pfn += order2size(pg->order) - 1;
+                continue;
+            }
+
+            if (!(pg->flags & STRUCT_PAGE_FLAG_MOVABLE) || !pg->mapping)
+                continue;
+
+            if (!targets)
+                targets = _isolate_free_pages(ctx, &free_pfn, block);
+            // the scanners met
+            if (!targets)
+                break;
+
+            // new->mapping overlaps the list link, so take the next target first
+            struct page *new = targets, *next = link2page(new->next);
+            if (!_migrate_page(pg, new))
+                continue;
+
+            targets = next;
+            _buddy_free_locked(ctx, pg, PAGES_1_ORDER);
+            migrated++;
+        }
+
+        spin_unlock_global(&ctx->this_lock);
+
+        if (!targets && free_pfn <= block)
+            break;
+    }
+
+    spin_lock_global(&ctx->this_lock);
+    // give back what didn't get used
+    while (targets) {
+        struct page *pg = targets;
+        targets = link2page(pg->next);
+        _buddy_free_locked(ctx, pg, PAGES_1_ORDER);
+    }
+
+    done = _has_free_order(ctx, order);
+    ctx->compact_count++;
+    ctx->compact_migrated += migrated;
+    spin_unlock_global(&ctx->this_lock);
+
+    kprintf_verbose("  - buddy: node %lu: compaction migrated %lu pages, order %lu %s\n",
+        node, migrated, order, done ? "available" : "still unavailable");
+    return done;
+}
+
+// ============================================================================
+// PER-CPU PAGE LISTS
+// ============================================================================
+
+// Small blocks (order <= PCP_HIGH_ORDER) are served from per-cpu lists, so the
+// common case never touches the buddy lock of the node. The lists get refilled
+// and drained in batches of pcp_batch(order) blocks, which amortizes the lock.
+// Freed blocks are cache hot and get pushed to the head, freshly refilled or
+// cold blocks get appended to the tail. Allocation pops from the head, draining
+// gives back the coldest blocks from the tail.
+// Pages sitting in a pcp list are accounted as allocated by the buddy allocator.
+// A cpu only caches blocks of its own node, remote blocks bypass the lists.
+
+static inline size_t pcp_batch(size_t order) {
+    return MAX(PCP_BATCH >> order, 2ul);
+}
+
+static inline size_t pcp_high(size_t order) {
+    return pcp_batch(order) * 4;
+}
+
+static inline void _pcp_link_head(struct page *pg, struct pcp_list *pcl) {
+    pg->prev = PAGE_LINK_NONE;
+    pg->next = page2link(pcl->head);
+    if (pcl->head)
+        pcl->head->prev = page2link(pg);
+    else
+        pcl->tail = pg;
+    pcl->head = pg;
+    pcl->count++;
+}
+
+static inline void _pcp_link_tail(struct page *pg, struct pcp_list *pcl) {
+    pg->next = PAGE_LINK_NONE;
+    pg->prev = page2link(pcl->tail);
+    if (pcl->tail)
+        pcl->tail->next = page2link(pg);
+    else
+        pcl->head = pg;
+    pcl->tail = pg;
+    pcl->count++;
+}
+
+static inline struct page *_pcp_get_head(struct pcp_list *pcl) {
+    struct page *pg = pcl->head;
+    if (!pg) return NULL;
+
+    pcl->head = link2page(pg->next);
+    if (pcl->head)
+        pcl->head->prev = PAGE_LINK_NONE;
+    else
+        pcl->tail = NULL;
+    pcl->count--;
+
+    pg->next = pg->prev = PAGE_LINK_POISON;
+    return pg;
+}
+
+static inline struct page *_pcp_get_tail(struct pcp_list *pcl) {
+    struct page *pg = pcl->tail;
+    if (!pg) return NULL;
+
+    pcl->tail = link2page(pg->prev);
+    if (pcl->tail)
+        pcl->tail->next = PAGE_LINK_NONE;
+    else
+        pcl->head = NULL;
+    pcl->count--;
+
+    pg->next = pg->prev = PAGE_LINK_POISON;
+    return pg;
+}
+
+// pull up to one batch of blocks out of the buddy allocator of the local node.
+// call with preemption disabled
+static void pcp_refill(struct buddy_context *ctx, struct pcp_list *pcl, size_t order)
+{
+    if (!ctx->usable_pages) return;
+
+    // below the min watermark, pcp_alloc() falls back to buddy_alloc_node() and its reclaim
+    spin_lock(&ctx->this_lock);
+    for (size_t i = 0; i < pcp_batch(order) && _above_min(ctx, order); i++) {
+        struct page *pg = _buddy_alloc_locked(ctx, order, PAGE_MIGRATE_UNMOVABLE);
+        if (!pg) break;
+
+        pg->flags |= STRUCT_PAGE_FLAG_PCP;
+        _pcp_link_tail(pg, pcl);
+    }
+    spin_unlock(&ctx->this_lock);
+}
+
+// give count of the coldest blocks back to the buddy allocator of the local node.
+// call with preemption disabled
+static void pcp_drain(struct buddy_context *ctx, struct pcp_list *pcl, size_t order, size_t count)
+{
+    spin_lock(&ctx->this_lock);
+    while (count--) {
+        struct page *pg = _pcp_get_tail(pcl);
+        if (!pg) break;
+
+        pg->flags &= ~STRUCT_PAGE_FLAG_PCP;
+        _buddy_free_locked(ctx, pg, order);
+    }
+    spin_unlock(&ctx->this_lock);
+}
+
+// without reclaim, NULL if the local lists can't be refilled above the min watermark
+static struct page *pcp_alloc(size_t order, bool reclaim)
+{
+    int_status_t old = preempt_fetch_disable();
+    cpu_local_t *cpu = get_this_cpu();
+    struct pcp_list *pcl = &cpu->pcp->lists[order];
+    size_t node = cpu->numa_node;
+
+    if (!pcl->count)
+        pcp_refill(&buddy_nodes[node], pcl, order);
+
+    struct page *pg = _pcp_get_head(pcl);
+    if (pg)
+        pg->flags &= ~STRUCT_PAGE_FLAG_PCP;
+
+    preempt_restore(old);
+
+    // the local node ran dry, take the block from the next closest node.
+    // remote blocks never get cached
+    if (!pg && reclaim)
+        pg = buddy_alloc_node(order, node);
+    return pg;
+}
+
+static void pcp_free(struct page *page, size_t order, bool cold)
+{
+    if (page->flags & (STRUCT_PAGE_FLAG_PCP | STRUCT_PAGE_FLAG_ZEROED))
+        kpanic(0, NULL, "double free of page %lu (order %lu)\n", page2idx(page), order);
+
+    if (page2idx(page) % order2size(order)) {
+        kpanic(0, NULL, "trying to free page %lu of order %lu, when alignment order is %lu\n",
+            page2idx(page), order, get_alignment_order(page2idx(page) * PAGE_SIZE));
+    }
+
+    int_status_t old = preempt_fetch_disable();
+    cpu_local_t *cpu = get_this_cpu();
+
+    // remote blocks go straight back to their own node
+    if (page->node != cpu->numa_node) {
+        preempt_restore(old);
+        buddy_free(page, order);
+        return;
+    }
+
+    struct pcp_list *pcl = &cpu->pcp->lists[order];
+
+    page->flags |= STRUCT_PAGE_FLAG_PCP;
+    if (cold)
+        _pcp_link_tail(page, pcl);
+    else
+        _pcp_link_head(page, pcl);
+
+    if (pcl->count > pcp_high(order))
+        pcp_drain(&buddy_nodes[cpu->numa_node], pcl, order, pcp_batch(order));
+
+    preempt_restore(old);
+}
+
+// ============================================================================
+// PRE-ZEROED POOL
+// ============================================================================
+
+// page_calloc() mostly wants single pages (page tables), so an idle priority thread
+// keeps a pool of already zeroed order 0 pages per node. Pooled pages carry
+// STRUCT_PAGE_FLAG_ZEROED and count as allocated for the buddy allocator.
+// If the buddy allocator runs dry, the pools get drained back into it.
+
+struct zero_pool {
+    k_spinlock_t lock;
+    struct page *head;
+    size_t count;
+};
+
+static struct zero_pool zero_pools[NUMA_MAX_NODES];
+
+static struct page *zero_pool_get(size_t node)
+{
+    struct zero_pool *zp = &zero_pools[node];
+
+    // racy, only a hint
+    if (!zp->count) return NULL;
+
+    spin_lock_global(&zp->lock);
+    struct page *pg = _list_get(&zp->head);
+    if (pg)
+        zp->count--;
+    spin_unlock_global(&zp->lock);
+
+    if (pg) {
+        if (!(pg->flags & STRUCT_PAGE_FLAG_ZEROED))
+            kpanic(0, NULL, "page %lu in zero pool isn't zeroed\n", page2idx(pg));
+        pg->flags &= ~STRUCT_PAGE_FLAG_ZEROED;
+    }
+    return pg;
+}
+
+// zero up to count pages of node into its pool. returns the number of pages added
+static size_t zero_pool_fill(size_t node, size_t count)
+{
+    struct buddy_context *ctx = &buddy_nodes[node];
+    struct zero_pool *zp = &zero_pools[node];
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        // leave the rest of the memory to actual allocations
+        if (ctx->free_pages < ctx->usable_pages / ZERO_POOL_RESERVE_FRACTION)
+            break;
+
+        spin_lock_global(&ctx->this_lock);
+        struct page *pg = _buddy_alloc_locked(ctx, PAGES_1_ORDER, PAGE_MIGRATE_UNMOVABLE);
+        spin_unlock_global(&ctx->this_lock);
+        if (!pg) break;
+
+        memset((void *)(page2phys(pg) + hhdm->offset), 0, PAGE_SIZE);
+        pg->flags |= STRUCT_PAGE_FLAG_ZEROED;
+
+        spin_lock_global(&zp->lock);
+        _list_link(pg, &zp->head);
+        zp->count++;
+        spin_unlock_global(&zp->lock);
+    }
+
+    return i;
+}
+
+// give all pooled pages back to the buddy allocator. returns the number of pages freed
+static size_t zero_pool_drain(void)
+{
+    size_t drained = 0;
+
+    for (size_t n = 0; n < numa_node_count; n++) {
+        struct zero_pool *zp = &zero_pools[n];
+
+        spin_lock_global(&zp->lock);
+        struct page *list = zp->head;
+        zp->head = NULL;
+        zp->count = 0;
+        spin_unlock_global(&zp->lock);
+
+        struct page *pg;
+        while ((pg = _list_get(&list))) {
+            pg->flags &= ~STRUCT_PAGE_FLAG_ZEROED;
+            buddy_free(pg, PAGES_1_ORDER);
+            drained++;
+        }
+    }
+
+    return drained;
+}
+
+static size_t zero_pool_count(void)
+{
+    size_t count = 0;
+    for (size_t n = 0; n < numa_node_count; n++)
+        count += zero_pools[n].count;
+    return count;
+}
+
+static void page_zero_thread(void *arg)
+{
+    (void)arg;
+
+    preempt_enable();
+
+    for (;;) {
+        for (size_t n = 0; n < numa_node_count; n++) {
+            if (!buddy_nodes[n].usable_pages) continue;
+
+            while (zero_pools[n].count < ZERO_POOL_HIGH) {
+                if (!zero_pool_fill(n, MIN(ZERO_POOL_BATCH, ZERO_POOL_HIGH - zero_pools[n].count)))
+                    break;
+            }
+        }
 
-    frame_allocator_free += order2size(cpy_order);
-    buddy_allocator.deallocation_count++;
+        scheduler_sleep_for(ZERO_POOL_INTERVAL_MS);
+    }
 
-    spin_unlock_global(&buddy_allocator.this_lock);
+    unreachable();
 }
-#endif // MUNKOS_CONFIG_BUDDY
\ No newline at end of file
+#endif // MUNKOS_CONFIG_BUDDY
+
+// ============================================================================
+// RECLAIM
+// ============================================================================
+
+// Caches register a shrinker to give memory back under pressure. Each round, every
+// shrinker gets asked for the full amount: freeing objects of one cache often only
+// frees pages once the slab caches run. New shrinkers go to the front of the list, so
+// the generic slab caches (registered first) run last, after everybody else freed.
+// Allocations that find every node at its min watermark reclaim directly, and a low
+// priority thread brings nodes that went below their low watermark back up to high.
+// Only one reclaimer runs at a time, everybody else just retries without it.
+// Code holding map_page_lock or a vma_lock uses page_alloc_atomic() instead, since
+// whatever a shrinker frees may need those (or a shootdown the holder can't ack).
+
+static struct shrinker *shrinkers;
+static k_spinlock_t reclaim_lock;   // protects the shrinker list, held while shrinkers run
+static size_t reclaim_rounds, reclaimed_pages;
+
+void shrinker_register(struct shrinker *shrinker)
+{
+    spin_lock_global(&reclaim_lock);
+    shrinker->next = shrinkers;
+    shrinkers = shrinker;
+    spin_unlock_global(&reclaim_lock);
+
+    kprintf_verbose("  - reclaim: registered shrinker \"%s\"\n", shrinker->name);
+}
+
+void shrinker_unregister(struct shrinker *shrinker)
+{
+    spin_lock_global(&reclaim_lock);
+    struct shrinker **curr = &shrinkers;
+    while (*curr && *curr != shrinker)
+        curr = &(*curr)->next;
+
+    if (!*curr)
+        kpanic(0, NULL, "shrinker \"%s\" isn't registered\n", shrinker->name);
+    *curr = shrinker->next;
+    spin_unlock_global(&reclaim_lock);
+}
+
+size_t page_reclaim(size_t nr)
+{
+    int_status_t old = preempt_fetch_disable();
+
+    // somebody else is reclaiming already (maybe even us, further up the stack)
+    if (!spin_trylock(&reclaim_lock)) {
+        preempt_restore(old);
+        return 0;
+    }
+
+    size_t freed = 0;
+    for (struct shrinker *s = shrinkers; s; s = s->next) {
+        if (s->count(s))
+            freed += s->scan(s, nr);
+    }
+
+    reclaim_rounds++;
+    reclaimed_pages += freed;
+
+    spin_unlock(&reclaim_lock);
+    preempt_restore(old);
+
+    return freed;
+}
+
+#ifdef MUNKOS_CONFIG_BUDDY
+static bool kswapd_pending;
+
+// picked up within KSWAPD_INTERVAL_MS, can be called from anywhere
+static void kswapd_wake(void)
+{
+    __atomic_store_n(&kswapd_pending, true, __ATOMIC_RELAXED);
+}
+
+static void kswapd_thread(void *arg)
+{
+    (void)arg;
+
+    preempt_enable();
+
+    for (;;) {
+        bool woken = __atomic_exchange_n(&kswapd_pending, false, __ATOMIC_RELAXED);
+
+        for (size_t n = 0; n < numa_node_count; n++) {
+            struct buddy_context *ctx = &buddy_nodes[n];
+            if (!ctx->usable_pages) continue;
+
+            // the counters are only read as a hint
+            if (!woken && ctx->free_pages >= ctx->watermark_low)
+                continue;
+
+            while (ctx->free_pages < ctx->watermark_high) {
+                if (!page_reclaim(MIN(ctx->watermark_high - ctx->free_pages, RECLAIM_BATCH)))
+                    break;
+            }
+
+            kprintf_verbose("  - reclaim: node %lu: %lu pages free (%lu rounds, %lu pages reclaimed so far)\n",
+                n, ctx->free_pages, reclaim_rounds, reclaimed_pages);
+        }
+
+        scheduler_sleep_for(KSWAPD_INTERVAL_MS);
+    }
+
+    unreachable();
+}
+#endif // MUNKOS_CONFIG_BUDDY
@@ -0,0 +1,125 @@
+/*
+ * ioremap: mmio and other physical ranges mapped with a cache type of their own, most
+ * importantly WC for framebuffers and prefetchable bars. Areas get a range of
+ * IOREMAP_START - IOREMAP_END out of the ioremap vmem arena. Ranges of 2 MiB and more
+ * get a va congruent to their physical address modulo 2 MiB, so mmu_map_range() can use
+ * huge leaves.
+ * Mapping the same frame with two cache types is undefined, so every area is checked
+ * against the hhdm and the other areas first. Areas are kept in a rbtree keyed by their
+ * start for iounmap().
+*/
+
+#include "ioremap.h"
+#include "frame_alloc.h"
+#include "interrupt.h"
+#include "kheap.h"
+#include "kprintf.h"
+#include "locking.h"
+#include "macros.h"
+#include "mmu.h"
+#include "rbtree.h"
+#include "vmem.h"
+
+struct ioremap_area {
+    size_t key;                         // mapped start, has to come first (struct rb_tree_data)
+    uintptr_t phys;                     // page aligned
+    size_t size;                        // mapped bytes
+    uintptr_t base;                     // vmem range, the mapping may start behind it
+    size_t reserved;
+    enum memory_cache_type cache_type;
+};
+
+static struct slab_cache *ioremap_area_cache;
+static struct vmem_arena *ioremap_arena;
+
+static rb_tree_node_t *ioremap_tree;
+static k_spinlock_t ioremap_lock;
+
+void ioremap_init(void)
+{
+    ioremap_area_cache = kmem_cache_create("ioremap_area", sizeof(struct ioremap_area), 8, NULL);
+    if (!ioremap_area_cache)
+        kpanic(0, NULL, "couldn't create ioremap area cache\n");
+
+    ioremap_arena = vmem_create("ioremap", IOREMAP_START, IOREMAP_END - IOREMAP_START, PAGE_SIZE, 0);
+    if (!ioremap_arena)
+        kpanic(0, NULL, "couldn't create ioremap arena\n");
+
+    init_root_node(&ioremap_tree);
+}
+
+// another area maps part of phys -> phys + size with a different type. call with
+// ioremap_lock held
+static bool _area_conflict(uintptr_t phys, size_t size, enum memory_cache_type cache_type)
+{
+    for (struct ioremap_area *area = (struct ioremap_area *)tree_find_ceil(&ioremap_tree, 0); area;
+        area = (struct ioremap_area *)tree_find_ceil(&ioremap_tree, area->key + 1)) {
+        if (area->cache_type != cache_type && area->phys < phys + size && phys < area->phys + area->size)
+            return true;
+    }
+    return false;
+}
+
+void *ioremap(uintptr_t phys, size_t len, enum memory_cache_type cache_type)
+{
+    if (!len)
+        return NULL;
+
+    uintptr_t start = ALIGN_DOWN(phys, PAGE_SIZE);
+    size_t size = ALIGN_UP(phys + len, PAGE_SIZE) - start;
+
+    struct ioremap_area *area = kmem_cache_alloc(ioremap_area_cache);
+    if (!area)
+        return NULL;
+
+    // room to slide the mapping to the right offset inside a 2mib page
+    area->reserved = size >= HUGE_PAGE_2M ? size + HUGE_PAGE_2M - PAGE_SIZE : size;
+    area->base = vmem_alloc(ioremap_arena, area->reserved, VMEM_INSTANTFIT);
+    if (!area->base) {
+        kprintf("  - ioremap: no va range left for %lu bytes\n", size);
+        kmem_cache_free(ioremap_area_cache, area);
+        return NULL;
+    }
+
+    area->key = area->base;
+    if (size >= HUGE_PAGE_2M)
+        area->key += (start - area->base) & (HUGE_PAGE_2M - 1);
+    area->phys = start;
+    area->size = size;
+    area->cache_type = cache_type;
+
+    spin_lock_global(&ioremap_lock);
+
+    if (_area_conflict(start, size, cache_type)
+        || mmu_cache_type_conflict(&kernel_pmc, start + hhdm->offset, size, cache_type)) {
+        spin_unlock_global(&ioremap_lock);
+        kprintf("  - ioremap: 0x%p - 0x%p is mapped with another cache type already\n", start, start + size);
+        vmem_free(ioremap_arena, area->base, area->reserved);
+        kmem_cache_free(ioremap_area_cache, area);
+        return NULL;
+    }
+    tree_insert(&ioremap_tree, (struct rb_tree_data *)area);
+
+    spin_unlock_global(&ioremap_lock);
+
+    mmu_map_range_linear(&kernel_pmc, area->key, start, size, MAF_WRITE | MAF_NX, cache_type);
+
+    return (void *)(area->key + (phys - start));
+}
+
+void iounmap(void *addr)
+{
+    if (!addr) return;
+
+    spin_lock_global(&ioremap_lock);
+    struct ioremap_area *area = (struct ioremap_area *)tree_remove(&ioremap_tree, ALIGN_DOWN((uintptr_t)addr, PAGE_SIZE));
+    spin_unlock_global(&ioremap_lock);
+
+    if (!area)
+        kpanic(0, NULL, "iounmap: %p isn't the start of an ioremap area\n", addr);
+
+    // the frames aren't ours
+    mmu_unmap_range(&kernel_pmc, area->key, area->size, false);
+    vmem_free(ioremap_arena, area->base, area->reserved);
+    kmem_cache_free(ioremap_area_cache, area);
+}
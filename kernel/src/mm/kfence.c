@@ -0,0 +1,322 @@
+/*
+ * KFENCE style sampling sanitizer. Every KFENCE_SAMPLE_INTERVAL-th kmalloc of a cpu
+ * gets its own page out of a small pool, where every object page sits between two
+ * unmapped guard pages:
+ *   [guard][obj 0][guard][obj 1][guard] ... [obj n-1][guard]
+ * Objects are placed at the end of their page on even slots (catches overflows),
+ * and at the start on odd ones (catches underflows). The rest of the page is filled
+ * with canary bytes, checked on free. Freed object pages get unmapped until reuse,
+ * so use-after-free faults as well. kfree() may run in any context, so it only queues
+ * the object, and a thread does the unmapping and shootdowns in batches. Until then
+ * the page stays mapped, use-after-free right after the free goes unnoticed.
+ * Faults in the pool are reported, and the page
+ * gets mapped back in so the kernel keeps running, the affected slots are retired.
+ * Everything else only costs a per-cpu countdown in kmalloc().
+*/
+
+#include "kfence.h"
+
+#ifdef CONFIG_KFENCE
+
+#include "compiler.h"
+#include "cpu.h"
+#include "frame_alloc.h"
+#include "kprintf.h"
+#include "locking.h"
+#include "macros.h"
+#include "memory.h"
+#include "mmu.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "stacktrace.h"
+#include "vmalloc.h"
+
+enum kfence_object_state {
+    KFENCE_OBJECT_UNUSED,
+    KFENCE_OBJECT_ALLOCATED,
+    KFENCE_OBJECT_FREEING,      // page still mapped, waiting for the protect thread
+    KFENCE_OBJECT_FREED,        // page unmapped, waiting for reuse
+};
+
+struct kfence_object {
+    enum kfence_object_state state;
+    bool retired;               // something was reported, never hand it out again
+    uintptr_t page;             // va of the object page
+    uintptr_t page_phys;
+    uintptr_t addr;             // object address inside the page
+    size_t size;
+    uintptr_t alloc_caller, free_caller;
+    struct kfence_object *next; // freelist, or the list of objects to protect
+};
+
+uintptr_t kfence_pool_start, kfence_pool_end;
+
+static struct kfence_object kfence_objects[KFENCE_NUM_OBJECTS];
+// guard page frames, guard i is in front of object i (the last one behind the last object)
+static uintptr_t kfence_guard_phys[KFENCE_NUM_OBJECTS + 1];
+
+// fifo, so freed objects stay protected for as long as possible
+static struct kfence_object *kfence_free_head, *kfence_free_tail;
+// freed objects whose pages are still mapped
+static struct kfence_object *kfence_protect_list;
+static k_spinlock_t kfence_lock;
+
+static size_t kfence_allocations, kfence_reports;
+
+static inline uintptr_t _guard_addr(size_t i)
+{
+    return kfence_pool_start + 2 * i * PAGE_SIZE;
+}
+
+static inline void _map(uintptr_t va, uintptr_t pa)
+{
+    mmu_map_single_page_4k(&kernel_pmc, va, pa, PM_COMMON_PRESENT | PM_COMMON_WRITE | PM_COMMON_NX);
+}
+
+// call with kfence_lock being held
+static void _freelist_push(struct kfence_object *obj)
+{
+    obj->next = NULL;
+    if (kfence_free_tail)
+        kfence_free_tail->next = obj;
+    else
+        kfence_free_head = obj;
+    kfence_free_tail = obj;
+}
+
+// call with kfence_lock being held
+static struct kfence_object *_freelist_pop(void)
+{
+    struct kfence_object *obj = kfence_free_head;
+    if (obj) {
+        kfence_free_head = obj->next;
+        if (!kfence_free_head)
+            kfence_free_tail = NULL;
+    }
+    return obj;
+}
+
+void kfence_init(void)
+{
+    size_t pages = 2 * KFENCE_NUM_OBJECTS + 1;
+
+    uintptr_t pool = (uintptr_t)vmalloc(pages * PAGE_SIZE);
+    if (!pool) {
+        kprintf("  - kfence: couldn't allocate the pool, disabled\n");
+        return;
+    }
+
+    for (size_t i = 0; i <= KFENCE_NUM_OBJECTS; i++) {
+        uintptr_t guard = pool + 2 * i * PAGE_SIZE;
+        kfence_guard_phys[i] = virt2phys(&kernel_pmc, guard);
+        mmu_unmap_single_page(&kernel_pmc, guard, false);
+    }
+
+    for (size_t i = 0; i < KFENCE_NUM_OBJECTS; i++) {
+        struct kfence_object *obj = &kfence_objects[i];
+        obj->state = KFENCE_OBJECT_UNUSED;
+        obj->page = pool + (2 * i + 1) * PAGE_SIZE;
+        obj->page_phys = virt2phys(&kernel_pmc, obj->page);
+        _freelist_push(obj);
+    }
+
+    // enables sampling
+    kfence_pool_end = pool + pages * PAGE_SIZE;
+    __atomic_store_n(&kfence_pool_start, pool, __ATOMIC_RELEASE);
+
+    kprintf_verbose("  - kfence: %d objects at 0x%p, sampling every %d allocations\n",
+        KFENCE_NUM_OBJECTS, pool, KFENCE_SAMPLE_INTERVAL);
+}
+
+bool kfence_should_sample(void)
+{
+    if (!smp_initialized || !__atomic_load_n(&kfence_pool_start, __ATOMIC_ACQUIRE))
+        return false;
+
+    int_status_t old = preempt_fetch_disable();
+    cpu_local_t *cpu = get_this_cpu();
+    bool sample = !cpu->kfence_countdown;
+    cpu->kfence_countdown = sample ? KFENCE_SAMPLE_INTERVAL - 1 : cpu->kfence_countdown - 1;
+    preempt_restore(old);
+
+    return sample;
+}
+
+void *kfence_alloc(size_t size, uintptr_t caller)
+{
+    if (!size || size > PAGE_SIZE)
+        return NULL;
+
+    spin_lock_global(&kfence_lock);
+    struct kfence_object *obj;
+    // objects can get retired while they're freed (use-after-free report)
+    while ((obj = _freelist_pop()) && obj->retired)
+        ;
+    if (!obj) {
+        spin_unlock_global(&kfence_lock);
+        return NULL;
+    }
+
+    size_t slot = obj - kfence_objects;
+    if (obj->state == KFENCE_OBJECT_FREED)
+        _map(obj->page, obj->page_phys);
+
+    obj->state = KFENCE_OBJECT_ALLOCATED;
+    obj->size = size;
+    obj->alloc_caller = caller;
+    obj->free_caller = 0;
+    // pow2 sizes keep the kmalloc alignment at the page end
+    obj->addr = (slot & 1) ? obj->page : obj->page + PAGE_SIZE - ALIGN_UP(size, sizeof(void *));
+    kfence_allocations++;
+
+    spin_unlock_global(&kfence_lock);
+
+    memset((void *)obj->page, KFENCE_CANARY_BYTE, PAGE_SIZE);
+    return (void *)obj->addr;
+}
+
+static void _report(const char *what, struct kfence_object *obj, uintptr_t addr)
+{
+    kfence_reports++;
+
+    kprintf("  - kfence: %s at 0x%p\n", what, addr);
+    if (obj) {
+        kprintf("  - kfence: object 0x%p (%lu bytes, offset %ld), allocated by 0x%p",
+            obj->addr, obj->size, (long)(addr - obj->addr), obj->alloc_caller);
+        if (obj->free_caller)
+            kprintf(", freed by 0x%p", obj->free_caller);
+        kprintf("\n");
+        obj->retired = true;
+    }
+}
+
+static inline struct kfence_object *_addr2obj(const void *addr)
+{
+    size_t page = ((uintptr_t)addr - kfence_pool_start) / PAGE_SIZE;
+    // even pages are guards
+    return (page & 1) ? &kfence_objects[page / 2] : NULL;
+}
+
+size_t kfence_ksize(const void *addr)
+{
+    struct kfence_object *obj = _addr2obj(addr);
+    return obj ? obj->size : 0;
+}
+
+void kfence_free(void *addr, uintptr_t caller)
+{
+    struct kfence_object *obj = _addr2obj(addr);
+
+    spin_lock_global(&kfence_lock);
+
+    if (!obj || obj->state != KFENCE_OBJECT_ALLOCATED || obj->addr != (uintptr_t)addr) {
+        bool freed = obj && (obj->state == KFENCE_OBJECT_FREEING || obj->state == KFENCE_OBJECT_FREED);
+        _report(freed ? "double free" : "invalid free", obj, (uintptr_t)addr);
+        spin_unlock_global(&kfence_lock);
+        stacktrace();
+        return;
+    }
+
+    // everything around the object has to be untouched
+    uint8_t *page = (uint8_t *)obj->page;
+    size_t start = obj->addr - obj->page, end = start + obj->size;
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        if (i == start) i = end;
+        if (i < PAGE_SIZE && page[i] != KFENCE_CANARY_BYTE) {
+            _report("memory corruption", obj, obj->page + i);
+            stacktrace();
+            break;
+        }
+    }
+
+    // the protect thread unmaps it, kfree() never takes map_page_lock or shoots down
+    obj->state = KFENCE_OBJECT_FREEING;
+    obj->free_caller = caller;
+    obj->next = kfence_protect_list;
+    kfence_protect_list = obj;
+
+    spin_unlock_global(&kfence_lock);
+}
+
+static void _kfence_protect_thread(void *arg)
+{
+    (void)arg;
+
+    preempt_enable();
+
+    for (;;) {
+        spin_lock_global(&kfence_lock);
+        struct kfence_object *list = kfence_protect_list;
+        kfence_protect_list = NULL;
+        spin_unlock_global(&kfence_lock);
+
+        // not on the freelist yet, so nobody maps them back in meanwhile
+        while (list) {
+            struct kfence_object *obj = list;
+            list = obj->next;
+            mmu_unmap_single_page(&kernel_pmc, obj->page, false);
+
+            spin_lock_global(&kfence_lock);
+            obj->state = KFENCE_OBJECT_FREED;
+            if (!obj->retired)
+                _freelist_push(obj);
+            spin_unlock_global(&kfence_lock);
+        }
+
+        scheduler_sleep_for(KFENCE_PROTECT_INTERVAL_MS);
+    }
+
+    unreachable();
+}
+
+void kfence_protect_init(void)
+{
+    if (__atomic_load_n(&kfence_pool_start, __ATOMIC_ACQUIRE))
+        scheduler_new_kernel_thread(_kfence_protect_thread, NULL, TASK_PRIORITY_LOW);
+}
+
+bool kfence_handle_fault(cpu_ctx_t *regs)
+{
+    uintptr_t addr = regs->cr2;
+    if (!kfence_pool_start || !is_kfence_addr((void *)addr))
+        return false;
+
+    spin_lock_global(&kfence_lock);
+
+    struct kfence_object *obj = _addr2obj((void *)addr);
+    if (obj) {
+        _report(obj->state == KFENCE_OBJECT_FREED ? "use-after-free" : "invalid access", obj, addr);
+        _map(obj->page, obj->page_phys);
+    } else {
+        // guard page: blame the closer one of the allocated neighbours
+        size_t guard = (addr - kfence_pool_start) / (2 * PAGE_SIZE);
+        struct kfence_object *left = guard ? &kfence_objects[guard - 1] : NULL,
+            *right = guard < KFENCE_NUM_OBJECTS ? &kfence_objects[guard] : NULL;
+        if (left && left->state != KFENCE_OBJECT_ALLOCATED) left = NULL;
+        if (right && right->state != KFENCE_OBJECT_ALLOCATED) right = NULL;
+
+        uintptr_t page = _guard_addr(guard);
+        if (left && right)
+            obj = (addr - page < PAGE_SIZE / 2) ? left : right;
+        else
+            obj = left ? left : right;
+
+        _report("out-of-bounds access", obj, addr);
+        _map(page, kfence_guard_phys[guard]);
+
+        // the guard is gone, so both neighbours aren't protected anymore
+        if (guard) kfence_objects[guard - 1].retired = true;
+        if (guard < KFENCE_NUM_OBJECTS) kfence_objects[guard].retired = true;
+    }
+
+    spin_unlock_global(&kfence_lock);
+
+    kprintf("  - kfence: rip 0x%p, %s, %lu reports so far\n",
+        regs->rip, (regs->error_code & 2) ? "write" : "read", kfence_reports);
+    stacktrace_at(regs->rbp);
+
+    // retry the access, the page is mapped now
+    return true;
+}
+
+#endif // CONFIG_KFENCE
@@ -6,6 +6,8 @@
  * early_mem_exit(), cleans up memmap copy, from now on unusable
  * early_mem_statistics(&usable, &free), stores total usable memory and free memory in pages
  * early_mem_dbg_print(), self explaining
+ * It also sets up the sparse struct page map: physical memory is split into sections
+ * of PAGES_PER_SECTION pages, and only sections containing ram get a struct page array.
 */
 
 #include "frame_alloc.h"
@@ -32,6 +34,64 @@ static size_t early_mem_bytes_allocated;
 
 static int early_mem_is_initialized = 0;
 
+// memory types that get a struct page, everything else is mmio or unusable
+static inline bool _has_ram(size_t type)
+{
+    return type == LIMINE_MEMMAP_USABLE || type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE
+        || type == LIMINE_MEMMAP_KERNEL_AND_MODULES || type == LIMINE_MEMMAP_ACPI_RECLAIMABLE
+        || type == LIMINE_MEMMAP_ACPI_NVS;
+}
+
+// walk all sections containing ram, relies on the memmap being sorted. with map == NULL
+// just count them, otherwise hand out the struct page arrays from map.
+// returns the number of present sections
+static size_t _sparse_walk(struct page *map)
+{
+    size_t present = 0, next = 0;   // next: first section that hasn't been visited
+
+    for (size_t i = 0; i < memmap_entry_count; i++) {
+        struct memmap_entry *ent = &memmap[i];
+        if (!_has_ram(ent->type) || !ent->length) continue;
+
+        size_t first = MAX(next, ent->start >> SECTION_SHIFT);
+        size_t last = (ent->start + ent->length - 1) >> SECTION_SHIFT;
+        for (size_t s = first; s <= last; s++) {
+            if (map) {
+                struct page *sec_map = map + present * PAGES_PER_SECTION;
+                for (size_t j = 0; j < PAGES_PER_SECTION; j++)
+                    sec_map[j].section = s;
+                mem_sections[s].mem_map = sec_map - (s << PFN_SECTION_SHIFT);
+            }
+            present++;
+        }
+        next = MAX(next, last + 1);
+    }
+
+    return present;
+}
+
+static void sparse_init(void)
+{
+    mem_section_count = DIV_ROUNDUP(early_mem_total_pages, PAGES_PER_SECTION);
+    if (mem_section_count > UINT16_MAX + 1ul) {
+        kpanic(0, NULL, "physical address space too big for %lu sections\n", mem_section_count);
+    }
+
+    mem_sections = early_mem_alloc(mem_section_count * sizeof(struct mem_section));
+    memset(mem_sections, 0x00, mem_section_count * sizeof(struct mem_section));
+
+    // one block for all present sections, keeps early_mem allocations low.
+    // early_mem_alloc() doesn't align, start the struct pages on a cache line
+    size_t present = _sparse_walk(NULL);
+    size_t map_size = present * PAGES_PER_SECTION * sizeof(struct page);
+    struct page *map = (struct page *)ALIGN_UP((uintptr_t)early_mem_alloc(map_size + 64), 64);
+    memset(map, 0x00, map_size);
+    _sparse_walk(map);
+
+    kprintf_verbose("  - early_mem: %lu of %lu memory sections present, struct pages use %luKiB\n",
+        present, mem_section_count, (present * PAGES_PER_SECTION * sizeof(struct page)) / KiB);
+}
+
 struct limine_memmap_request memmap_request = {
     .id = LIMINE_MEMMAP_REQUEST,
     .revision = 0
@@ -88,8 +148,7 @@ size_t early_mem_init()
 
     early_mem_is_initialized = 1;
 
-    pages = early_mem_alloc(early_mem_total_pages * sizeof(struct page));
-    memset(pages, 0x00, early_mem_total_pages * sizeof(struct page));
+    sparse_init();
 
     return early_mem_total_pages;
 }
@@ -0,0 +1,219 @@
+/*
+ * NUMA topology. The SRAT tells us which physical memory ranges and cpus belong
+ * to which proximity domain, the SLIT how far the domains are apart. Proximity
+ * domains get mapped to dense node ids (0 .. numa_node_count - 1), the page frame
+ * allocator keeps one buddy allocator per node and allocates node-local first,
+ * falling back to the other nodes ordered by distance.
+ * Everything is parsed into static tables, since this runs before any allocator.
+*/
+
+#include "numa.h"
+#include "_acpi.h"
+#include "frame_alloc.h"
+#include "interrupt.h"
+#include "kprintf.h"
+#include "macros.h"
+#include "scheduler.h"
+#include "smp.h"
+
+#define NUMA_MAX_CPUS 256
+
+struct numa_cpu_affinity {
+    uint32_t apic_id;
+    size_t node;
+};
+
+struct numa_node numa_nodes[NUMA_MAX_NODES];
+size_t numa_node_count = 1;
+
+static struct numa_mem_range numa_ranges[NUMA_MAX_MEM_RANGES];
+static size_t numa_range_count;
+
+static struct numa_cpu_affinity numa_cpus[NUMA_MAX_CPUS];
+static size_t numa_cpu_count;
+
+// get the node id for a proximity domain, create it if it doesn't exist yet
+static size_t _domain2node(uint32_t domain)
+{
+    for (size_t i = 0; i < numa_node_count; i++) {
+        if (numa_nodes[i].proximity_domain == domain)
+            return i;
+    }
+
+    if (numa_node_count == NUMA_MAX_NODES) {
+        kprintf("  - numa: too many proximity domains, folding domain %u into node 0\n", domain);
+        return 0;
+    }
+
+    numa_nodes[numa_node_count].proximity_domain = domain;
+    return numa_node_count++;
+}
+
+static void _add_cpu(uint32_t apic_id, uint32_t domain)
+{
+    if (numa_cpu_count == NUMA_MAX_CPUS) {
+        kprintf("  - numa: too many cpus in srat, ignoring apic id %u\n", apic_id);
+        return;
+    }
+
+    numa_cpus[numa_cpu_count].apic_id = apic_id;
+    numa_cpus[numa_cpu_count].node = _domain2node(domain);
+    numa_cpu_count++;
+}
+
+static void parse_srat(struct acpi_srat *srat)
+{
+    for (uintptr_t off = 0; off < srat->header.length - sizeof(struct acpi_srat); ) {
+        struct acpi_srat_header *hdr = (struct acpi_srat_header *)(srat->entries + off);
+
+        if (hdr->type == SRAT_ENTRY_PROCESSOR_LAPIC_AFFINITY) {
+            struct acpi_srat_lapic_affinity *ent = (struct acpi_srat_lapic_affinity *)hdr;
+            if (ent->flags & SRAT_AFFINITY_FLAG_ENABLED) {
+                uint32_t domain = ent->proximity_domain_lo
+                    | ((uint32_t)ent->proximity_domain_hi[0] << 8)
+                    | ((uint32_t)ent->proximity_domain_hi[1] << 16)
+                    | ((uint32_t)ent->proximity_domain_hi[2] << 24);
+                _add_cpu(ent->apic_id, domain);
+            }
+        }
+        else if (hdr->type == SRAT_ENTRY_PROCESSOR_X2APIC_AFFINITY) {
+            struct acpi_srat_x2apic_affinity *ent = (struct acpi_srat_x2apic_affinity *)hdr;
+            if (ent->flags & SRAT_AFFINITY_FLAG_ENABLED)
+                _add_cpu(ent->x2apic_id, ent->proximity_domain);
+        }
+        else if (hdr->type == SRAT_ENTRY_MEMORY_AFFINITY) {
+            struct acpi_srat_memory_affinity *ent = (struct acpi_srat_memory_affinity *)hdr;
+            if ((ent->flags & SRAT_AFFINITY_FLAG_ENABLED) && ent->length) {
+                if (numa_range_count == NUMA_MAX_MEM_RANGES) {
+                    kprintf("  - numa: too many memory ranges in srat, ignoring 0x%p\n", ent->base);
+                } else {
+                    struct numa_mem_range *r = &numa_ranges[numa_range_count++];
+                    // the allocator works with whole pages
+                    r->start = ALIGN_DOWN(ent->base, PAGE_SIZE);
+                    r->end = ALIGN_UP(ent->base + ent->length, PAGE_SIZE);
+                    r->node = _domain2node(ent->proximity_domain);
+                }
+            }
+        }
+
+        // broken table
+        if (!hdr->length) break;
+        off += hdr->length;
+    }
+}
+
+static void parse_slit(struct acpi_slit *slit)
+{
+    for (size_t i = 0; i < numa_node_count; i++) {
+        for (size_t j = 0; j < numa_node_count; j++) {
+            uint32_t from = numa_nodes[i].proximity_domain, to = numa_nodes[j].proximity_domain;
+
+            // the slit is indexed by proximity domain
+            if (from >= slit->locality_count || to >= slit->locality_count)
+                continue;
+
+            numa_nodes[i].distance[j] = slit->entries[from * slit->locality_count + to];
+        }
+    }
+}
+
+// order every nodes fallback list by distance (insertion sort, ties by node id)
+static void build_fallback_lists(void)
+{
+    for (size_t n = 0; n < numa_node_count; n++) {
+        struct numa_node *node = &numa_nodes[n];
+
+        for (size_t i = 0; i < numa_node_count; i++) {
+            size_t j = i;
+            while (j && node->distance[node->fallback[j - 1]] > node->distance[i]) {
+                node->fallback[j] = node->fallback[j - 1];
+                j--;
+            }
+            node->fallback[j] = i;
+        }
+    }
+}
+
+void numa_init(void)
+{
+    acpi_early_init();
+
+    struct acpi_srat *srat = get_sdt("SRAT");
+
+    numa_node_count = 0;
+    if (srat)
+        parse_srat(srat);
+
+    // no srat, or an srat without usable entries: uma system
+    if (!numa_node_count) {
+        numa_node_count = 1;
+        numa_nodes[0].proximity_domain = 0;
+        numa_range_count = 0;
+        numa_cpu_count = 0;
+    }
+
+    for (size_t i = 0; i < numa_node_count; i++) {
+        for (size_t j = 0; j < numa_node_count; j++) {
+            numa_nodes[i].distance[j] = (i == j) ? NUMA_DISTANCE_LOCAL : NUMA_DISTANCE_REMOTE;
+        }
+    }
+
+    struct acpi_slit *slit = get_sdt("SLIT");
+    if (slit && numa_node_count > 1)
+        parse_slit(slit);
+
+    build_fallback_lists();
+
+    kprintf_verbose("  - numa: %lu node(s), %lu memory range(s), %lu cpu(s) in srat\n",
+        numa_node_count, numa_range_count, numa_cpu_count);
+    for (size_t i = 0; i < numa_range_count; i++) {
+        kprintf_verbose("  - numa: node %lu: 0x%p - 0x%p\n",
+            numa_ranges[i].node, numa_ranges[i].start, numa_ranges[i].end);
+    }
+}
+
+size_t numa_node_of_phys(uintptr_t phys)
+{
+    for (size_t i = 0; i < numa_range_count; i++) {
+        if (phys >= numa_ranges[i].start && phys < numa_ranges[i].end)
+            return numa_ranges[i].node;
+    }
+
+    return 0;
+}
+
+uintptr_t numa_range_end(uintptr_t phys)
+{
+    uintptr_t next = UINTPTR_MAX;
+
+    for (size_t i = 0; i < numa_range_count; i++) {
+        if (phys >= numa_ranges[i].start && phys < numa_ranges[i].end)
+            return numa_ranges[i].end;
+        if (numa_ranges[i].start > phys)
+            next = MIN(next, numa_ranges[i].start);
+    }
+
+    return next;
+}
+
+size_t numa_node_of_lapic(uint32_t lapic_id)
+{
+    for (size_t i = 0; i < numa_cpu_count; i++) {
+        if (numa_cpus[i].apic_id == lapic_id)
+            return numa_cpus[i].node;
+    }
+
+    return 0;
+}
+
+size_t numa_this_node(void)
+{
+    if (!smp_initialized)
+        return 0;
+
+    int_status_t old = preempt_fetch_disable();
+    size_t node = get_this_cpu()->numa_node;
+    preempt_restore(old);
+
+    return node;
+}
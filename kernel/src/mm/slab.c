@@ -8,47 +8,108 @@
 #include "memory.h"
 #include "compiler.h"
 #include "locking.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "kfence.h"
 
 // Basic slab allocator. Allocations on pow2 sized blocks are guaranteed to be aligned,
 // if allocated via the generic cache pools. When the sanitizer is enabled,
 // the blocks alignment changes to 64 bytes.
 // A driver can create its own pools for objects with specific sizes,
-// and then specifically allocate from them (similar to linux kmem_cache).
+// and then specifically allocate from them (similar to linux kmem_cache, see
+// kmem_cache_create()). Those objects aren't rounded up to pow2, and may have
+// a constructor that runs once per object when its slab gets created.
+// Once smp is up, every cache gets per-cpu magazines in front of the slabs
+// (see MAGAZINES), so most allocations and frees never touch the cache lock.
+// Completely free slabs are kept up to a per-cache limit, a reaper thread gives back
+// those that weren't needed for a whole SLAB_REAP_INTERVAL_MS.
+// Slabs are coloured: the first object of each new slab is shifted by a rotating
+// offset taken from the slack at the slab end, so equally indexed objects of
+// different slabs don't all map to the same cpu cache sets.
 // Sanity checks and the following sanitizers are (kinda) implemented:
 //   - buffer over-/underflow
 //   - primitive double free protection
 // missing:
 //   - use after free
 
-// slab layout?
+// slab layout:
+//   [colour][obj 0][obj 1]...[obj n-1][slack][bufctl[n] (CONFIG_SLAB_BUFCTL caches only)]
+// objects are obj_md_size apart. free objects are either linked through a pointer
+// inside them (at free_offset), or, for bufctl caches, kept as a stack of u16 object
+// indices at the slab end, so allocating and freeing never writes to the objects
 
 struct slab_cache;
 
-// reuse struct page for slab object data (40 bytes) (sync this up!)
+// reuse struct page for slab object data (32 bytes) (sync this up!)
 struct slab {
-    int32_t flags;
-    struct slab *next;                  // dll of slabs in a cache
-    struct slab *prev;
+    uint16_t flags;
+    uint8_t order;                      // struct page header, don't touch
+    uint8_t node;
+    uint16_t section;
+    uint16_t color;                     // offset of the first object into the slab
+    uint32_t next;                      // dll of slabs in a cache (pfns)
+    uint32_t prev;
     struct slab_cache *this_cache;      // reference
-    void *freelist;    // linked list of free slab objects. link when free'd,
-                        // unlink when allocated. exceptions: full, empty
+    uint32_t freelist;  // offset of the first object in the linked list of free slab objects.
+                        // link when free'd, unlink when allocated. exceptions: full, empty.
+                        // unused for bufctl caches
     uint16_t used_objs;
     uint16_t total_objs;
 };
 
+// freelist offset of a slab without free objects
+#define SLAB_FREELIST_END (UINT32_MAX)
+
+// a stack of free objects, owned by a cpu or sitting in a caches depot
+struct slab_magazine {
+    struct slab_magazine *next;         // depot list
+    size_t rounds;                      // objects in objs[]
+    void *objs[SLAB_MAGAZINE_SIZE];
+};
+
+// per-cpu magazine pair of a cache. allocations pop from loaded, frees push to it,
+// previous gets swapped in when loaded runs empty / full
+struct slab_cpu_cache {
+    struct slab_magazine *loaded;
+    struct slab_magazine *previous;
+} __attribute__((aligned(64)));
+
+// slab_cache flags
+#define SLAB_CACHE_GENERIC (1 << 0)     // one of the kmalloc caches, can't be destroyed
+#define SLAB_CACHE_BUFCTL (1 << 1)      // free objects are tracked in an index array
+
 struct slab_cache {
     char *name;
-    uint16_t unused;                    // for alignment
+    uint16_t flags;
     uint16_t pages_per_slab;
     uint16_t obj_size;                  // raw size of object
-    uint16_t obj_md_size;               // size of object + metadata
+    uint16_t obj_md_size;               // size of object + metadata (stride in the slab)
+    uint16_t free_offset;               // where the freelist pointer lives in a free object
+    uint16_t objs_per_slab;
+    uint16_t color_range;               // max colour offset (the slack of a slab)
+    uint16_t color_step;                // colour granularity, keeps objects aligned
+    uint16_t color_next;                // colour of the next new slab
+    uint32_t obj_reciprocal;            // ceil(2^32 / obj_md_size), for offset -> index
+    void (*ctor)(void *obj);            // NULL or called on every new object
+    struct slab_cache *next_cache;      // slab_caches list
     size_t total_objs;
     size_t total_objs_allocated;
     size_t full_slab_count, partial_slab_count, empty_slab_count;
+    size_t free_slab_limit;             // full slabs kept when objects get freed
+    size_t full_slab_min;               // lowest full_slab_count since the last reap
+    // pages given back by the free slab limit, the reaper and the shrinker
+    size_t limit_pages, reaped_pages, shrunk_pages;
     struct slab *full_slabs;            // dll for full slabs (newly allocated or all freed)
     struct slab *partial_slabs;         // partially full slabs (preffered one to alloc from)
     struct slab *empty_slabs;           // completely empty slabs (need to be free)
     k_spinlock_t lock;
+
+    // magazine layer, cpu_caches is NULL until slab_smp_init()
+    struct slab_cpu_cache *cpu_caches;  // one per cpu, indexed like global_cpus
+    struct slab_magazine *depot_full;
+    struct slab_magazine *depot_empty;
+    size_t depot_full_count, depot_empty_count;
+    k_spinlock_t depot_lock;
 };
 
 size_t slab_initialized;
@@ -58,6 +119,19 @@ size_t kmalloc_pps_mappings[KMALLOC_ALLOC_SIZES] = {
        1,  1,  1,  1,   2,   4,   8,    8,    16,   16
 };
 
+// every cache, generic and kmem_cache_create()'d ones
+static struct slab_cache *slab_caches;
+static k_spinlock_t slab_caches_lock;
+
+static struct shrinker slab_shrinker;
+
+// magazines are allocated from the generic cache that fits them
+static struct slab_cache *magazine_cache;
+_Static_assert(sizeof(struct slab_magazine) <= 256, "magazines should fit into 256 bytes");
+
+static void _cache_free_locked(struct slab_cache *c, struct slab *s, void *addr);
+static struct slab *_find_corresponding_slab(void *addr);
+
 // phys starting address of this slab
 static inline void *slab2addr(struct slab *slab)
 {
@@ -67,6 +141,98 @@ static inline void *slab2addr(struct slab *slab)
     return (void *)(page2idx(pg) << PAGE_SHIFT);
 }
 
+// hhdm address of the first object of this slab
+static inline uint8_t *slab_data(struct slab *slab)
+{
+    return (uint8_t *)((uintptr_t)slab2addr(slab) + (uintptr_t)hhdm->offset);
+}
+
+static inline uint32_t slab2link(struct slab *slab)
+{
+    return page2link((struct page *)slab);
+}
+
+static inline struct slab *link2slab(uint32_t link)
+{
+    return (struct slab *)link2page(link);
+}
+
+// first free object, NULL if the slab is fully allocated
+static inline void *_freelist_head(struct slab *slab)
+{
+    return (slab->freelist == SLAB_FREELIST_END) ? NULL : slab_data(slab) + slab->freelist;
+}
+
+static inline void _freelist_set(struct slab *slab, void *obj)
+{
+    slab->freelist = obj ? (uint32_t)((uint8_t *)obj - slab_data(slab)) : SLAB_FREELIST_END;
+}
+
+// first object of a slab, behind its colour
+static inline uint8_t *slab_objs(struct slab *slab)
+{
+    return slab_data(slab) + slab->color;
+}
+
+// index array of a bufctl slab. bufctl[used_objs..total_objs) are the free objects
+static inline uint16_t *_slab_bufctl(struct slab_cache *c, struct slab *slab)
+{
+    return (uint16_t *)(slab_data(slab) + c->pages_per_slab * PAGE_SIZE) - slab->total_objs;
+}
+
+static inline uint16_t _obj2idx(struct slab_cache *c, struct slab *slab, void *obj)
+{
+    // exact, since offsets are multiples of obj_md_size and below 2^16
+    uint64_t off = (uint8_t *)obj - slab_objs(slab);
+    return (uint16_t)((off * c->obj_reciprocal) >> 32);
+}
+
+// the freelist link of a free object. caches with a constructor keep it behind the
+// object, so a free object stays constructed
+static inline void *_obj_next(struct slab_cache *c, void *obj)
+{
+    return *(void **)((uint8_t *)obj + c->free_offset);
+}
+
+static inline void _obj_set_next(struct slab_cache *c, void *obj, void *next)
+{
+    *(void **)((uint8_t *)obj + c->free_offset) = next;
+}
+
+// take a free object off a slab, that isn't fully allocated. call with c->lock being held
+static inline void *_slab_pop(struct slab_cache *c, struct slab *s)
+{
+    void *obj;
+
+    if (c->flags & SLAB_CACHE_BUFCTL) {
+        obj = slab_objs(s) + (size_t)_slab_bufctl(c, s)[s->used_objs] * c->obj_md_size;
+    } else {
+        obj = _freelist_head(s);
+        if (!obj) {
+            kpanic(0, NULL, "slab freelist is empty, but total=%hu, used=%hu, size=%hu\n",
+                s->total_objs, s->used_objs, c->obj_size);
+        }
+        // advance freelist
+        _freelist_set(s, _obj_next(c, obj));
+    }
+
+    s->used_objs++;
+    return obj;
+}
+
+// put obj back into its slab. call with c->lock being held
+static inline void _slab_push(struct slab_cache *c, struct slab *s, void *obj)
+{
+    s->used_objs--;
+
+    if (c->flags & SLAB_CACHE_BUFCTL) {
+        _slab_bufctl(c, s)[s->used_objs] = _obj2idx(c, s, obj);
+    } else {
+        _obj_set_next(c, obj, _freelist_head(s));
+        _freelist_set(s, obj);
+    }
+}
+
 static inline size_t _size2block(size_t size)
 {
     if (size == 0)
@@ -85,10 +251,10 @@ static inline size_t _size2block(size_t size)
 
 // stack insertion of new into dll at head
 static inline void _list_link(struct slab *new, struct slab **head) {
-    new->prev = NULL;
-    new->next = *head;
+    new->prev = PAGE_LINK_NONE;
+    new->next = slab2link(*head);
     if (*head)
-        (*head)->prev = new;
+        (*head)->prev = slab2link(new);
     *head = new;
 }
 
@@ -97,15 +263,15 @@ static inline void _list_unlink(struct slab *entry, struct slab **head) {
     if (!*head) kpanic(0, NULL, "head == 0");
 
     if (*head == entry)
-        *head = entry->next;
+        *head = link2slab(entry->next);
 
-    if (entry->prev)
-        entry->prev->next = entry->next;
-    if (entry->next)
-        entry->next->prev = entry->prev;
+    if (entry->prev != PAGE_LINK_NONE)
+        link2slab(entry->prev)->next = entry->next;
+    if (entry->next != PAGE_LINK_NONE)
+        link2slab(entry->next)->prev = entry->prev;
 
-    entry->prev = (struct slab *)0xDEADBEEF;
-    entry->next = (struct slab *)0xDEADBEEF;
+    entry->prev = PAGE_LINK_POISON;
+    entry->next = PAGE_LINK_POISON;
 }
 
 // marks all pages except for head of a composite page
@@ -121,14 +287,14 @@ static inline void _mark_composite_page(struct page *head, size_t num_pgs)
     size_t i = page2idx(head);
     num_pgs--;
     for (struct page *pg = NULL; num_pgs; num_pgs--) {
-        pg = &pages[i + num_pgs];
+        pg = pfn2page(i + num_pgs);
 
         if (pg->flags & STRUCT_PAGE_FLAG_COMPOSITE_TAIL) {
             kpanic(0, NULL, "page was part of composite tail already\n");
         }
 
         pg->flags |= STRUCT_PAGE_FLAG_COMPOSITE_TAIL;
-        pg->comp_head = head;
+        pg->comp_head = i;
     }
 }
 
@@ -139,7 +305,7 @@ static inline void _unmark_composite_page(struct page *head, size_t num_pgs)
     size_t i = page2idx(head);
     num_pgs--;
     for (struct page *pg = NULL; num_pgs; num_pgs--) {
-        pg = &pages[i + num_pgs];
+        pg = pfn2page(i + num_pgs);
 
         if (!(pg->flags & STRUCT_PAGE_FLAG_COMPOSITE_TAIL)) {
             kpanic(0, NULL, "page wasn't part of composite tail\n");
@@ -149,86 +315,188 @@ static inline void _unmark_composite_page(struct page *head, size_t num_pgs)
     }
 }
 
-// initialize a single slab_cache
-static void init_slab_cache(struct slab_cache *c, size_t alloc_size, const char *name)
+// initialize a single slab_cache and link it into slab_caches.
+// generic caches (flags & SLAB_CACHE_GENERIC) are pow2 sized and aligned to their size,
+// every other cache packs its objects at align, and picks its own slab size
+static void init_slab_cache(struct slab_cache *c, const char *name, size_t size, size_t align,
+    void (*ctor)(void *), uint16_t flags)
 {
     if (c->name) kpanic(0, NULL, "slab_cache already initalized");
 
     c->empty_slabs = c->full_slabs = c->partial_slabs = NULL;
     c->lock.lock = 0;
+    c->depot_lock.lock = 0;
     c->name = (char *)name;
-    
-    // not pow2 or not in range abort
-    if (alloc_size & (alloc_size - 1) || alloc_size < KMALLOC_ALLOC_MIN || alloc_size > KMALLOC_ALLOC_MAX)
-        kpanic(0, NULL, "not pow2");
-
-    c->obj_size = alloc_size;
+    c->flags = flags;
+    c->ctor = ctor;
 
     c->total_objs = 0;
     c->total_objs_allocated = 0;
     c->full_slab_count = c->partial_slab_count = c->empty_slab_count = 0;
 
-    // account for kasan metadata
+    if (flags & SLAB_CACHE_GENERIC) {
+        // not pow2 or not in range abort
+        if (size & (size - 1) || size < KMALLOC_ALLOC_MIN || size > KMALLOC_ALLOC_MAX)
+            kpanic(0, NULL, "not pow2");
+
+        c->obj_size = size;
+        c->free_offset = 0;
+
+        // account for kasan metadata
 #ifdef CONFIG_SLAB_SANITIZE
-    c->obj_md_size = c->obj_size + KMALLOC_REDZONE_LEFT + KMALLOC_REDZONE_RIGHT;
+        c->obj_md_size = c->obj_size + KMALLOC_REDZONE_LEFT + KMALLOC_REDZONE_RIGHT;
 #else
-    c->obj_md_size = c->obj_size;
+        c->obj_md_size = c->obj_size;
 #endif
 
-    // min alloc size 16
-    c->pages_per_slab = kmalloc_pps_mappings[size2order(alloc_size >> 5)];
+        // min alloc size 16
+        c->pages_per_slab = kmalloc_pps_mappings[size2order(size >> 5)];
+        // kmalloc guarantees pow2 alignment
+        align = size;
+    } else {
+        // the freelist link needs at least a pointer
+        align = MAX(align, sizeof(void *));
+        if (!size || align & (align - 1))
+            kpanic(0, NULL, "slab: cache \"%s\" with size %lu, align %lu\n", name, size, align);
+
+        // constructed objects can't be overwritten by the freelist link
+        size_t stride = ALIGN_UP(size, sizeof(void *));
+        c->free_offset = ctor ? stride : 0;
+        stride = ALIGN_UP(stride + (ctor ? sizeof(void *) : 0), align);
+
+        if (stride > KMALLOC_MAX_CACHE_SIZE)
+            kpanic(0, NULL, "slab: cache \"%s\" objects too big (%lu)\n", name, stride);
+
+        c->obj_size = size;
+        c->obj_md_size = stride;
+
+        // smallest slab with at least 8 objects, that wastes at most 1/8th of itself
+        size_t pps = 1;
+        while (pps < 16 && ((pps * PAGE_SIZE) / stride < 8 || (pps * PAGE_SIZE) % stride > (pps * PAGE_SIZE) / 8))
+            pps <<= 1;
+        c->pages_per_slab = pps;
+    }
+
+    size_t slab_bytes = c->pages_per_slab * PAGE_SIZE, per_obj = c->obj_md_size;
+#ifdef CONFIG_SLAB_BUFCTL
+    // only where the array fits into the slack. the pow2 kmalloc caches have none,
+    // so they'd lose an object per slab to it
+    if (c->obj_md_size >= SLAB_BUFCTL_MIN_SIZE
+        && slab_bytes / (per_obj + sizeof(uint16_t)) == slab_bytes / per_obj) {
+        c->flags |= SLAB_CACHE_BUFCTL;
+        per_obj += sizeof(uint16_t);
+    }
+#endif
+
+    c->objs_per_slab = slab_bytes / per_obj;
+    c->color_range = slab_bytes - c->objs_per_slab * per_obj;
+    c->color_step = MAX(align, SLAB_COLOR_ALIGN);
+    c->color_next = 0;
+
+    // enough free objects to refill two magazines
+    c->free_slab_limit = MAX(1, DIV_ROUNDUP(2 * SLAB_MAGAZINE_SIZE, c->objs_per_slab));
+    c->full_slab_min = 0;
+    c->limit_pages = c->reaped_pages = c->shrunk_pages = 0;
+
+    c->obj_reciprocal = (uint32_t)(((1ull << 32) + c->obj_md_size - 1) / c->obj_md_size);
+}
+
+// link c into slab_caches. call with slab_caches_lock being held
+static void _link_cache_locked(struct slab_cache *c)
+{
+    c->next_cache = slab_caches;
+    slab_caches = c;
+}
+
+// give c per-cpu magazines. false if they couldn't be allocated
+static bool _enable_magazines(struct slab_cache *c)
+{
+    struct slab_cpu_cache *cpu_caches = kcalloc(smp_cpu_count, sizeof(struct slab_cpu_cache));
+    if (!cpu_caches)
+        return false;
+
+    // the other cpus may be allocating already
+    __atomic_store_n(&c->cpu_caches, cpu_caches, __ATOMIC_RELEASE);
+    return true;
 }
 
 void slab_init()
 {
     kprintf_verbose("%s preparing kernel heap...\n", ansi_progress_string);
 
-    for (int i = 0; i < KMALLOC_ALLOC_SIZES; i++) {
-        init_slab_cache(&kmalloc_generic_caches[i], 1 << (i + 4), "some cache");
+    for (int i = KMALLOC_ALLOC_SIZES - 1; i >= 0; i--) {
+        struct slab_cache *c = &kmalloc_generic_caches[i];
+        init_slab_cache(c, "some cache", 1 << (i + 4), 1 << (i + 4), NULL, SLAB_CACHE_GENERIC);
+        _link_cache_locked(c);
     }
 
     for (int i = 0; i < KMALLOC_ALLOC_SIZES; i++) {
         kprintf_verbose("  - slab: slab_cache %d \"%s\" (size %hu) initialized\n", i, kmalloc_generic_caches[i].name, kmalloc_generic_caches[i].obj_size);
     }
 
+    shrinker_register(&slab_shrinker);
+
     slab_initialized = 1;
     kprintf("%s slab allocator initialized\n", ansi_okay_string);
 }
 
-// allocate a new slab from the buddy allocator for a given slab_cache.
-// slab will contain AT LEAST min_objects total objects.
-// the more objects per slab, the more potential memory waste
+void slab_smp_init(void)
+{
+    spin_lock_global(&slab_caches_lock);
+
+    magazine_cache = &kmalloc_generic_caches[_size2block(sizeof(struct slab_magazine))];
+
+    for (struct slab_cache *c = slab_caches; c; c = c->next_cache) {
+        if (!_enable_magazines(c))
+            kpanic(0, NULL, "slab: couldn't allocate per-cpu caches\n");
+    }
+
+    spin_unlock_global(&slab_caches_lock);
+
+    kprintf_verbose("  - slab: per-cpu magazines for %lu cpus enabled\n", smp_cpu_count);
+}
+
+// turn the c->pages_per_slab pages at new_slab (from the buddy allocator) into a full
+// slab of c. the more objects per slab, the more potential memory waste
 // the less objects per slab, the more buddy allocations
 //
 // call with c->lock being held
-static void new_slab(struct slab_cache *c, size_t page_count)
+static void new_slab(struct slab_cache *c, struct slab *new_slab)
 {
-    const size_t alloc_order = size2order(page_count);
+    const size_t alloc_order = size2order(c->pages_per_slab);
 
-    // rounds up
-    struct slab *new_slab = (struct slab *)page_alloc(alloc_order);
-
-    new_slab->this_cache = c;
-    new_slab->total_objs = (order2size(alloc_order) * PAGE_SIZE) / c->obj_md_size;
-    if (new_slab->total_objs != (c->pages_per_slab * PAGE_SIZE) / c->obj_md_size) {
+    if (order2size(alloc_order) != c->pages_per_slab) {
         kpanic(0, NULL, "check failed\n");
     }
+    new_slab->this_cache = c;
+    new_slab->total_objs = c->objs_per_slab;
     new_slab->used_objs = 0;
 
+    // rotate through the colours
+    new_slab->color = c->color_next;
+    c->color_next += c->color_step;
+    if (c->color_next > c->color_range)
+        c->color_next = 0;
+
     // generate freelist
-    // for each object, put a pointer to the next free object
-    uint8_t *slab_data = (uint8_t *)((uintptr_t)slab2addr(new_slab) + (uintptr_t)hhdm->offset);
+    // for each object, put a pointer to the next free object (or its index)
+    uint8_t *data = slab_objs(new_slab);
+    uint16_t *bufctl = _slab_bufctl(c, new_slab);
 
-    for (int i = 0; i < new_slab->total_objs - 1; i++) {
-        void *next = slab_data + (i + 1) * c->obj_md_size;
+    for (int i = 0; i < new_slab->total_objs; i++) {
+        void *obj = data + i * c->obj_md_size;
 
-        // next block pointer
-        *((uintptr_t *)(slab_data + i * c->obj_md_size)) = (uintptr_t)next;
+        if (c->ctor)
+            c->ctor(obj);
+
+        if (c->flags & SLAB_CACHE_BUFCTL)
+            bufctl[i] = i;
+        else
+            // next block pointer, last one NULL
+            _obj_set_next(c, obj, (i == new_slab->total_objs - 1) ? NULL : data + (i + 1) * c->obj_md_size);
     }
-    // last one NULL
-    *((uintptr_t *)(slab_data + (new_slab->total_objs - 1) * c->obj_md_size)) = (uintptr_t)NULL;
 
-    new_slab->freelist = (void *)slab_data;
+    _freelist_set(new_slab, (c->flags & SLAB_CACHE_BUFCTL) ? NULL : data);
 
     _list_link(new_slab, &c->full_slabs);
     c->full_slab_count++;
@@ -238,26 +506,133 @@ static void new_slab(struct slab_cache *c, size_t page_count)
     _mark_composite_page((struct page *)new_slab, order2size(alloc_order));
 }
 
+// give the first of the full slabs back to the buddy allocator, returns the freed pages.
+// call with c->lock being held
+static size_t _release_full_slab(struct slab_cache *c)
+{
+    struct slab *s = c->full_slabs;
+
+    _list_unlink(s, &c->full_slabs);
+    c->full_slab_count--;
+
+    c->total_objs -= s->total_objs;
+
+    _unmark_composite_page((struct page *)s, c->pages_per_slab);
+
+    page_free((struct page *)s, size2order(c->pages_per_slab));
+    return c->pages_per_slab;
+}
+
 // attempt to evict some full slabs from cache.
 // call with c->lock being held
 static void _attempt_free_full(struct slab_cache *c)
 {
-    // policy: keep slab order + 1 many slabs in cache
-    if (c->full_slab_count > _size2block(c->obj_md_size) + 1) {
-        // evict slab
-        struct slab *s = c->full_slabs;
+    // policy: keep free_slab_limit slabs in cache, the reaper trims the rest once idle
+    if (c->full_slab_count > c->free_slab_limit)
+        c->limit_pages += _release_full_slab(c);
+}
 
-        _list_unlink(s, &c->full_slabs);
-        c->full_slab_count--;
+// free slabs of all caches, that can go back to the buddy allocator.
+// slab_caches_lock is only tried, the shrinker may run from an allocation in here
+static size_t slab_shrink_count(struct shrinker *this)
+{
+    (void)this;
+
+    if (!spin_trylock(&slab_caches_lock))
+        return 0;
+
+    size_t pages = 0;
+    for (struct slab_cache *c = slab_caches; c; c = c->next_cache) {
+        pages += c->full_slab_count * c->pages_per_slab;
+        pages += (c->depot_full_count * SLAB_MAGAZINE_SIZE * c->obj_md_size) / PAGE_SIZE;
+    }
+
+    spin_unlock(&slab_caches_lock);
+    return pages;
+}
 
-        c->total_objs -= s->total_objs;
+// put the objects parked in the depot of c back into their slabs, so those can be freed.
+// the per-cpu magazines stay, they belong to their cpu. call with c->lock being held
+static void _depot_drain_locked(struct slab_cache *c)
+{
+    spin_lock(&c->depot_lock);
+    struct slab_magazine *full = c->depot_full, *empty = c->depot_empty;
+    c->depot_full = c->depot_empty = NULL;
+    c->depot_full_count = c->depot_empty_count = 0;
+    spin_unlock(&c->depot_lock);
+
+    while (full) {
+        struct slab_magazine *mag = full;
+        full = mag->next;
+
+        while (mag->rounds) {
+            void *obj = mag->objs[--mag->rounds];
+            _cache_free_locked(c, _find_corresponding_slab(obj), obj);
+        }
+
+        mag->next = empty;
+        empty = mag;
+    }
+
+    // magazines are objects of magazine_cache, which may be c itself
+    bool locked = (c == magazine_cache) || spin_trylock(&magazine_cache->lock);
+    while (locked && empty) {
+        struct slab_magazine *mag = empty;
+        empty = mag->next;
+        _cache_free_locked(magazine_cache, _find_corresponding_slab(mag), mag);
+    }
+    if (locked && c != magazine_cache)
+        spin_unlock(&magazine_cache->lock);
+
+    // couldn't free them right now, keep them around
+    spin_lock(&c->depot_lock);
+    while (empty) {
+        struct slab_magazine *mag = empty;
+        empty = mag->next;
+        mag->next = c->depot_empty;
+        c->depot_empty = mag;
+        c->depot_empty_count++;
+    }
+    spin_unlock(&c->depot_lock);
+}
+
+// give back free slabs until nr pages are freed. caches that are locked right now
+// may be allocating (and reclaiming), so they get skipped
+static size_t slab_shrink_scan(struct shrinker *this, size_t nr)
+{
+    (void)this;
+
+    if (!spin_trylock(&slab_caches_lock))
+        return 0;
+
+    size_t freed = 0;
+    for (struct slab_cache *c = slab_caches; c && freed < nr; c = c->next_cache) {
+        if (!spin_trylock(&c->lock))
+            continue;
 
-        _unmark_composite_page((struct page *)s, c->pages_per_slab);
+        if (magazine_cache)
+            _depot_drain_locked(c);
+
+        while (c->full_slabs && freed < nr) {
+            size_t pages = _release_full_slab(c);
+            c->shrunk_pages += pages;
+            freed += pages;
+        }
+        c->full_slab_min = MIN(c->full_slab_min, c->full_slab_count);
 
-        page_free((struct page *)s, size2order(c->pages_per_slab));
+        spin_unlock(&c->lock);
     }
+
+    spin_unlock(&slab_caches_lock);
+    return freed;
 }
 
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrink_count,
+    .scan = slab_shrink_scan
+};
+
 static void *cache_alloc(struct slab_cache *c)
 {
     // lock everything for now
@@ -270,23 +645,14 @@ static void *cache_alloc(struct slab_cache *c)
 
     struct slab *part = c->partial_slabs;
     if (part) {
-        if (!part->freelist) {
-            kpanic(0, NULL, "partial->freelist is empty, but total=%hu, used=%hu, size=%lu\n",
-                part->total_objs, part->used_objs, c->obj_size);
-        }
-
         // alloc from partial
-        void *ret = part->freelist;
-
-        // advance freelist
-        part->freelist = (void *)*((uintptr_t *)part->freelist);
+        void *ret = _slab_pop(c, part);
         part->this_cache->total_objs_allocated++;
-        part->used_objs++;
 
         if (part->used_objs == part->total_objs) {
             // if emptied
-            if (part->freelist) {
-                kpanic(0, NULL, "part->freelist has items, but total-used=%hu, size=%lu\n",
+            if (part->freelist != SLAB_FREELIST_END) {
+                kpanic(0, NULL, "part->freelist has items, but total-used=%hu, size=%hu\n",
                     part->total_objs - part->used_objs, c->obj_size);
             }
 
@@ -308,15 +674,11 @@ got_full:
 
         _list_unlink(full, &c->full_slabs);
         c->full_slab_count--;
+        c->full_slab_min = MIN(c->full_slab_min, c->full_slab_count);
         _list_link(full, &c->partial_slabs);
         c->partial_slab_count++;
 
-        void *ret = full->freelist;
-
-        // advance freelist
-        full->freelist = (void *)*((uintptr_t *)full->freelist);
-
-        full->used_objs++;
+        void *ret = _slab_pop(c, full);
         full->this_cache->total_objs_allocated++;
 
         spin_unlock_global(&c->lock);
@@ -324,9 +686,19 @@ got_full:
         return ret;
     }
 
-    // we don't have any full slabs
-    new_slab(c, c->pages_per_slab);
-    goto got_full;
+    // we don't have any full slabs. reclaim may free objects of c (shrinkers kfree()),
+    // so the lock isn't held while allocating the pages
+    spin_unlock_global(&c->lock);
+    struct slab *pages = (struct slab *)page_alloc(size2order(c->pages_per_slab));
+    spin_lock_global(&c->lock);
+    if (pages) {
+        new_slab(c, pages);
+        goto got_full;
+    }
+
+    spin_unlock_global(&c->lock);
+    preempt_restore(old);
+    return NULL;
 
     unreachable();
 }
@@ -340,7 +712,7 @@ static struct slab *_find_corresponding_slab(void *addr)
     if (this->flags & STRUCT_PAGE_FLAG_SLAB_COMPOSITE_HEAD) {
         return (struct slab *)this;
     } else if (this->flags & STRUCT_PAGE_FLAG_COMPOSITE_TAIL) {
-        return (struct slab *)this->comp_head;
+        return (struct slab *)pfn2page(this->comp_head);
     } else {
         slab_dbg_print();
         kpanic(0, NULL, "Invalid slab flags for %p <size=%lu>\n",
@@ -349,6 +721,295 @@ static struct slab *_find_corresponding_slab(void *addr)
     }
 }
 
+static void cache_free(struct slab *s, void *addr)
+{
+    int_status_t old = preempt_fetch_disable();
+    spin_lock_global(&s->this_cache->lock);
+    _cache_free_locked(s->this_cache, s, addr);
+    spin_unlock_global(&s->this_cache->lock);
+    preempt_restore(old);
+}
+
+// ============================================================================
+// REAPER
+// ============================================================================
+
+static size_t slab_reap_passes;
+
+// give back the full slabs of every cache, that stayed unused since the last pass:
+// full_slab_count never dropped below full_slab_min, so that many slabs were idle
+static void slab_reap(void)
+{
+    size_t freed = 0;
+
+    spin_lock_global(&slab_caches_lock);
+    for (struct slab_cache *c = slab_caches; c; c = c->next_cache) {
+        spin_lock(&c->lock);
+
+        for (size_t idle = MIN(c->full_slab_min, c->full_slab_count); idle; idle--) {
+            size_t pages = _release_full_slab(c);
+            c->reaped_pages += pages;
+            freed += pages;
+        }
+        c->full_slab_min = c->full_slab_count;
+
+        spin_unlock(&c->lock);
+    }
+    spin_unlock_global(&slab_caches_lock);
+
+    slab_reap_passes++;
+    if (freed)
+        kprintf_verbose("  - slab: reaped %lu idle pages (pass %lu)\n", freed, slab_reap_passes);
+}
+
+static void slab_reaper_thread(void *arg)
+{
+    (void)arg;
+
+    preempt_enable();
+
+    for (;;) {
+        scheduler_sleep_for(SLAB_REAP_INTERVAL_MS);
+        slab_reap();
+    }
+
+    unreachable();
+}
+
+void slab_reaper_init(void)
+{
+    scheduler_new_kernel_thread(slab_reaper_thread, NULL, TASK_PRIORITY_LOW);
+}
+
+// ============================================================================
+// MAGAZINES
+// ============================================================================
+
+// Bonwick style magazine layer: every cpu holds two magazines per cache. Allocations
+// and frees only touch those, with interrupts disabled and without any lock. When both
+// are empty (or full), a whole magazine gets traded with the depot of the cache under
+// depot_lock. Only if the depot can't help either, the slab layer gets involved.
+// Objects in magazines still count as allocated for their slabs.
+// Magazines come straight from the slab layer of magazine_cache, never from magazines.
+
+static inline struct slab_cpu_cache *_this_cpu_cache(struct slab_cache *c)
+{
+    return &c->cpu_caches[get_this_cpu() - global_cpus];
+}
+
+static inline void _swap_magazines(struct slab_cpu_cache *cc)
+{
+    struct slab_magazine *tmp = cc->loaded;
+    cc->loaded = cc->previous;
+    cc->previous = tmp;
+}
+
+// NULL if neither the magazines nor the depot have an object left
+static void *magazine_alloc(struct slab_cache *c)
+{
+    if (!__atomic_load_n(&c->cpu_caches, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    int_status_t old = preempt_fetch_disable();
+    struct slab_cpu_cache *cc = _this_cpu_cache(c);
+    struct slab_magazine *spare = NULL;
+
+    if (!cc->loaded || !cc->loaded->rounds) {
+        if (cc->previous && cc->previous->rounds) {
+            _swap_magazines(cc);
+        } else {
+            // trade the empty previous for a full one from the depot
+            spin_lock(&c->depot_lock);
+            struct slab_magazine *full = c->depot_full;
+            if (full) {
+                c->depot_full = full->next;
+                c->depot_full_count--;
+
+                if (cc->previous) {
+                    if (c->depot_empty_count < SLAB_DEPOT_EMPTY_MAX) {
+                        cc->previous->next = c->depot_empty;
+                        c->depot_empty = cc->previous;
+                        c->depot_empty_count++;
+                    } else {
+                        spare = cc->previous;
+                    }
+                }
+                cc->previous = cc->loaded;
+                cc->loaded = full;
+            }
+            spin_unlock(&c->depot_lock);
+        }
+    }
+
+    void *obj = NULL;
+    if (cc->loaded && cc->loaded->rounds)
+        obj = cc->loaded->objs[--cc->loaded->rounds];
+
+    if (spare)
+        cache_free(_find_corresponding_slab(spare), spare);
+
+    preempt_restore(old);
+    return obj;
+}
+
+// false if obj couldn't be put into a magazine, and has to go to its slab
+static bool magazine_free(struct slab_cache *c, void *obj)
+{
+    if (!__atomic_load_n(&c->cpu_caches, __ATOMIC_ACQUIRE))
+        return false;
+
+    int_status_t old = preempt_fetch_disable();
+    struct slab_cpu_cache *cc = _this_cpu_cache(c);
+
+    if (!cc->loaded || cc->loaded->rounds == SLAB_MAGAZINE_SIZE) {
+        if (cc->previous && cc->previous->rounds < SLAB_MAGAZINE_SIZE) {
+            _swap_magazines(cc);
+        } else {
+            // trade the full previous for an empty one from the depot, or a new one
+            spin_lock(&c->depot_lock);
+            struct slab_magazine *empty = c->depot_empty;
+            if (empty) {
+                c->depot_empty = empty->next;
+                c->depot_empty_count--;
+            }
+            spin_unlock(&c->depot_lock);
+
+            if (!empty && (empty = cache_alloc(magazine_cache)))
+                empty->rounds = 0;
+
+            if (empty) {
+                if (cc->previous) {
+                    spin_lock(&c->depot_lock);
+                    cc->previous->next = c->depot_full;
+                    c->depot_full = cc->previous;
+                    c->depot_full_count++;
+                    spin_unlock(&c->depot_lock);
+                }
+                cc->previous = cc->loaded;
+                cc->loaded = empty;
+            }
+        }
+    }
+
+    bool stored = cc->loaded && cc->loaded->rounds < SLAB_MAGAZINE_SIZE;
+    if (stored)
+        cc->loaded->objs[cc->loaded->rounds++] = obj;
+
+    preempt_restore(old);
+    return stored;
+}
+
+// ============================================================================
+// KMEM CACHES
+// ============================================================================
+
+struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *))
+{
+    if (!slab_initialized)
+        kpanic(0, NULL, "slab isn't initialized");
+
+    struct slab_cache *c = kcalloc(1, sizeof(struct slab_cache));
+    if (!c)
+        return NULL;
+
+    init_slab_cache(c, name, size, align, ctor, 0);
+
+    spin_lock_global(&slab_caches_lock);
+    _link_cache_locked(c);
+    // caches created before smp get their magazines in slab_smp_init().
+    // without magazines the cache still works, just always through c->lock
+    if (magazine_cache && !_enable_magazines(c))
+        kprintf("  - slab: no per-cpu magazines for cache \"%s\"\n", name);
+    spin_unlock_global(&slab_caches_lock);
+
+    kprintf_verbose("  - slab: cache \"%s\" created (size %lu, stride %hu, %hu pages per slab)\n",
+        name, size, c->obj_md_size, c->pages_per_slab);
+    return c;
+}
+
+void *kmem_cache_alloc(struct slab_cache *c)
+{
+    void *ret = magazine_alloc(c);
+    if (!ret)
+        ret = cache_alloc(c);
+    return ret;
+}
+
+void kmem_cache_free(struct slab_cache *c, void *obj)
+{
+    if (!obj) return;
+
+    struct slab *s = _find_corresponding_slab(obj);
+    if (s->this_cache != c)
+        kpanic(0, NULL, "slab: %p freed to cache \"%s\", but belongs to \"%s\"\n",
+            obj, c->name, s->this_cache->name);
+
+    if (!magazine_free(c, obj))
+        cache_free(s, obj);
+}
+
+// every object has to be freed already, and nobody may use c anymore
+void kmem_cache_destroy(struct slab_cache *c)
+{
+    if (!c) return;
+
+    if (c->flags & SLAB_CACHE_GENERIC)
+        kpanic(0, NULL, "slab: tried to destroy generic cache \"%s\"\n", c->name);
+
+    spin_lock_global(&slab_caches_lock);
+    struct slab_cache **link = &slab_caches;
+    while (*link && *link != c)
+        link = &(*link)->next_cache;
+    if (!*link)
+        kpanic(0, NULL, "slab: cache \"%s\" isn't known\n", c->name);
+    *link = c->next_cache;
+    spin_unlock_global(&slab_caches_lock);
+
+    struct slab_cpu_cache *cpu_caches = __atomic_exchange_n(&c->cpu_caches, NULL, __ATOMIC_ACQ_REL);
+
+    int_status_t old = preempt_fetch_disable();
+    spin_lock_global(&c->lock);
+
+    // hand the magazines of every cpu to the depot, so they get drained with it
+    if (cpu_caches) {
+        spin_lock(&c->depot_lock);
+        for (size_t i = 0; i < smp_cpu_count; i++) {
+            struct slab_magazine *mags[2] = { cpu_caches[i].loaded, cpu_caches[i].previous };
+            for (int j = 0; j < 2; j++) {
+                if (!mags[j]) continue;
+                mags[j]->next = c->depot_full;
+                c->depot_full = mags[j];
+                c->depot_full_count++;
+            }
+        }
+        spin_unlock(&c->depot_lock);
+    }
+
+    if (magazine_cache)
+        _depot_drain_locked(c);
+
+    if (c->total_objs_allocated)
+        kpanic(0, NULL, "slab: destroying cache \"%s\" with %lu objects left\n",
+            c->name, c->total_objs_allocated);
+
+    while (c->full_slabs)
+        _release_full_slab(c);
+
+    spin_unlock_global(&c->lock);
+
+    // magazines the drain couldn't give back right away
+    while (c->depot_empty) {
+        struct slab_magazine *mag = c->depot_empty;
+        c->depot_empty = mag->next;
+        cache_free(_find_corresponding_slab(mag), mag);
+    }
+
+    preempt_restore(old);
+
+    kfree(cpu_caches);
+    kfree(c);
+}
+
 // allocate from the kmalloc_generic_caches. alloc sizes are rounded up to powers
 // of 2. pow2 allocations are aligned.
 // since I noticed that I have a tendency to use unitialized malloc'ed memory,
@@ -359,6 +1020,7 @@ void *kmalloc(size_t size)
     if (size > KMALLOC_MAX_CACHE_SIZE) {
         // check double free here too
         struct page *ret = page_alloc(psize2order(size));
+        if (!ret) return NULL;
         ret->flags |= STRUCT_PAGE_FLAG_KMALLOC_BUDDY;
         ret->order = psize2order(size);
         return (void *)(hhdm->offset + page2phys(ret));
@@ -372,14 +1034,26 @@ void *kmalloc(size_t size)
     if (!slab_initialized)
         kpanic(0, NULL, "slab isn't initialized");
 
+#ifdef CONFIG_KFENCE
+    if (kfence_should_sample()) {
+        void *obj = kfence_alloc(size, (uintptr_t)__builtin_return_address(0));
+        if (obj)
+            return obj;
+    }
+#endif
+
     size_t i = _size2block(size);
     if (i >= KMALLOC_ALLOC_SIZES) {
         kpanic(0, NULL, "kmalloc: tried to allocate %lu (max %d)\n", size, KMALLOC_MAX_CACHE_SIZE);
     }
     struct slab_cache *cache = &kmalloc_generic_caches[i];
 
-    // alloc from this cache
-    void *ret = cache_alloc(cache);
+    // alloc from this cache, the per-cpu magazines first
+    void *ret = magazine_alloc(cache);
+    if (!ret)
+        ret = cache_alloc(cache);
+    if (!ret)
+        return NULL;
 
 #ifdef CONFIG_SLAB_SANITIZE
     ret += KMALLOC_REDZONE_LEFT;
@@ -415,6 +1089,13 @@ void kfree(void *addr)
     // NULL ptr free is a noop
     if (!addr) return;
 
+#ifdef CONFIG_KFENCE
+    if (is_kfence_addr(addr)) {
+        kfence_free(addr, (uintptr_t)__builtin_return_address(0));
+        return;
+    }
+#endif
+
     struct page *pg = phys2page((uintptr_t)addr - hhdm->offset);
     if (pg->flags & STRUCT_PAGE_FLAG_KMALLOC_BUDDY) {
         pg->flags &= ~STRUCT_PAGE_FLAG_KMALLOC_BUDDY;
@@ -464,21 +1145,25 @@ void kfree(void *addr)
     }
 #endif
 
-    int_status_t old = preempt_fetch_disable();
-    spin_lock_global(&s->this_cache->lock);
+    if (!magazine_free(s->this_cache, addr))
+        cache_free(s, addr);
+}
 
-    // add object to slabs freelist
-    *(void **)addr = s->freelist;
-    s->freelist = addr;
+// give addr back to its slab. call with c->lock being held
+static void _cache_free_locked(struct slab_cache *c, struct slab *s, void *addr)
+{
+    // add object to slabs freelist first, s may be given back to the buddy allocator below
+    size_t used = s->used_objs;
+    _slab_push(c, s, addr);
+    c->total_objs_allocated--;
 
-    struct slab_cache *c = s->this_cache;
-    if (s->used_objs == s->total_objs) {
+    if (used == s->total_objs) {
         // if migration from empty to partial
         _list_unlink(s, &c->empty_slabs);
         c->empty_slab_count--;
         _list_link(s, &c->partial_slabs);
         c->partial_slab_count++;
-    } else if (s->used_objs == 1) {
+    } else if (used == 1) {
         // if migration from partial to full
         _list_unlink(s, &c->partial_slabs);
         c->partial_slab_count--;
@@ -487,33 +1172,77 @@ void kfree(void *addr)
 
         _attempt_free_full(c);
     } // else stay in partial
+}
 
-    s->used_objs--;
-    c->total_objs_allocated--;
-
-    spin_unlock_global(&s->this_cache->lock);
-    preempt_restore(old);
+// give the tail of a kmalloc buddy block back, until it is of order
+static void _kmalloc_buddy_shrink(struct page *pg, size_t order)
+{
+    while (pg->order > order) {
+        pg->order--;
+        page_free(pfn2page(page2idx(pg) + order2size(pg->order)), pg->order);
+    }
 }
 
+// resizes in place whenever possible: slab objects stay, as long as the new size
+// still belongs to their size class, buddy blocks shrink or grow into free buddies.
+// krealloc(addr, 0) frees addr
 void *krealloc(void *addr, size_t size)
 {
-    void *new = kmalloc(size);
-
     if (addr == NULL)
+        return kmalloc(size);
+
+    if (size == 0) {
+        kfree(addr);
+        return NULL;
+    }
+
+#ifdef CONFIG_KFENCE
+    // sampled objects always move back to the regular allocator
+    if (is_kfence_addr(addr)) {
+        void *new = kmalloc(size);
+        if (new) {
+            memcpy(new, addr, MIN(kfence_ksize(addr), size));
+            kfree(addr);
+        }
         return new;
+    }
+#endif
 
     size_t copy_size;
 
     struct page *pg = phys2page((uintptr_t)addr - hhdm->offset);
     if (pg->flags & STRUCT_PAGE_FLAG_KMALLOC_BUDDY) {
-        copy_size = MIN(pg->order, size);
+        if (size > KMALLOC_MAX_CACHE_SIZE) {
+            size_t order = psize2order(size);
+            if (order <= pg->order) {
+                _kmalloc_buddy_shrink(pg, order);
+                return addr;
+            }
+            if (page_grow(pg, pg->order, order)) {
+                pg->order = order;
+                return addr;
+            }
+        }
+
+        copy_size = MIN(order2size(pg->order) * PAGE_SIZE, size);
     } else {
         // can't do this if buddy page!!!
         // make sure not to copy oob of the old page
-        struct slab *s = _find_corresponding_slab(addr);
-        copy_size = MIN(s->this_cache->obj_size, size);
+        struct slab_cache *c = _find_corresponding_slab(addr)->this_cache;
+
+#ifndef CONFIG_SLAB_SANITIZE
+        // the redzones depend on the size, so the sanitizer always reallocates
+        if (size <= c->obj_size && (!(c->flags & SLAB_CACHE_GENERIC) || _size2block(size) == _size2block(c->obj_size)))
+            return addr;
+#endif
+
+        copy_size = MIN(c->obj_size, size);
     }
 
+    void *new = kmalloc(size);
+    if (!new)
+        return NULL;
+
     memcpy(new, addr, copy_size);
 
     kfree(addr);
@@ -524,6 +1253,8 @@ void *krealloc(void *addr, size_t size)
 void *kcalloc(size_t entries, size_t size)
 {
     void *ret = kmalloc(entries * size);
+    if (!ret)
+        return NULL;
     memset(ret, 0x00, entries * size);
     return ret;
 }
@@ -532,14 +1263,17 @@ k_spinlock_t templock;
 void slab_dbg_print(void)
 {
     spin_lock_global(&templock);
-    for (int i = 0; i < KMALLOC_ALLOC_SIZES; i++) {
-        struct slab_cache *c = &kmalloc_generic_caches[i];
+    spin_lock_global(&slab_caches_lock);
+    for (struct slab_cache *c = slab_caches; c; c = c->next_cache) {
         spin_lock_global(&c->lock);
 
         kprintf("%s, size=%d <obj_per_slab=%lu> <pages_per_slab=%lu>\n"
                "<total_objs=%lu> <total_objs_allocated=%lu> <full=%lu/partials=%lu/empty=%lu>\n",
-            c->name, c->obj_size, (c->pages_per_slab * PAGE_SIZE) / c->obj_md_size, c->pages_per_slab,
+            c->name, c->obj_size, c->objs_per_slab, c->pages_per_slab,
             c->total_objs, c->total_objs_allocated, c->full_slab_count, c->partial_slab_count, c->empty_slab_count);
+        kprintf("    depot: full magazines=%lu, empty magazines=%lu\n", c->depot_full_count, c->depot_empty_count);
+        kprintf("    free slab limit=%lu, pages freed: limit=%lu, reaped=%lu, shrunk=%lu\n",
+            c->free_slab_limit, c->limit_pages, c->reaped_pages, c->shrunk_pages);
 
         struct slab *curr = c->full_slabs;
         int j = 0;
@@ -547,7 +1281,7 @@ void slab_dbg_print(void)
         while (curr) {
             kprintf("        %d: total=%hu, used=%hu @ %p\n",
                 j, curr->total_objs, curr->used_objs, (uintptr_t)slab2addr(curr) + hhdm->offset);
-            curr = curr->next;
+            curr = link2slab(curr->next);
             j++;
         }
 
@@ -557,7 +1291,7 @@ void slab_dbg_print(void)
         while (curr) {
             kprintf("        %d: total=%hu, used=%hu @ %p\n",
                 j, curr->total_objs, curr->used_objs, (uintptr_t)slab2addr(curr) + hhdm->offset);
-            curr = curr->next;
+            curr = link2slab(curr->next);
             j++;
         }
 
@@ -567,11 +1301,12 @@ void slab_dbg_print(void)
         while (curr) {
             kprintf("        %d: total=%hu, used=%hu @ %p\n",
                 j, curr->total_objs, curr->used_objs, (uintptr_t)slab2addr(curr) + hhdm->offset);
-            curr = curr->next;
+            curr = link2slab(curr->next);
             j++;
         }
 
         spin_unlock_global(&c->lock);
     }
+    spin_unlock_global(&slab_caches_lock);
     spin_unlock_global(&templock);
 }
\ No newline at end of file
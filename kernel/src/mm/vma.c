@@ -0,0 +1,479 @@
+/*
+ * Demand paging. Every address space keeps its vm areas in a rbtree keyed by their
+ * start, nothing gets mapped when an area is created. The first access to a page faults,
+ * and vma_handle_fault() maps a zeroed frame, or the page cache frame of the backing file
+ * (vn_getpage()). Sparse areas only cost the pages that were actually touched.
+ * Private file areas map cache frames copy-on-write, shared ones map them writable, and
+ * the dirty bits of their ptes tell which pages have to be written back (vma_sync()).
+ * Files without a page cache get read into private copies.
+ * With CONFIG_THP, the first fault in a 2mib aligned range of an anonymous area that has
+ * no page table yet maps a zeroed huge page. Ranges populated 4kib wise get collapsed by
+ * a background thread, which write protects the page table, copies its pages into a huge
+ * page, and only swaps it in if nothing touched the table in the meantime.
+ * The fault path only holds pmc->vma_lock while mapping, file reads happen without it.
+ * Areas going away bump pmc->vma_seq, so a fault racing with an unmap drops its page
+ * instead of mapping it into a range that's gone.
+ * vma_fork() clones an address space copy-on-write: the areas are copied, the frames get
+ * shared read only, and the first write to one of them faults and breaks the sharing.
+*/
+
+#include "vma.h"
+#include "compiler.h"
+#include "cpu.h"
+#include "frame_alloc.h"
+#include "kheap.h"
+#include "kprintf.h"
+#include "macros.h"
+#include "memory.h"
+#include "process.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "vfs.h"
+
+// #PF error code bits
+#define PF_ERR_PRESENT (1 << 0)
+#define PF_ERR_WRITE (1 << 1)
+#define PF_ERR_USER (1 << 2)
+#define PF_ERR_FETCH (1 << 4)
+
+static struct slab_cache *vma_cache;
+
+void vma_init(void)
+{
+    vma_cache = kmem_cache_create("vma", sizeof(struct vma), 8, NULL);
+    if (!vma_cache)
+        kpanic(0, NULL, "couldn't create vma cache\n");
+}
+
+struct vma *vma_find(page_map_ctx_t *pmc, uintptr_t va)
+{
+    struct vma *vma = (struct vma *)tree_find_floor(&pmc->vma_root, va);
+    return (vma && va < vma->end) ? vma : NULL;
+}
+
+struct vma *vma_map(page_map_ctx_t *pmc, uintptr_t start, size_t len, uint64_t prot,
+    struct vfs_vnode *vnode, size_t offset, int flags)
+{
+    if (!len || (start | len | offset) & (PAGE_SIZE - 1))
+        return NULL;
+    if ((flags & VMA_SHARED) && (!vnode || !vnode->v_op->vn_getpage))
+        return NULL;
+
+    struct vma *vma = kmem_cache_alloc(vma_cache);
+    if (!vma)
+        return NULL;
+
+    vma->key = start;
+    vma->end = start + len;
+    vma->prot = prot & (MAF_WRITE | MAF_USER | MAF_NX);
+    vma->vnode = vnode;
+    vma->offset = offset;
+    vma->flags = flags;
+
+    spin_lock_global(&pmc->vma_lock);
+
+    // the area in front may reach into this one, the one behind may start inside it
+    struct vma *prev = (struct vma *)tree_find_floor(&pmc->vma_root, start);
+    struct vma *next = (struct vma *)tree_find_ceil(&pmc->vma_root, start);
+    if ((prev && prev->end > start) || (next && next->key < vma->end)) {
+        spin_unlock_global(&pmc->vma_lock);
+        kmem_cache_free(vma_cache, vma);
+        return NULL;
+    }
+
+    tree_insert(&pmc->vma_root, (struct rb_tree_data *)vma);
+    if (vnode)
+        __atomic_add_fetch(&vnode->v_refc, 1, __ATOMIC_RELAXED);
+
+    spin_unlock_global(&pmc->vma_lock);
+    return vma;
+}
+
+struct vma_writeback {
+    struct vfs_vnode *vnode;
+    uintptr_t start;
+    size_t offset;
+};
+
+static void _vma_writeback_page(void *ctx, uintptr_t va, struct page *frame)
+{
+    struct vma_writeback *wb = ctx;
+    size_t index = (wb->offset + (va - wb->start)) / PAGE_SIZE;
+
+    if (wb->vnode->v_op->vn_putpage && wb->vnode->v_op->vn_putpage(wb->vnode, index, frame) != VFS_FS_OP_STATUS_OK)
+        kprintf("  - vma: couldn't write back page %lu of vnode 0x%p\n", index, wb->vnode);
+}
+
+static void _vma_release(page_map_ctx_t *pmc, struct vma *vma)
+{
+    if (vma->flags & VMA_SHARED) {
+        struct vma_writeback wb = { .vnode = vma->vnode, .start = vma->key, .offset = vma->offset };
+        mmu_clean_range(pmc, vma->key, vma->end - vma->key, _vma_writeback_page, &wb);
+    }
+
+    // anonymous frames and private copies get freed, page cache frames just lose a reference
+    mmu_unmap_range(pmc, vma->key, vma->end - vma->key, true);
+
+    if (vma->vnode)
+        __atomic_sub_fetch(&vma->vnode->v_refc, 1, __ATOMIC_RELAXED);
+    kmem_cache_free(vma_cache, vma);
+}
+
+bool vma_unmap(page_map_ctx_t *pmc, uintptr_t start)
+{
+    spin_lock_global(&pmc->vma_lock);
+    struct vma *vma = (struct vma *)tree_remove(&pmc->vma_root, start);
+    if (vma)
+        pmc->vma_seq++;
+    spin_unlock_global(&pmc->vma_lock);
+
+    // the lock isn't held during the shootdown
+    if (vma)
+        _vma_release(pmc, vma);
+    return vma;
+}
+
+void vma_unmap_all(page_map_ctx_t *pmc)
+{
+    for (;;) {
+        spin_lock_global(&pmc->vma_lock);
+        struct vma *vma = pmc->vma_root != RB_NIL
+            ? (struct vma *)tree_remove(&pmc->vma_root, pmc->vma_root->data->key) : NULL;
+        if (vma)
+            pmc->vma_seq++;
+        spin_unlock_global(&pmc->vma_lock);
+
+        if (!vma)
+            break;
+        _vma_release(pmc, vma);
+    }
+}
+
+bool vma_sync(page_map_ctx_t *pmc, uintptr_t start)
+{
+    spin_lock_global(&pmc->vma_lock);
+    struct vma *vma = (struct vma *)tree_find(&pmc->vma_root, start);
+    if (!vma || !(vma->flags & VMA_SHARED)) {
+        spin_unlock_global(&pmc->vma_lock);
+        return false;
+    }
+
+    // the area may go away during the writeback, the vnode may not
+    struct vma_writeback wb = { .vnode = vma->vnode, .start = vma->key, .offset = vma->offset };
+    size_t len = vma->end - vma->key;
+    __atomic_add_fetch(&wb.vnode->v_refc, 1, __ATOMIC_RELAXED);
+    spin_unlock_global(&pmc->vma_lock);
+
+    mmu_clean_range(pmc, start, len, _vma_writeback_page, &wb);
+
+    __atomic_sub_fetch(&wb.vnode->v_refc, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+page_map_ctx_t *vma_fork(page_map_ctx_t *src)
+{
+    page_map_ctx_t *dst = mmu_pmc_create();
+    if (!dst)
+        return NULL;
+
+    uintptr_t shared_start = UINTPTR_MAX, shared_end = 0;
+    struct vma **copies = NULL;
+    size_t count, allocated = 0, i;
+    bool failed = false;
+
+    // faults in src wait until every area is shared, nothing is populated behind our back.
+    // with the lock held nothing may be allocated (reclaim could need it), so the copies
+    // are made up front, until there are enough of them
+    for (;;) {
+        spin_lock_global(&src->vma_lock);
+        count = 0;
+        for (struct vma *vma = (struct vma *)tree_find_ceil(&src->vma_root, 0); vma;
+            vma = (struct vma *)tree_find_ceil(&src->vma_root, vma->end))
+            count++;
+        if (count <= allocated)
+            break;
+        spin_unlock_global(&src->vma_lock);
+
+        struct vma **grown = krealloc(copies, count * sizeof(struct vma *));
+        if (!grown)
+            goto fail;
+        copies = grown;
+        for (; allocated < count; allocated++)
+            if (!(copies[allocated] = kmem_cache_alloc(vma_cache)))
+                goto fail;
+    }
+
+    // the areas shared so far go into dst even on failure, releasing them unwinds it
+    i = 0;
+    for (struct vma *vma = (struct vma *)tree_find_ceil(&src->vma_root, 0); vma && !failed;
+        vma = (struct vma *)tree_find_ceil(&src->vma_root, vma->end), i++) {
+        *copies[i] = *vma;
+        if (vma->vnode)
+            __atomic_add_fetch(&vma->vnode->v_refc, 1, __ATOMIC_RELAXED);
+
+        failed = !mmu_share_range(dst, src, vma->key, vma->end - vma->key, !(vma->flags & VMA_SHARED));
+        shared_start = MIN(shared_start, vma->key);
+        shared_end = MAX(shared_end, vma->end);
+    }
+    count = i;
+
+    // a collapse of src in flight must not free the frames dst shares now
+    src->vma_seq++;
+    spin_unlock_global(&src->vma_lock);
+
+    // src lost write access to the shared pages, the lock isn't held during the shootdown
+    if (shared_end)
+        tlb_shootdown(src, shared_start, shared_end);
+
+    // dst isn't visible to anyone else yet
+    for (i = 0; i < count; i++)
+        tree_insert(&dst->vma_root, (struct rb_tree_data *)copies[i]);
+    for (; i < allocated; i++)
+        kmem_cache_free(vma_cache, copies[i]);
+    kfree(copies);
+
+    if (failed) {
+        kprintf("  - vma: out of memory forking address space 0x%p\n", src);
+        mmu_pmc_put(dst);
+        return NULL;
+    }
+    return dst;
+
+fail:
+    for (i = 0; i < allocated; i++)
+        kmem_cache_free(vma_cache, copies[i]);
+    kfree(copies);
+    mmu_pmc_put(dst);
+    return NULL;
+}
+
+#ifdef CONFIG_THP
+// back the 2mib range at hva by a huge page, if there's no page table for it yet
+static bool _thp_fault(page_map_ctx_t *pmc, uintptr_t hva, uint64_t flags, size_t seq)
+{
+    // the walk stops above the pts
+    int depth;
+    size_t idx;
+    if (mmu_walk_table(pmc, hva, &depth, &idx) || depth > 2)
+        return false;
+
+    struct page *huge = page_calloc(PAGES_512_ORDER);
+    if (!huge)
+        return false;
+
+    // without memory for the tables, the 4kib path fails the same way
+    spin_lock(&pmc->vma_lock);
+    bool mapped = pmc->vma_seq == seq
+        && mmu_try_map_single_page_2m(pmc, hva, page2phys(huge), flags) == MMU_TRY_MAP_OK;
+    spin_unlock(&pmc->vma_lock);
+
+    if (!mapped)
+        page_free(huge, PAGES_512_ORDER);
+    return mapped;
+}
+
+// collapse the page table at va into huge, true if huge is in use now
+static bool _thp_collapse(page_map_ctx_t *pmc, uintptr_t va, size_t seq, uint64_t *ptes, struct page *huge)
+{
+    if (!mmu_collapse_begin(pmc, va, ptes, THP_COLLAPSE_MIN_PAGES))
+        return false;
+
+    // from here on writes fault, and the pages can be copied
+    tlb_shootdown(pmc, va, va + HUGE_PAGE_2M);
+
+    uint8_t *dst = (uint8_t *)(page2phys(huge) + hhdm->offset);
+    for (size_t i = 0; i < 512; i++) {
+        if (ptes[i] & PM_COMMON_PRESENT)
+            memcpy(dst + i * PAGE_SIZE, (void *)((ptes[i] & PT_PHYS_MASK) + hhdm->offset), PAGE_SIZE);
+        else
+            memset(dst + i * PAGE_SIZE, 0, PAGE_SIZE);
+    }
+
+    // an area that went away may have been replaced by another one
+    spin_lock_global(&pmc->vma_lock);
+    struct page *table = mmu_collapse_end(pmc, va, ptes, huge, pmc->vma_seq == seq);
+    spin_unlock_global(&pmc->vma_lock);
+
+    if (!table)
+        return false;
+
+    tlb_shootdown(pmc, va, va + HUGE_PAGE_2M);
+    for (size_t i = 0; i < 512; i++) {
+        if (!(ptes[i] & PM_COMMON_PRESENT))
+            continue;
+        // drops the owner's reference of a frame that was shared once
+        struct page *frame = phys2page(ptes[i] & PT_PHYS_MASK);
+        if (page_put(frame))
+            page_free(frame, PAGES_1_ORDER);
+    }
+    page_free(table, PAGES_1_ORDER);
+    return true;
+}
+
+// collapse the anonymous areas of pmc, until budget huge pages were used. *huge is a
+// spare huge page, NULL once it got used
+static void _thp_scan(page_map_ctx_t *pmc, uint64_t *ptes, struct page **huge, size_t *budget)
+{
+    for (uintptr_t next = 0; *budget; ) {
+        spin_lock_global(&pmc->vma_lock);
+        struct vma *vma = (struct vma *)tree_find_ceil(&pmc->vma_root, next);
+        if (!vma) {
+            spin_unlock_global(&pmc->vma_lock);
+            return;
+        }
+        uintptr_t start = ALIGN_UP(vma->key, HUGE_PAGE_2M), end = ALIGN_DOWN(vma->end, HUGE_PAGE_2M);
+        bool anon = !vma->vnode;
+        size_t seq = pmc->vma_seq;
+        next = vma->end;
+        spin_unlock_global(&pmc->vma_lock);
+
+        for (uintptr_t va = start; anon && va < end && *budget; va += HUGE_PAGE_2M) {
+            if (!*huge && !(*huge = page_alloc(PAGES_512_ORDER))) {
+                *budget = 0;
+                return;
+            }
+            if (_thp_collapse(pmc, va, seq, ptes, *huge)) {
+                *huge = NULL;
+                (*budget)--;
+            }
+        }
+    }
+}
+
+static void _thp_collapse_thread(void *arg)
+{
+    (void)arg;
+
+    preempt_enable();
+
+    uint64_t *ptes = kmalloc(512 * sizeof(uint64_t));
+    if (!ptes)
+        kpanic(0, NULL, "couldn't allocate the thp collapse buffer\n");
+
+    for (;;) {
+        struct page *huge = NULL;
+        size_t budget = THP_COLLAPSE_BATCH;
+
+        _thp_scan(&kernel_pmc, ptes, &huge, &budget);
+        for (page_map_ctx_t *pmc = mmu_pmc_next(NULL); pmc; pmc = mmu_pmc_next(pmc))
+            _thp_scan(pmc, ptes, &huge, &budget);
+
+        if (huge)
+            page_free(huge, PAGES_512_ORDER);
+        if (budget < THP_COLLAPSE_BATCH)
+            kprintf_verbose("  - thp: collapsed %lu huge pages\n", THP_COLLAPSE_BATCH - budget);
+
+        scheduler_sleep_for(THP_COLLAPSE_INTERVAL_MS);
+    }
+
+    unreachable();
+}
+#endif // CONFIG_THP
+
+void vma_thp_init(void)
+{
+#ifdef CONFIG_THP
+    scheduler_new_kernel_thread(_thp_collapse_thread, NULL, TASK_PRIORITY_LOW);
+#endif
+}
+
+// read the file page at offset into frame, the part behind the end of the file is zeroed
+static bool _read_file_page(struct vfs_vnode *vnode, size_t offset, struct page *frame)
+{
+    uint8_t *buf = (uint8_t *)(page2phys(frame) + hhdm->offset);
+    struct vfs_uio uio = {
+        .uio = UIO_READ,
+        .uio_buf = buf,
+        .uio_offset = offset,
+        .uio_resid = PAGE_SIZE
+    };
+
+    if (vnode->v_op->vn_rdwr(vnode, &uio, 0) != VFS_FS_OP_STATUS_OK)
+        return false;
+
+    memset(buf + PAGE_SIZE - uio.uio_resid, 0, uio.uio_resid);
+    return true;
+}
+
+bool vma_handle_fault(cpu_ctx_t *regs)
+{
+    uintptr_t addr = regs->cr2;
+    uint64_t error = regs->error_code;
+
+    page_map_ctx_t *pmc = &kernel_pmc;
+    if (addr < 0xffff800000000000ul && smp_initialized && get_this_cpu()->curr_thread)
+        pmc = get_this_cpu()->curr_thread->pmc;
+
+    spin_lock(&pmc->vma_lock);
+
+    struct vma *vma = vma_find(pmc, addr);
+    if (!vma || ((error & PF_ERR_WRITE) && !(vma->prot & MAF_WRITE))
+        || ((error & PF_ERR_USER) && !(vma->prot & MAF_USER))
+        || ((error & PF_ERR_FETCH) && (vma->prot & MAF_NX))) {
+        spin_unlock(&pmc->vma_lock);
+        return false;
+    }
+
+    // of the protection violations on present pages only writes to cow pages are ours
+    if (error & PF_ERR_PRESENT) {
+        spin_unlock(&pmc->vma_lock);
+        return (error & PF_ERR_WRITE) && mmu_cow_fault(pmc, addr);
+    }
+
+    uintptr_t va = ALIGN_DOWN(addr, PAGE_SIZE);
+    uint64_t flags = PM_COMMON_PRESENT | vma->prot;
+    struct vfs_vnode *vnode = vma->vnode;
+    size_t offset = vma->offset + (va - vma->key);
+    size_t seq = pmc->vma_seq;
+    bool shared = vma->flags & VMA_SHARED;
+    uintptr_t hva = ALIGN_DOWN(va, HUGE_PAGE_2M);
+    bool huge_fits = !vnode && hva >= vma->key && hva + HUGE_PAGE_2M <= vma->end;
+
+    spin_unlock(&pmc->vma_lock);
+
+#ifdef CONFIG_THP
+    if (huge_fits && _thp_fault(pmc, hva, flags, seq))
+        return true;
+#else
+    (void)huge_fits;
+#endif
+
+    struct page *frame;
+    if (vnode && vnode->v_op->vn_getpage) {
+        // map the cache frame itself, private areas copy it on the first write
+        if (vnode->v_op->vn_getpage(vnode, offset / PAGE_SIZE, &frame) != VFS_FS_OP_STATUS_OK)
+            return false;
+        if (!shared && (flags & PM_COMMON_WRITE))
+            flags = (flags & ~PM_COMMON_WRITE) | PT_COW;
+    } else if (vnode) {
+        frame = page_alloc(PAGES_1_ORDER);
+        if (frame && !_read_file_page(vnode, offset, frame)) {
+            page_free(frame, PAGES_1_ORDER);
+            return false;
+        }
+    } else {
+        frame = page_calloc(PAGES_1_ORDER);
+    }
+
+    if (!frame) {
+        kprintf("  - vma: out of memory populating 0x%p\n", va);
+        return false;
+    }
+
+    // another cpu may have been faster, or the area is gone by now
+    spin_lock(&pmc->vma_lock);
+    int status = pmc->vma_seq == seq
+        ? mmu_try_map_single_page_4k(pmc, va, page2phys(frame), flags) : MMU_TRY_MAP_BUSY;
+    spin_unlock(&pmc->vma_lock);
+
+    if (status != MMU_TRY_MAP_OK && page_put(frame))
+        page_free(frame, PAGES_1_ORDER);
+
+    if (status == MMU_TRY_MAP_NOMEM) {
+        kprintf("  - vma: out of memory populating 0x%p\n", va);
+        return false;
+    }
+
+    // retry the access
+    return true;
+}
@@ -0,0 +1,167 @@
+/*
+ * vmalloc: big kernel allocations, that don't need to be physically contiguous.
+ * Every area gets a range of VMALLOC_START - VMALLOC_END out of the vmalloc vmem arena
+ * (followed by an unmapped guard page), and is backed by order 0 frames mapped one by
+ * one. So a 1.1 MiB table costs 282 pages instead of an order 9 block, and still works
+ * when the buddy allocator has no big blocks left.
+ * Areas are kept in a rbtree keyed by their start for vfree().
+*/
+
+#include "vmalloc.h"
+#include "frame_alloc.h"
+#include "interrupt.h"
+#include "kfence.h"
+#include "kheap.h"
+#include "kprintf.h"
+#include "locking.h"
+#include "macros.h"
+#include "memory.h"
+#include "mmu.h"
+#include "rbtree.h"
+#include "vmem.h"
+
+struct vmalloc_area {
+    size_t key;                         // start address, has to come first (struct rb_tree_data)
+    size_t pages;                       // mapped pages, without the guard page
+};
+
+static struct slab_cache *vmalloc_area_cache;
+static struct vmem_arena *vmalloc_arena;
+
+static rb_tree_node_t *vmalloc_tree;
+static k_spinlock_t vmalloc_lock;
+
+void vmalloc_init(void)
+{
+    vmalloc_area_cache = kmem_cache_create("vmalloc_area", sizeof(struct vmalloc_area), 8, NULL);
+    if (!vmalloc_area_cache)
+        kpanic(0, NULL, "couldn't create vmalloc area cache\n");
+
+    // small areas (with their guard page) come from the quantum caches
+    vmalloc_arena = vmem_create("vmalloc", VMALLOC_START, VMALLOC_END - VMALLOC_START,
+        PAGE_SIZE, VMEM_QCACHE_MAX * PAGE_SIZE);
+    if (!vmalloc_arena)
+        kpanic(0, NULL, "couldn't create vmalloc arena\n");
+
+    init_root_node(&vmalloc_tree);
+}
+
+// pages + a guard page of va. NULL if the range is exhausted
+static struct vmalloc_area *_reserve_area(size_t pages)
+{
+    struct vmalloc_area *area = kmem_cache_alloc(vmalloc_area_cache);
+    if (!area)
+        return NULL;
+
+    area->key = vmem_alloc(vmalloc_arena, (pages + 1) * PAGE_SIZE, VMEM_INSTANTFIT);
+    if (!area->key) {
+        kmem_cache_free(vmalloc_area_cache, area);
+        return NULL;
+    }
+    area->pages = pages;
+
+    spin_lock_global(&vmalloc_lock);
+    tree_insert(&vmalloc_tree, (struct rb_tree_data *)area);
+    spin_unlock_global(&vmalloc_lock);
+
+    return area;
+}
+
+static void _release_area(struct vmalloc_area *area)
+{
+    spin_lock_global(&vmalloc_lock);
+    tree_remove(&vmalloc_tree, area->key);
+    spin_unlock_global(&vmalloc_lock);
+
+    vmem_free(vmalloc_arena, area->key, (area->pages + 1) * PAGE_SIZE);
+    kmem_cache_free(vmalloc_area_cache, area);
+}
+
+// unmap and free the first mapped pages of area
+static void _unmap_area(struct vmalloc_area *area, size_t mapped)
+{
+    mmu_unmap_range(&kernel_pmc, area->key, mapped * PAGE_SIZE, true);
+}
+
+void *vmalloc(size_t size)
+{
+    if (!size)
+        return NULL;
+
+    size_t pages = DIV_ROUNDUP(size, PAGE_SIZE);
+
+    struct vmalloc_area *area = _reserve_area(pages);
+    if (!area) {
+        kprintf("  - vmalloc: no va range left for %lu pages\n", pages);
+        return NULL;
+    }
+
+    // map the frames batch by batch, the buddy lock is taken once per batch
+    struct page *frames[VMALLOC_BULK_BATCH];
+    size_t mapped = 0;
+    while (mapped < pages) {
+        size_t got = page_alloc_bulk(PAGES_1_ORDER, MIN(pages - mapped, VMALLOC_BULK_BATCH), frames);
+        if (!got) {
+            _unmap_area(area, mapped);
+            _release_area(area);
+            return NULL;
+        }
+
+        for (size_t i = 0; i < got; i++, mapped++) {
+            mmu_map_single_page_4k(&kernel_pmc, area->key + mapped * PAGE_SIZE, page2phys(frames[i]),
+                PM_COMMON_PRESENT | PM_COMMON_WRITE | PM_COMMON_NX);
+        }
+    }
+
+    return (void *)area->key;
+}
+
+void *vzalloc(size_t size)
+{
+    void *ret = vmalloc(size);
+    if (ret)
+        memset(ret, 0, size);
+    return ret;
+}
+
+void vfree(void *addr)
+{
+    if (!addr) return;
+
+    spin_lock_global(&vmalloc_lock);
+    struct vmalloc_area *area = (struct vmalloc_area *)tree_find(&vmalloc_tree, (uintptr_t)addr);
+    spin_unlock_global(&vmalloc_lock);
+
+    if (!area)
+        kpanic(0, NULL, "vfree: %p isn't the start of a vmalloc area\n", addr);
+
+    _unmap_area(area, area->pages);
+    _release_area(area);
+}
+
+void *kvmalloc(size_t size)
+{
+    if (size <= KMALLOC_MAX_CACHE_SIZE)
+        return kmalloc(size);
+    return vmalloc(size);
+}
+
+void *kvcalloc(size_t entries, size_t size)
+{
+    if (entries * size <= KMALLOC_MAX_CACHE_SIZE)
+        return kcalloc(entries, size);
+    return vzalloc(entries * size);
+}
+
+void kvfree(void *addr)
+{
+    // the kfence pool lives in the vmalloc range, but its objects come from kmalloc()
+#ifdef CONFIG_KFENCE
+    if (is_vmalloc_addr(addr) && !is_kfence_addr(addr))
+#else
+    if (is_vmalloc_addr(addr))
+#endif
+        vfree(addr);
+    else
+        kfree(addr);
+}
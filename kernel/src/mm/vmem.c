@@ -0,0 +1,446 @@
+/*
+ * vmem: Bonwick style arena allocator for ranges of kernel virtual address space.
+ * An arena consists of spans, that get cut into segments. Every segment has a boundary
+ * tag (struct vmem_seg) in an address sorted list, so a freed range coalesces with its
+ * free neighbours right away and no va gets lost to fragmentation of the bookkeeping.
+ * Free segments sit in power of two freelists with a bitmap in front of them: instant
+ * fit takes the head of the first non empty list above the requested size, which is
+ * guaranteed to fit, in O(1). Allocated segments are found in a hash on free.
+ * Small sizes (up to VMEM_QCACHE_MAX quanta) go through per-cpu quantum caches, which
+ * only take the arena lock to move half of their ranges at once.
+*/
+
+#include "vmem.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "kheap.h"
+#include "kprintf.h"
+#include "macros.h"
+#include "scheduler.h"
+#include "smp.h"
+
+enum vmem_seg_type {
+    VMEM_SEG_SPAN,      // marks the start of a span, keeps spans from coalescing
+    VMEM_SEG_FREE,
+    VMEM_SEG_ALLOC,
+};
+
+struct vmem_seg {
+    uintptr_t start;
+    size_t size;
+    enum vmem_seg_type type;
+    struct vmem_seg *seg_next, *seg_prev;   // all segments of the arena, by address
+    struct vmem_seg *next, *prev;           // freelist, or hash chain (next only)
+};
+
+static struct slab_cache *vmem_seg_cache;
+
+static struct vmem_arena *vmem_arenas;
+static k_spinlock_t vmem_arenas_lock;
+static bool vmem_qcaches_ready;
+
+void vmem_init(void)
+{
+    vmem_seg_cache = kmem_cache_create("vmem_seg", sizeof(struct vmem_seg), 8, NULL);
+    if (!vmem_seg_cache)
+        kpanic(0, NULL, "couldn't create vmem segment cache\n");
+}
+
+static inline size_t _highbit(size_t x)
+{
+    return 63 - __builtin_clzl(x);
+}
+
+// insert seg behind after, at the head if after is NULL
+static void _seg_insert_after(struct vmem_arena *vm, struct vmem_seg *after, struct vmem_seg *seg)
+{
+    seg->seg_prev = after;
+    seg->seg_next = after ? after->seg_next : vm->segs;
+    if (seg->seg_next)
+        seg->seg_next->seg_prev = seg;
+    if (after)
+        after->seg_next = seg;
+    else
+        vm->segs = seg;
+}
+
+static void _seg_remove(struct vmem_arena *vm, struct vmem_seg *seg)
+{
+    if (seg->seg_prev)
+        seg->seg_prev->seg_next = seg->seg_next;
+    else
+        vm->segs = seg->seg_next;
+    if (seg->seg_next)
+        seg->seg_next->seg_prev = seg->seg_prev;
+}
+
+static void _freelist_add(struct vmem_arena *vm, struct vmem_seg *seg)
+{
+    size_t list = _highbit(seg->size);
+
+    seg->prev = NULL;
+    seg->next = vm->freelist[list];
+    if (seg->next)
+        seg->next->prev = seg;
+    vm->freelist[list] = seg;
+    vm->freemap |= 1ull << list;
+}
+
+static void _freelist_del(struct vmem_arena *vm, struct vmem_seg *seg)
+{
+    size_t list = _highbit(seg->size);
+
+    if (seg->prev)
+        seg->prev->next = seg->next;
+    else
+        vm->freelist[list] = seg->next;
+    if (seg->next)
+        seg->next->prev = seg->prev;
+
+    if (!vm->freelist[list])
+        vm->freemap &= ~(1ull << list);
+}
+
+static inline size_t _hash(struct vmem_arena *vm, uintptr_t addr)
+{
+    return ((addr / vm->quantum) * 0x9e3779b97f4a7c15ull) >> (64 - VMEM_HASH_SHIFT);
+}
+
+static void _hash_add(struct vmem_arena *vm, struct vmem_seg *seg)
+{
+    struct vmem_seg **bucket = &vm->hash[_hash(vm, seg->start)];
+    seg->next = *bucket;
+    *bucket = seg;
+}
+
+static struct vmem_seg *_hash_remove(struct vmem_arena *vm, uintptr_t addr)
+{
+    for (struct vmem_seg **link = &vm->hash[_hash(vm, addr)]; *link; link = &(*link)->next) {
+        struct vmem_seg *seg = *link;
+        if (seg->start == addr) {
+            *link = seg->next;
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+// find and cut out size bytes. *spare is used (and set to NULL) for the remainder.
+// 0 if nothing fits. call with vm->lock being held
+static uintptr_t _xalloc_locked(struct vmem_arena *vm, size_t size, int flags, struct vmem_seg **spare)
+{
+    size_t list = _highbit(size);
+    struct vmem_seg *seg = NULL;
+
+    if (!(flags & VMEM_BESTFIT)) {
+        // every segment on a list above the one of size fits
+        size_t first = (size & (size - 1)) ? list + 1 : list;
+        uint64_t map = first < VMEM_FREELISTS ? vm->freemap & ~((1ull << first) - 1) : 0;
+        if (map)
+            seg = vm->freelist[__builtin_ctzl(map)];
+    }
+
+    // best fit, or the instant fit fallback into the list of size itself
+    for (size_t i = list; !seg && i < VMEM_FREELISTS; i++) {
+        if (!(vm->freemap & (1ull << i)))
+            continue;
+        for (struct vmem_seg *s = vm->freelist[i]; s; s = s->next) {
+            if (s->size >= size && (!seg || s->size < seg->size))
+                seg = s;
+        }
+    }
+
+    if (!seg)
+        return 0;
+
+    _freelist_del(vm, seg);
+
+    if (seg->size > size) {
+        struct vmem_seg *rest = *spare;
+        *spare = NULL;
+
+        rest->start = seg->start + size;
+        rest->size = seg->size - size;
+        rest->type = VMEM_SEG_FREE;
+        _seg_insert_after(vm, seg, rest);
+        _freelist_add(vm, rest);
+
+        seg->size = size;
+    }
+
+    seg->type = VMEM_SEG_ALLOC;
+    _hash_add(vm, seg);
+    vm->in_use += size;
+
+    return seg->start;
+}
+
+// give back addr and coalesce it with its free neighbours. the boundary tags that
+// became unused are stored in dead (up to two), returns their count.
+// call with vm->lock being held
+static size_t _xfree_locked(struct vmem_arena *vm, uintptr_t addr, size_t size, struct vmem_seg **dead)
+{
+    struct vmem_seg *seg = _hash_remove(vm, addr);
+    if (!seg || seg->size != size)
+        kpanic(0, NULL, "vmem %s: bad free of 0x%p (%lu bytes)\n", vm->name, addr, size);
+
+    size_t count = 0;
+    vm->in_use -= size;
+    seg->type = VMEM_SEG_FREE;
+
+    // segments of other spans are separated by span markers
+    struct vmem_seg *prev = seg->seg_prev;
+    if (prev && prev->type == VMEM_SEG_FREE) {
+        _freelist_del(vm, prev);
+        prev->size += seg->size;
+        _seg_remove(vm, seg);
+        dead[count++] = seg;
+        seg = prev;
+    }
+
+    struct vmem_seg *next = seg->seg_next;
+    if (next && next->type == VMEM_SEG_FREE) {
+        _freelist_del(vm, next);
+        seg->size += next->size;
+        _seg_remove(vm, next);
+        dead[count++] = next;
+    }
+
+    _freelist_add(vm, seg);
+    return count;
+}
+
+static void _free_segs(struct vmem_seg **segs, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (segs[i])
+            kmem_cache_free(vmem_seg_cache, segs[i]);
+    }
+}
+
+// QUANTUM CACHES
+// ============================================================================
+// Ranges in quantum caches stay allocated in the arena, they only skip its lock.
+
+static inline struct vmem_qcache *_this_qcache(struct vmem_arena *vm, size_t size)
+{
+    return &vm->qcaches[(get_this_cpu() - global_cpus) * VMEM_QCACHE_MAX + size / vm->quantum - 1];
+}
+
+// call with preemption disabled
+static void _qcache_refill(struct vmem_arena *vm, struct vmem_qcache *qc, size_t size, int flags)
+{
+    // boundary tags are allocated up front, the arena lock is held only once
+    struct vmem_seg *spares[VMEM_QCACHE_ROUNDS / 2];
+    size_t count;
+    for (count = 0; count < VMEM_QCACHE_ROUNDS / 2; count++) {
+        if (!(spares[count] = kmem_cache_alloc(vmem_seg_cache)))
+            break;
+    }
+
+    spin_lock(&vm->lock);
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t addr = _xalloc_locked(vm, size, flags, &spares[i]);
+        if (!addr)
+            break;
+        qc->addrs[qc->rounds++] = addr;
+    }
+    spin_unlock(&vm->lock);
+
+    _free_segs(spares, count);
+}
+
+static uintptr_t _qcache_alloc(struct vmem_arena *vm, size_t size, int flags)
+{
+    int_status_t old = preempt_fetch_disable();
+    struct vmem_qcache *qc = _this_qcache(vm, size);
+
+    if (!qc->rounds)
+        _qcache_refill(vm, qc, size, flags);
+
+    uintptr_t addr = qc->rounds ? qc->addrs[--qc->rounds] : 0;
+
+    preempt_restore(old);
+    return addr;
+}
+
+static void _qcache_free(struct vmem_arena *vm, uintptr_t addr, size_t size)
+{
+    struct vmem_seg *dead[VMEM_QCACHE_ROUNDS];
+    size_t dead_count = 0;
+
+    int_status_t old = preempt_fetch_disable();
+    struct vmem_qcache *qc = _this_qcache(vm, size);
+
+    if (qc->rounds == VMEM_QCACHE_ROUNDS) {
+        // give the older half back to the arena
+        spin_lock(&vm->lock);
+        for (size_t i = 0; i < VMEM_QCACHE_ROUNDS / 2; i++)
+            dead_count += _xfree_locked(vm, qc->addrs[i], size, &dead[dead_count]);
+        spin_unlock(&vm->lock);
+
+        for (size_t i = 0; i < VMEM_QCACHE_ROUNDS / 2; i++)
+            qc->addrs[i] = qc->addrs[i + VMEM_QCACHE_ROUNDS / 2];
+        qc->rounds = VMEM_QCACHE_ROUNDS / 2;
+    }
+
+    qc->addrs[qc->rounds++] = addr;
+
+    preempt_restore(old);
+
+    _free_segs(dead, dead_count);
+}
+
+// call with vmem_arenas_lock being held
+static void _enable_qcaches(struct vmem_arena *vm)
+{
+    if (!vm->qcache_max)
+        return;
+
+    struct vmem_qcache *qcaches = kcalloc(smp_cpu_count * VMEM_QCACHE_MAX, sizeof(struct vmem_qcache));
+    if (!qcaches)
+        kpanic(0, NULL, "vmem %s: couldn't allocate quantum caches\n", vm->name);
+
+    // the other cpus may be allocating already
+    __atomic_store_n(&vm->qcaches, qcaches, __ATOMIC_RELEASE);
+}
+
+void vmem_smp_init(void)
+{
+    spin_lock_global(&vmem_arenas_lock);
+
+    for (struct vmem_arena *vm = vmem_arenas; vm; vm = vm->next)
+        _enable_qcaches(vm);
+    vmem_qcaches_ready = true;
+
+    spin_unlock_global(&vmem_arenas_lock);
+
+    kprintf_verbose("  - vmem: per-cpu quantum caches for %lu cpus enabled\n", smp_cpu_count);
+}
+
+// ARENAS
+// ============================================================================
+
+struct vmem_arena *vmem_create(const char *name, uintptr_t base, size_t size, size_t quantum, size_t qcache_max)
+{
+    if (!quantum || (quantum & (quantum - 1)))
+        kpanic(0, NULL, "vmem %s: quantum has to be a power of two\n", name);
+
+    struct vmem_arena *vm = kcalloc(1, sizeof(struct vmem_arena));
+    if (!vm)
+        return NULL;
+
+    vm->name = name;
+    vm->quantum = quantum;
+    vm->qcache_max = MIN(ALIGN_DOWN(qcache_max, quantum), VMEM_QCACHE_MAX * quantum);
+
+    if (size && !vmem_add(vm, base, size)) {
+        kfree(vm);
+        return NULL;
+    }
+
+    spin_lock_global(&vmem_arenas_lock);
+    vm->next = vmem_arenas;
+    vmem_arenas = vm;
+    if (vmem_qcaches_ready)
+        _enable_qcaches(vm);
+    spin_unlock_global(&vmem_arenas_lock);
+
+    kprintf_verbose("  - vmem: arena \"%s\" 0x%p - 0x%p, quantum %lu\n", name, base, base + size, quantum);
+    return vm;
+}
+
+bool vmem_add(struct vmem_arena *vm, uintptr_t base, size_t size)
+{
+    if (!base || !size || (base | size) & (vm->quantum - 1))
+        return false;
+
+    struct vmem_seg *span = kmem_cache_alloc(vmem_seg_cache);
+    struct vmem_seg *seg = kmem_cache_alloc(vmem_seg_cache);
+    if (!span || !seg) {
+        struct vmem_seg *segs[2] = { span, seg };
+        _free_segs(segs, 2);
+        return false;
+    }
+
+    span->start = seg->start = base;
+    span->size = seg->size = size;
+    span->type = VMEM_SEG_SPAN;
+    seg->type = VMEM_SEG_FREE;
+
+    spin_lock_global(&vm->lock);
+
+    // keep the segment list sorted, spans don't overlap
+    struct vmem_seg *after = NULL;
+    for (struct vmem_seg *s = vm->segs; s && s->start < base; s = s->seg_next)
+        after = s;
+
+    _seg_insert_after(vm, after, span);
+    _seg_insert_after(vm, span, seg);
+    _freelist_add(vm, seg);
+    vm->total += size;
+
+    spin_unlock_global(&vm->lock);
+    return true;
+}
+
+uintptr_t vmem_alloc(struct vmem_arena *vm, size_t size, int flags)
+{
+    if (!size)
+        return 0;
+
+    size = ALIGN_UP(size, vm->quantum);
+
+    if (size <= vm->qcache_max && __atomic_load_n(&vm->qcaches, __ATOMIC_ACQUIRE))
+        return _qcache_alloc(vm, size, flags);
+
+    struct vmem_seg *spare = kmem_cache_alloc(vmem_seg_cache);
+    if (!spare)
+        return 0;
+
+    spin_lock_global(&vm->lock);
+    uintptr_t addr = _xalloc_locked(vm, size, flags, &spare);
+    spin_unlock_global(&vm->lock);
+
+    _free_segs(&spare, 1);
+    return addr;
+}
+
+void vmem_free(struct vmem_arena *vm, uintptr_t addr, size_t size)
+{
+    if (!addr)
+        return;
+
+    size = ALIGN_UP(size, vm->quantum);
+
+    if (size <= vm->qcache_max && __atomic_load_n(&vm->qcaches, __ATOMIC_ACQUIRE)) {
+        _qcache_free(vm, addr, size);
+        return;
+    }
+
+    struct vmem_seg *dead[2];
+
+    spin_lock_global(&vm->lock);
+    size_t count = _xfree_locked(vm, addr, size, dead);
+    spin_unlock_global(&vm->lock);
+
+    _free_segs(dead, count);
+}
+
+void vmem_dbg_print(struct vmem_arena *vm)
+{
+    spin_lock_global(&vm->lock);
+
+    size_t free_segs = 0, largest = 0;
+    for (size_t i = 0; i < VMEM_FREELISTS; i++) {
+        for (struct vmem_seg *s = vm->freelist[i]; s; s = s->next) {
+            free_segs++;
+            largest = MAX(largest, s->size);
+        }
+    }
+
+    kprintf("  - vmem %s: %lu KiB, %lu KiB in use, %lu free segments (largest %lu KiB)\n",
+        vm->name, vm->total / 1024, vm->in_use / 1024, free_segs, largest / 1024);
+
+    spin_unlock_global(&vm->lock);
+}
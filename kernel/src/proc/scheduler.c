@@ -10,6 +10,7 @@
 #include "compiler.h"
 #include "time.h"
 #include "kevent.h"
+#include "vma.h"
 
 // the scheduler is based on a prio RR
 //
@@ -28,6 +29,8 @@ struct task *kernel_task = NULL;
 
 static uint64_t scheduler_task_id_counter = 0;
 
+static struct slab_cache *task_cache;
+
 static struct scheduler_runqueue prio_queue[TASK_PRIORITY_MAX_PRIORITIES];
 static struct scheduler_runqueue sleep_queue;
 static struct scheduler_runqueue reap_queue;
@@ -144,6 +147,10 @@ void init_scheduling(void)
 {
     kprintf_verbose("%s starting kernel task and preemption...\n", ansi_progress_string);
 
+    task_cache = kmem_cache_create("task", sizeof(struct task), 64, NULL);
+    if (!task_cache)
+        kpanic(0, NULL, "couldn't create task cache\n");
+
     interrupts_register_vector(INT_VEC_SCHEDULER, (uintptr_t)scheduler_preempt);
     kernel_task = scheduler_spawn_task(NULL, &kernel_pmc, SPAWN_TASK_NO_KERNEL_STACK, 64 * KiB);
 
@@ -159,9 +166,25 @@ void init_scheduling(void)
 // flags (SPAWN_TASK_):
 //  - THREAD_GROUP (inherit gid from parent)
 //  - NO_KERNEL_STACK (for kernel threads for example)
+//  - FORK_PMC (run in a copy-on-write clone of pmc instead of pmc itself)
 struct task *scheduler_spawn_task(struct task *parent_proc, page_map_ctx_t *pmc, uint8_t flags, uint64_t stacksize)
 {
-    struct task *new_task = kcalloc(1, sizeof(struct task));
+    // the clone comes with the reference of the new task. it shoots down, so it can't
+    // happen under the big lock
+    page_map_ctx_t *forked = NULL;
+    if (flags & SPAWN_TASK_FORK_PMC) {
+        forked = vma_fork(pmc);
+        if (!forked)
+            return NULL;
+    }
+
+    struct task *new_task = kmem_cache_alloc(task_cache);
+    if (!new_task) {
+        if (forked)
+            mmu_pmc_put(forked);
+        return NULL;
+    }
+    memset(new_task, 0, sizeof(struct task));
 
     spin_lock_global(&scheduler_big_lock);
 
@@ -218,7 +241,7 @@ struct task *scheduler_spawn_task(struct task *parent_proc, page_map_ctx_t *pmc,
     new_task->rr_next = new_task->rr_prev = NULL;
     runqueue_insert_front(&sleep_queue, new_task);
 
-    new_task->pmc = pmc;
+    new_task->pmc = forked ? forked : mmu_pmc_get(pmc);
 
     spin_unlock_global(&scheduler_big_lock);
     return new_task;
@@ -256,16 +279,17 @@ void scheduler_cleanup_task(struct task *task)
 
     spin_unlock_global(&scheduler_big_lock);
 
-    // threads task is the first to be pushed
-    page_free(phys2page(task->stacks.data[0]), psize2order(task->stack_size));
+    // threads task is the first to be pushed. the reaper most likely runs on
+    // another cpu than the task did, so the stacks aren't cache hot here
+    page_free_cold(phys2page(task->stacks.data[0]), psize2order(task->stack_size));
 
     // clean up all IST and kernel stacks
     for (size_t i = 1; i < task->stacks.size; i++) {
-        page_free(phys2page(task->stacks.data[i]), psize2order(KERNEL_STACK_SIZE));
+        page_free_cold(phys2page(task->stacks.data[i]), psize2order(KERNEL_STACK_SIZE));
     }
 
-    // [TODO] clean up page map context
-    // cleanup(task->pmc);
+    // the last task of an address space frees its page tables
+    mmu_pmc_put(task->pmc);
 }
 
 struct task *scheduler_new_kernel_thread(void (*entry)(void *args), void *args, enum task_priority prio)
@@ -368,6 +392,8 @@ comp_noreturn void switch2task(struct task *target)
     if (target->state != TASK_STATE_READY || preempt_fetch())
         kpanic(0, NULL, "cannot switch to non-ready task");
 
+    // publish it first, so shootdowns don't miss this cpu
+    __atomic_store_n(&get_this_cpu()->active_pml4, target->pmc->pml4_address, __ATOMIC_SEQ_CST);
     mmu_set_ctx(target->pmc);
     get_this_cpu()->tss.rsp0 = (uint64_t)target->kernel_stack;
 
@@ -11,7 +11,8 @@
  * preempt_restore(): set IF = old_status
  *
  * spin_(un)lock(): takes/releases lock
- * spin_(un)lock_global(): disables/restores preemption, takes/releases lock */
+ * spin_(un)lock_global(): disables/restores preemption, takes/releases lock
+ * spin_trylock(): takes lock if it's free, doesn't touch preemption */
 
 inline void preempt_disable(void) {
     __asm__ volatile ("cli" : : :);
@@ -70,6 +71,11 @@ void spin_unlock_global(k_spinlock_t *lock) {
     preempt_restore(lock->old_state);
 }
 
+// return 0 if the lock is taken already
+bool spin_trylock(k_spinlock_t *lock) {
+    return !__atomic_test_and_set(&lock->lock, __ATOMIC_ACQUIRE);
+}
+
 // return 0 on timeout
 bool spin_lock_timeout(k_spinlock_t *lock, size_t millis) {
     // 1000 hz
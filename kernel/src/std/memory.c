@@ -1,10 +1,26 @@
 #include "memory.h"
 #include "compiler.h"
 
-// these are completeky unoptimized, maybe its a nice idea to include
-// hand optimized per arch versions (non sse)?
+// memcpy and memset use rep movs / rep stos on x86-64: the kernel is built without
+// sse, and with fast strings (ERMSB) those are as good as it gets for bigger copies.
+// qwords first, then the tail bytes, so the byte variant never runs for long
 
 void *memcpy(void *dest, const void *src, size_t n) {
+#if defined(__x86_64__)
+    void *ret = dest;
+    size_t qwords = n >> 3, bytes = n & 7;
+
+    __asm__ volatile (
+        "rep movsq\n"
+        : "+D" (dest), "+S" (src), "+c" (qwords) : : "memory"
+    );
+    __asm__ volatile (
+        "rep movsb\n"
+        : "+D" (dest), "+S" (src), "+c" (bytes) : : "memory"
+    );
+
+    return ret;
+#else
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
 
@@ -13,9 +29,26 @@ void *memcpy(void *dest, const void *src, size_t n) {
     }
 
     return dest;
+#endif
 }
 
 void *memset(void *s, int c, size_t n) {
+#if defined(__x86_64__)
+    void *ret = s;
+    size_t qwords = n >> 3, bytes = n & 7;
+    uint64_t pattern = (uint8_t)c * 0x0101010101010101ull;
+
+    __asm__ volatile (
+        "rep stosq\n"
+        : "+D" (s), "+c" (qwords) : "a" (pattern) : "memory"
+    );
+    __asm__ volatile (
+        "rep stosb\n"
+        : "+D" (s), "+c" (bytes) : "a" (pattern) : "memory"
+    );
+
+    return ret;
+#else
     uint8_t *p = (uint8_t *)s;
 
     for (size_t i = 0; i < n; i++) {
@@ -23,6 +56,7 @@ void *memset(void *s, int c, size_t n) {
     }
 
     return s;
+#endif
 }
 
 void *memmove(void *dest, const void *src, size_t n) {
@@ -221,6 +221,31 @@ struct rb_tree_data *tree_find(rb_tree_node_t **root, size_t key)
     return ret ? ret->data : NULL;
 }
 
+// smaller keys are stored in the right subtrees (see tree_insert())
+struct rb_tree_data *tree_find_floor(rb_tree_node_t **root, size_t key)
+{
+    struct rb_tree_data *best = NULL;
+    for (rb_tree_node_t *node = *root; node != RB_NIL; node = node->child[key < node->data->key]) {
+        if (node->data->key == key)
+            return node->data;
+        if (node->data->key < key)
+            best = node->data;
+    }
+    return best;
+}
+
+struct rb_tree_data *tree_find_ceil(rb_tree_node_t **root, size_t key)
+{
+    struct rb_tree_data *best = NULL;
+    for (rb_tree_node_t *node = *root; node != RB_NIL; node = node->child[key < node->data->key]) {
+        if (node->data->key == key)
+            return node->data;
+        if (node->data->key > key)
+            best = node->data;
+    }
+    return best;
+}
+
 void tree_set_data_at(rb_tree_node_t **root, size_t key, struct rb_tree_data *data)
 {
     rb_tree_node_t *found = _find_node(*root, key);